@@ -0,0 +1,402 @@
+// Download throughput of one file served to many connections, by each way
+// the server can send it, against a swss server forked off on loopback. Every
+// connection asks for the file, reads it whole and asks again. Reports
+// payload bytes received per second and the server's peak resident memory.
+//
+// Methods:
+//   copy    read into a fresh buffer for each request and sent with ws_send_bin
+//   file    ws_send_file, straight from the page cache
+//   region  one ws_region_map of the file, shared by every send
+//
+// usage: file_bench [-z copy|file|region] [-c connections] [-s file_size]
+//                   [-d seconds] [-T server_threads] [-b epoll|uring] [-p port]
+#include "../include/stats.h"
+#include "../include/swss.h"
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+
+enum bench_method
+{
+    BENCH_COPY,
+    BENCH_FILE,
+    BENCH_REGION,
+};
+
+// Where a connection is in the frames coming back: header bytes collected so
+// far, then payload bytes still to skip.
+struct bench_conn
+{
+    int fd;
+    u_int8_t header[10];
+    size_t have;
+    u_int64_t skip;
+};
+
+static int g_method = BENCH_FILE;
+static int g_conns = 32;
+static size_t g_size = 1 << 20;
+static double g_seconds = 3;
+static int g_server_threads = 1;
+static int g_uring;
+static const char *g_port = "9300";
+
+static int g_file = -1;
+static ws_region_t *g_region;
+static struct sockaddr_in g_addr;
+
+static void on_open(ws_conn_t conn) { (void)conn; }
+
+static void on_message(ws_conn_t conn, int text, const char *message, size_t length)
+{
+    (void)text;
+    (void)message;
+    (void)length;
+    if (g_method == BENCH_FILE)
+    {
+        ws_send_file(conn, g_file, 0, g_size);
+    }
+    else if (g_method == BENCH_REGION)
+    {
+        ws_send_region(conn, g_region, 0, g_size);
+    }
+    else
+    {
+        u_int8_t *buf = malloc(g_size);
+        if (buf && pread(g_file, buf, g_size, 0) == (ssize_t)g_size)
+        {
+            ws_send_bin(conn, buf, g_size);
+        }
+        free(buf);
+    }
+}
+
+static void on_close(ws_conn_t conn) { (void)conn; }
+static void on_error(ws_conn_t conn, int error_code)
+{
+    (void)conn;
+    (void)error_code;
+}
+
+static void run_server(void)
+{
+    static ws_callbacks_t callbacks = {
+        .on_open = on_open,
+        .on_message = on_message,
+        .on_close = on_close,
+        .on_error = on_error,
+    };
+    ws_init(&callbacks);
+    if (g_method == BENCH_REGION && !(g_region = ws_region_map(g_file, 0, g_size)))
+    {
+        exit(1);
+    }
+
+    ws_listen_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.threads = g_server_threads;
+    opts.backend = g_uring ? WS_BACKEND_URING : WS_BACKEND_EPOLL;
+    // one whole file per connection may be waiting for the socket
+    opts.send_high_water = g_size + 64;
+    ws_listen_opts(g_port, &opts);
+    exit(1);
+}
+
+static long read_hwm(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        return 0;
+    }
+    char line[256];
+    long hwm = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        sscanf(line, "VmHWM: %ld", &hwm);
+    }
+    fclose(f);
+    return hwm;
+}
+
+static int bench_connect(void)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    if (connect(fd, (const struct sockaddr *)&g_addr, sizeof(g_addr)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Blocking upgrade; the server sends nothing else until spoken to.
+static int bench_handshake(int fd)
+{
+    static const char request[] = "GET / HTTP/1.1\r\n"
+                                  "Host: localhost\r\n"
+                                  "Upgrade: websocket\r\n"
+                                  "Connection: Upgrade\r\n"
+                                  "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                                  "Sec-WebSocket-Version: 13\r\n"
+                                  "\r\n";
+    if (send(fd, request, sizeof(request) - 1, MSG_NOSIGNAL) != (ssize_t)sizeof(request) - 1)
+    {
+        return -1;
+    }
+    char buf[512];
+    size_t have = 0;
+    while (have < sizeof(buf) - 1)
+    {
+        ssize_t n = recv(fd, buf + have, sizeof(buf) - 1 - have, 0);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        have += n;
+        buf[have] = '\0';
+        if (strstr(buf, "\r\n\r\n"))
+        {
+            return strstr(buf, " 101 ") ? 0 : -1;
+        }
+    }
+    return -1;
+}
+
+// A one-byte binary request, masked with a zero key.
+static int send_request(int fd)
+{
+    static const u_int8_t request[] = {0x82, 0x81, 0, 0, 0, 0, 'f'};
+    return send(fd, request, sizeof(request), MSG_NOSIGNAL) == sizeof(request) ? 0 : -1;
+}
+
+// Steps c over n received bytes, counting payload into *bytes.
+// returns the number of files completed, or -1 if the server closed
+static int consume(struct bench_conn *c, const u_int8_t *data, size_t n, u_int64_t *bytes)
+{
+    int files = 0;
+    while (n > 0)
+    {
+        if (c->skip > 0)
+        {
+            size_t take = n < c->skip ? n : c->skip;
+            c->skip -= take;
+            *bytes += take;
+            data += take;
+            n -= take;
+            if (c->skip == 0)
+            {
+                files++;
+            }
+            continue;
+        }
+
+        c->header[c->have++] = *data++;
+        n--;
+        if (c->have < 2)
+        {
+            continue;
+        }
+        u_int8_t len7 = c->header[1] & 0x7F;
+        size_t need = len7 == 127 ? 10 : (len7 == 126 ? 4 : 2);
+        if (c->have < need)
+        {
+            continue;
+        }
+        if ((c->header[0] & 0x0F) == 0x8)
+        {
+            return -1;
+        }
+        u_int64_t len = len7;
+        if (len7 >= 126)
+        {
+            len = 0;
+            for (size_t b = 2; b < need; b++)
+            {
+                len = (len << 8) | c->header[b];
+            }
+        }
+        c->have = 0;
+        c->skip = len;
+        if (len == 0)
+        {
+            files++;
+        }
+    }
+    return files;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-z copy|file|region] [-c connections] [-s file_size] [-d seconds]\n"
+            "       [-T server_threads] [-b epoll|uring] [-p port]\n",
+            name);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "z:c:s:d:T:b:p:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'z':
+            g_method = strcmp(optarg, "copy") == 0     ? BENCH_COPY
+                       : strcmp(optarg, "region") == 0 ? BENCH_REGION
+                                                       : BENCH_FILE;
+            break;
+        case 'c':
+            g_conns = atoi(optarg);
+            break;
+        case 's':
+            g_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            g_seconds = atof(optarg);
+            break;
+        case 'T':
+            g_server_threads = atoi(optarg);
+            break;
+        case 'b':
+            g_uring = strcmp(optarg, "uring") == 0;
+            break;
+        case 'p':
+            g_port = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (g_conns < 1 || g_size < 1)
+    {
+        usage(argv[0]);
+    }
+
+    // the file, in the page cache before the server starts
+    char path[] = "/tmp/file_bench.XXXXXX";
+    g_file = mkstemp(path);
+    if (g_file == -1)
+    {
+        perror("mkstemp");
+        return 1;
+    }
+    unlink(path);
+    u_int8_t chunk[65536];
+    memset(chunk, 'x', sizeof(chunk));
+    for (size_t off = 0; off < g_size; off += sizeof(chunk))
+    {
+        size_t n = g_size - off < sizeof(chunk) ? g_size - off : sizeof(chunk);
+        if (pwrite(g_file, chunk, n, off) != (ssize_t)n)
+        {
+            perror("pwrite");
+            return 1;
+        }
+    }
+
+    pid_t server = fork();
+    if (server == 0)
+    {
+        run_server();
+    }
+    if (server == -1)
+    {
+        perror("fork");
+        return 1;
+    }
+
+    memset(&g_addr, 0, sizeof(g_addr));
+    g_addr.sin_family = AF_INET;
+    g_addr.sin_port = htons(atoi(g_port));
+    g_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int probe = -1;
+    for (int tries = 0; tries < 100 && probe == -1; tries++)
+    {
+        usleep(50000);
+        probe = bench_connect();
+    }
+    if (probe == -1)
+    {
+        fprintf(stderr, "server did not come up on port %s\n", g_port);
+        kill(server, SIGKILL);
+        return 1;
+    }
+    close(probe);
+
+    int epfd = epoll_create1(0);
+    struct bench_conn *conns = calloc(g_conns, sizeof(struct bench_conn));
+    for (int i = 0; i < g_conns; i++)
+    {
+        conns[i].fd = bench_connect();
+        if (conns[i].fd == -1 || bench_handshake(conns[i].fd) == -1)
+        {
+            fprintf(stderr, "connection %d failed\n", i);
+            kill(server, SIGKILL);
+            return 1;
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &conns[i];
+        epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].fd, &ev);
+    }
+
+    long hwm_idle = read_hwm(server);
+    u_int64_t start = ws_now_ns();
+    u_int64_t deadline = start + (u_int64_t)(g_seconds * 1e9);
+    u_int64_t bytes = 0, files = 0;
+    int failed = 0;
+    for (int i = 0; i < g_conns; i++)
+    {
+        failed |= send_request(conns[i].fd);
+    }
+
+    static u_int8_t buf[1 << 20];
+    struct epoll_event events[64];
+    while (!failed && ws_now_ns() < deadline)
+    {
+        int n = epoll_wait(epfd, events, 64, 10);
+        for (int i = 0; i < n && !failed; i++)
+        {
+            struct bench_conn *c = events[i].data.ptr;
+            ssize_t got = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (got == 0 || (got == -1 && errno != EAGAIN))
+            {
+                failed = 1;
+                break;
+            }
+            int done = got > 0 ? consume(c, buf, got, &bytes) : 0;
+            if (done == -1)
+            {
+                failed = 1;
+            }
+            for (int f = 0; f < done && !failed; f++)
+            {
+                files++;
+                failed |= send_request(c->fd);
+            }
+        }
+    }
+    double elapsed = (ws_now_ns() - start) / 1e9;
+    long hwm = read_hwm(server);
+    kill(server, SIGKILL);
+    waitpid(server, NULL, 0);
+
+    static const char *methods[] = {"copy", "file", "region"};
+    printf("%s: %d connections, %zu B file, %d %s reactor%s\n", methods[g_method], g_conns, g_size,
+           g_server_threads, g_uring ? "io_uring" : "epoll", g_server_threads > 1 ? "s" : "");
+    if (failed)
+    {
+        printf("  a connection failed\n");
+        return 1;
+    }
+    printf("  %8.0f files/s %9.1f MB/s   server peak RSS %.1f MiB (%.1f MiB before the load)\n", files / elapsed,
+           bytes / elapsed / 1e6, hwm / 1024.0, hwm_idle / 1024.0);
+    return 0;
+}
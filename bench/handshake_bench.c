@@ -0,0 +1,166 @@
+// Upgrade handshakes per second against an in-process server on loopback.
+// Each client thread connects, sends a request with a long cookie, checks the
+// 101 response and resets the connection, as in a reconnect storm.
+// usage: handshake_bench [client_threads] [seconds] [server_threads] [port] [epoll|uring]
+#include "../include/swss.h"
+#include <netinet/tcp.h>
+#include <stdatomic.h>
+#include <time.h>
+
+static const char *g_port;
+static double g_deadline;
+static atomic_long g_done;
+static atomic_long g_failed;
+
+static char g_request[4096];
+static size_t g_request_len;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void on_open(ws_conn_t conn) { (void)conn; }
+static void on_message(ws_conn_t conn, int text, const char *message, size_t length)
+{
+    (void)conn;
+    (void)text;
+    (void)message;
+    (void)length;
+}
+static void on_close(ws_conn_t conn) { (void)conn; }
+static void on_error(ws_conn_t conn, int error_code)
+{
+    (void)conn;
+    (void)error_code;
+}
+
+static void *server_thread(void *arg)
+{
+    ws_listen_opts(g_port, arg);
+    return NULL;
+}
+
+static int handshake_once(const struct sockaddr_in *addr)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    int ok = -1;
+    if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) == 0 &&
+        send(fd, g_request, g_request_len, MSG_NOSIGNAL) == (ssize_t)g_request_len)
+    {
+        char buf[512];
+        size_t have = 0;
+        while (have < sizeof(buf) - 1)
+        {
+            ssize_t n = recv(fd, buf + have, sizeof(buf) - 1 - have, 0);
+            if (n <= 0)
+            {
+                break;
+            }
+            have += n;
+            buf[have] = '\0';
+            if (strstr(buf, "\r\n\r\n"))
+            {
+                // accept token for the fixed key in the request
+                ok = strstr(buf, " 101 ") && strstr(buf, "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=") ? 0 : -1;
+                break;
+            }
+        }
+    }
+
+    // reset rather than close so the client side leaves no TIME_WAIT behind
+    struct linger lg = {.l_onoff = 1, .l_linger = 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    close(fd);
+    return ok;
+}
+
+static void *client_thread(void *arg)
+{
+    const struct sockaddr_in *addr = arg;
+    long done = 0, failed = 0;
+    while (now_sec() < g_deadline)
+    {
+        if (handshake_once(addr) == 0)
+        {
+            done++;
+        }
+        else
+        {
+            failed++;
+        }
+    }
+    atomic_fetch_add(&g_done, done);
+    atomic_fetch_add(&g_failed, failed);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int clients = argc > 1 ? atoi(argv[1]) : 4;
+    double seconds = argc > 2 ? atof(argv[2]) : 3;
+    int servers = argc > 3 ? atoi(argv[3]) : 1;
+    g_port = argc > 4 ? argv[4] : "9100";
+    int uring = argc > 5 && strcmp(argv[5], "uring") == 0;
+
+    g_request_len = snprintf(g_request, sizeof(g_request),
+                             "GET /chat HTTP/1.1\r\n"
+                             "Host: localhost\r\n"
+                             "Upgrade: websocket\r\n"
+                             "Connection: Upgrade\r\n"
+                             "Cookie: session=%0512d\r\n"
+                             "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                             "Sec-WebSocket-Version: 13\r\n"
+                             "\r\n",
+                             0);
+
+    static ws_callbacks_t callbacks = {
+        .on_open = on_open,
+        .on_message = on_message,
+        .on_close = on_close,
+        .on_error = on_error,
+    };
+    ws_init(&callbacks);
+
+    static ws_listen_opts_t opts;
+    opts.threads = servers;
+    opts.backend = uring ? WS_BACKEND_URING : WS_BACKEND_EPOLL;
+    pthread_t server;
+    pthread_create(&server, NULL, server_thread, &opts);
+    pthread_detach(server);
+    usleep(200000);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(g_port));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    pthread_t *threads = calloc(clients, sizeof(pthread_t));
+    double start = now_sec();
+    g_deadline = start + seconds;
+    for (int i = 0; i < clients; i++)
+    {
+        pthread_create(&threads[i], NULL, client_thread, &addr);
+    }
+    for (int i = 0; i < clients; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now_sec() - start;
+
+    printf("%d clients, %d %s reactors: %10.0f handshakes/s (%ld ok, %ld failed)\n", clients, servers,
+           uring ? "io_uring" : "epoll",
+           atomic_load(&g_done) / elapsed, atomic_load(&g_done), atomic_load(&g_failed));
+    free(threads);
+    return atomic_load(&g_failed) > 0 ? 1 : 0;
+}
@@ -0,0 +1,627 @@
+// Message throughput and latency against a swss server forked off on
+// loopback. Client threads open the connections, split between them, and
+// keep a window of messages in flight on each, stamped with the time they were
+// sent. Reports messages and payload bytes received per second, latency
+// percentiles and the server's resident memory.
+//
+// Patterns:
+//   echo    every connection sends; the server echoes each message back
+//   fanout  every connection subscribes to one topic and the first one
+//           publishes to it, so each message is delivered to all of them
+//
+// -k corks each echoing connection and leaves the flush to the end of the
+// server's event-loop iteration, so the echoes of one read go out together.
+//
+// usage: load_bench [-m echo|fanout] [-c connections] [-t client_threads]
+//                   [-s message_size] [-f fragments] [-w window] [-d seconds]
+//                   [-T server_threads] [-W workers] [-b epoll|uring] [-k]
+//                   [-p port]
+#include "../include/stats.h"
+#include "../include/swss.h"
+#include <getopt.h>
+#include <netinet/tcp.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#define BENCH_TOPIC "bench"
+
+enum bench_mode
+{
+    BENCH_ECHO,
+    BENCH_FANOUT,
+};
+
+struct bench_conn
+{
+    int fd;
+    int sender;
+    u_int8_t *buf;
+    size_t len;
+    size_t cap;
+};
+
+struct bench_thread
+{
+    pthread_t thread;
+    struct bench_conn *conns;
+    int first; // index of its first connection
+    int count;
+    u_int64_t msgs;
+    u_int64_t bytes;
+    ws_histogram_t latency;
+};
+
+static int g_mode = BENCH_ECHO;
+static int g_conns = 100;
+static int g_threads = 4;
+static size_t g_size = 64;
+static int g_fragments = 1;
+static int g_window = 1;
+static double g_seconds = 5;
+static int g_server_threads = 1;
+static int g_workers;
+static int g_uring;
+static int g_cork;
+static const char *g_port = "9200";
+
+static struct sockaddr_in g_addr;
+static u_int64_t g_deadline_ns;
+static atomic_int g_failed;
+
+static void on_open(ws_conn_t conn)
+{
+    if (g_mode == BENCH_FANOUT)
+    {
+        ws_subscribe(conn, BENCH_TOPIC);
+    }
+}
+
+static void on_message(ws_conn_t conn, int text, const char *message, size_t length)
+{
+    if (g_mode == BENCH_FANOUT)
+    {
+        ws_publish(BENCH_TOPIC, text ? 0x1 : 0x2, (const u_int8_t *)message, length);
+        return;
+    }
+    if (g_cork)
+    {
+        ws_cork(conn);
+    }
+    if (text)
+    {
+        ws_send_txt(conn, message, length);
+    }
+    else
+    {
+        ws_send_bin(conn, (const u_int8_t *)message, length);
+    }
+}
+
+static void on_close(ws_conn_t conn) { (void)conn; }
+static void on_error(ws_conn_t conn, int error_code)
+{
+    (void)conn;
+    (void)error_code;
+}
+
+static void run_server(void)
+{
+    static ws_callbacks_t callbacks = {
+        .on_open = on_open,
+        .on_message = on_message,
+        .on_close = on_close,
+        .on_error = on_error,
+    };
+    ws_init(&callbacks);
+
+    ws_listen_opts_t opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.threads = g_server_threads;
+    opts.workers = g_workers;
+    opts.backend = g_uring ? WS_BACKEND_URING : WS_BACKEND_EPOLL;
+    opts.max_message_size = g_size > WS_DEFAULT_MAX_MESSAGE ? g_size : 0;
+    // deep enough for every message in flight, so none is refused
+    opts.send_high_water = (size_t)256 << 20;
+    ws_listen_opts(g_port, &opts);
+    exit(1);
+}
+
+// Resident and peak resident memory of pid, in KiB.
+static int read_rss(pid_t pid, long *rss, long *hwm)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        return -1;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+    {
+        sscanf(line, "VmRSS: %ld", rss);
+        sscanf(line, "VmHWM: %ld", hwm);
+    }
+    fclose(f);
+    return 0;
+}
+
+static int bench_connect(void)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (const struct sockaddr *)&g_addr, sizeof(g_addr)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Blocking upgrade; the server sends nothing else until spoken to.
+static int bench_handshake(int fd)
+{
+    static const char request[] = "GET / HTTP/1.1\r\n"
+                                  "Host: localhost\r\n"
+                                  "Upgrade: websocket\r\n"
+                                  "Connection: Upgrade\r\n"
+                                  "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                                  "Sec-WebSocket-Version: 13\r\n"
+                                  "\r\n";
+    if (send(fd, request, sizeof(request) - 1, MSG_NOSIGNAL) != (ssize_t)sizeof(request) - 1)
+    {
+        return -1;
+    }
+    char buf[512];
+    size_t have = 0;
+    while (have < sizeof(buf) - 1)
+    {
+        ssize_t n = recv(fd, buf + have, sizeof(buf) - 1 - have, 0);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        have += n;
+        buf[have] = '\0';
+        if (strstr(buf, "\r\n\r\n"))
+        {
+            return strstr(buf, " 101 ") ? 0 : -1;
+        }
+    }
+    return -1;
+}
+
+// One message as it goes on the wire: g_fragments frames, masked with a zero
+// key so the payload needs no transform. The send time goes in the first 8
+// payload bytes.
+static u_int8_t *build_message(size_t *len, size_t *stamp_at)
+{
+    size_t piece = g_size / g_fragments;
+    u_int8_t *wire = malloc(g_size + (size_t)g_fragments * 14);
+    if (!wire)
+    {
+        return NULL;
+    }
+    size_t off = 0;
+    *stamp_at = 0;
+    for (int i = 0; i < g_fragments; i++)
+    {
+        size_t n = i == g_fragments - 1 ? g_size - piece * i : piece;
+        wire[off++] = (i == g_fragments - 1 ? 0x80 : 0) | (i == 0 ? 0x2 : 0x0);
+        if (n < 126)
+        {
+            wire[off++] = 0x80 | n;
+        }
+        else if (n < 65536)
+        {
+            wire[off++] = 0x80 | 126;
+            wire[off++] = n >> 8;
+            wire[off++] = n;
+        }
+        else
+        {
+            wire[off++] = 0x80 | 127;
+            for (int b = 7; b >= 0; b--)
+            {
+                wire[off++] = (u_int8_t)((u_int64_t)n >> (b * 8));
+            }
+        }
+        memset(wire + off, 0, 4);
+        off += 4;
+        if (i == 0)
+        {
+            *stamp_at = off;
+        }
+        memset(wire + off, 'x', n);
+        off += n;
+    }
+    *len = off;
+    return wire;
+}
+
+static int send_message(int fd, u_int8_t *wire, size_t len, size_t stamp_at)
+{
+    u_int64_t now = ws_now_ns();
+    memcpy(wire + stamp_at, &now, sizeof(now));
+    size_t sent = 0;
+    while (sent < len)
+    {
+        ssize_t n = send(fd, wire + sent, len - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+static void hist_record(ws_histogram_t *h, u_int64_t v)
+{
+    h->count++;
+    h->sum += v;
+    h->buckets[ws_hist_bucket(v)]++;
+    if (v > h->max)
+    {
+        h->max = v;
+    }
+}
+
+// Takes every complete frame out of c's buffer.
+// returns the number of whole messages received, or -1 if the server failed it
+static int parse_frames(struct bench_thread *t, struct bench_conn *c)
+{
+    int messages = 0;
+    size_t pos = 0;
+    while (c->len - pos >= 2)
+    {
+        u_int8_t *p = c->buf + pos;
+        size_t header = 2;
+        u_int64_t n = p[1] & 0x7F;
+        if (n == 126)
+        {
+            header = 4;
+        }
+        else if (n == 127)
+        {
+            header = 10;
+        }
+        if (c->len - pos < header)
+        {
+            break;
+        }
+        if (n == 126)
+        {
+            n = ((u_int64_t)p[2] << 8) | p[3];
+        }
+        else if (n == 127)
+        {
+            n = 0;
+            for (int b = 0; b < 8; b++)
+            {
+                n = (n << 8) | p[2 + b];
+            }
+        }
+        if (c->len - pos < header + n)
+        {
+            break;
+        }
+
+        u_int8_t opcode = p[0] & 0x0F;
+        if (opcode == 0x8)
+        {
+            return -1;
+        }
+        if (opcode == 0x1 || opcode == 0x2)
+        {
+            u_int64_t sent;
+            memcpy(&sent, p + header, sizeof(sent));
+            hist_record(&t->latency, ws_now_ns() - sent);
+        }
+        if (opcode < 0x8)
+        {
+            t->bytes += n;
+            if (p[0] & 0x80)
+            {
+                t->msgs++;
+                messages++;
+            }
+        }
+        pos += header + n;
+    }
+    memmove(c->buf, c->buf + pos, c->len - pos);
+    c->len -= pos;
+    return messages;
+}
+
+static int open_conns(struct bench_thread *t)
+{
+    t->conns = calloc(t->count, sizeof(struct bench_conn));
+    if (!t->conns)
+    {
+        return -1;
+    }
+    for (int i = 0; i < t->count; i++)
+    {
+        struct bench_conn *c = &t->conns[i];
+        c->cap = (g_size + 14) * 2 + 65536;
+        c->buf = malloc(c->cap);
+        c->fd = bench_connect();
+        if (c->fd == -1 || !c->buf || bench_handshake(c->fd) == -1)
+        {
+            return -1;
+        }
+        c->sender = g_mode == BENCH_ECHO || t->first + i == 0;
+    }
+    return 0;
+}
+
+static int run_load(struct bench_thread *t)
+{
+    size_t wire_len, stamp_at;
+    u_int8_t *wire = build_message(&wire_len, &stamp_at);
+    int epfd = epoll_create1(0);
+    if (!wire || epfd == -1)
+    {
+        return -1;
+    }
+    for (int i = 0; i < t->count; i++)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &t->conns[i];
+        epoll_ctl(epfd, EPOLL_CTL_ADD, t->conns[i].fd, &ev);
+        for (int w = 0; t->conns[i].sender && w < g_window; w++)
+        {
+            if (send_message(t->conns[i].fd, wire, wire_len, stamp_at) == -1)
+            {
+                return -1;
+            }
+        }
+    }
+
+    struct epoll_event events[64];
+    while (ws_now_ns() < g_deadline_ns)
+    {
+        int n = epoll_wait(epfd, events, 64, 10);
+        for (int i = 0; i < n; i++)
+        {
+            struct bench_conn *c = events[i].data.ptr;
+            ssize_t got;
+            while ((got = recv(c->fd, c->buf + c->len, c->cap - c->len, MSG_DONTWAIT)) > 0)
+            {
+                c->len += got;
+                int messages = parse_frames(t, c);
+                if (messages == -1)
+                {
+                    return -1;
+                }
+                // each message back makes room in the window for another
+                for (int m = 0; c->sender && m < messages; m++)
+                {
+                    if (send_message(c->fd, wire, wire_len, stamp_at) == -1)
+                    {
+                        return -1;
+                    }
+                }
+            }
+            if (got == 0 || (got == -1 && errno != EAGAIN))
+            {
+                return -1;
+            }
+        }
+    }
+    close(epfd);
+    free(wire);
+    return 0;
+}
+
+static pthread_barrier_t g_connected;
+static pthread_barrier_t g_start;
+
+static void *client_thread(void *arg)
+{
+    struct bench_thread *t = arg;
+    if (open_conns(t) == -1)
+    {
+        atomic_fetch_add(&g_failed, 1);
+    }
+    // the server's memory is read with every connection open and idle
+    pthread_barrier_wait(&g_connected);
+    pthread_barrier_wait(&g_start);
+    if (atomic_load(&g_failed) == 0 && run_load(t) == -1)
+    {
+        atomic_fetch_add(&g_failed, 1);
+    }
+    return NULL;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-m echo|fanout] [-c connections] [-t client_threads] [-s message_size]\n"
+            "       [-f fragments] [-w window] [-d seconds] [-T server_threads] [-W workers] [-b epoll|uring]\n"
+            "       [-k] [-p port]\n",
+            name);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "m:c:t:s:f:w:d:T:W:b:kp:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm':
+            g_mode = strcmp(optarg, "fanout") == 0 ? BENCH_FANOUT : BENCH_ECHO;
+            break;
+        case 'c':
+            g_conns = atoi(optarg);
+            break;
+        case 't':
+            g_threads = atoi(optarg);
+            break;
+        case 's':
+            g_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            g_fragments = atoi(optarg);
+            break;
+        case 'w':
+            g_window = atoi(optarg);
+            break;
+        case 'd':
+            g_seconds = atof(optarg);
+            break;
+        case 'T':
+            g_server_threads = atoi(optarg);
+            break;
+        case 'W':
+            g_workers = atoi(optarg);
+            break;
+        case 'b':
+            g_uring = strcmp(optarg, "uring") == 0;
+            break;
+        case 'k':
+            g_cork = 1;
+            break;
+        case 'p':
+            g_port = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (g_conns < 1 || g_window < 1 || g_fragments < 1)
+    {
+        usage(argv[0]);
+    }
+    if (g_threads > g_conns)
+    {
+        g_threads = g_conns;
+    }
+    // room for the timestamp in the first fragment
+    if (g_size < 8)
+    {
+        g_size = 8;
+    }
+    if (g_size / g_fragments < 8)
+    {
+        g_fragments = g_size / 8;
+    }
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    pid_t server = fork();
+    if (server == 0)
+    {
+        run_server();
+    }
+    if (server == -1)
+    {
+        perror("fork");
+        return 1;
+    }
+
+    memset(&g_addr, 0, sizeof(g_addr));
+    g_addr.sin_family = AF_INET;
+    g_addr.sin_port = htons(atoi(g_port));
+    g_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int probe = -1;
+    for (int tries = 0; tries < 100 && probe == -1; tries++)
+    {
+        usleep(50000);
+        probe = bench_connect();
+    }
+    if (probe == -1)
+    {
+        fprintf(stderr, "server did not come up on port %s\n", g_port);
+        kill(server, SIGKILL);
+        return 1;
+    }
+    close(probe);
+    usleep(50000);
+
+    long rss_base = 0, rss_idle = 0, rss_load = 0, hwm = 0;
+    read_rss(server, &rss_base, &hwm);
+
+    struct bench_thread *threads = calloc(g_threads, sizeof(struct bench_thread));
+    pthread_barrier_init(&g_connected, NULL, g_threads + 1);
+    pthread_barrier_init(&g_start, NULL, g_threads + 1);
+    for (int i = 0, first = 0; i < g_threads; i++)
+    {
+        threads[i].first = first;
+        threads[i].count = g_conns / g_threads + (i < g_conns % g_threads);
+        first += threads[i].count;
+        pthread_create(&threads[i].thread, NULL, client_thread, &threads[i]);
+    }
+
+    pthread_barrier_wait(&g_connected);
+    // subscriptions are made in on_open, which may trail the 101 response
+    usleep(100000);
+    read_rss(server, &rss_idle, &hwm);
+    u_int64_t start = ws_now_ns();
+    g_deadline_ns = start + (u_int64_t)(g_seconds * 1e9);
+    pthread_barrier_wait(&g_start);
+
+    ws_histogram_t latency;
+    memset(&latency, 0, sizeof(latency));
+    u_int64_t msgs = 0, bytes = 0;
+    for (int i = 0; i < g_threads; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+        msgs += threads[i].msgs;
+        bytes += threads[i].bytes;
+        latency.count += threads[i].latency.count;
+        latency.sum += threads[i].latency.sum;
+        if (threads[i].latency.max > latency.max)
+        {
+            latency.max = threads[i].latency.max;
+        }
+        for (int b = 0; b < WS_HIST_BUCKETS; b++)
+        {
+            latency.buckets[b] += threads[i].latency.buckets[b];
+        }
+    }
+    double elapsed = (ws_now_ns() - start) / 1e9;
+    read_rss(server, &rss_load, &hwm);
+    kill(server, SIGKILL);
+    waitpid(server, NULL, 0);
+
+    printf("%s: %d connections, %zu B in %d fragment%s, window %d, %d %s reactor%s", g_mode == BENCH_FANOUT ? "fanout" : "echo",
+           g_conns, g_size, g_fragments, g_fragments > 1 ? "s" : "", g_window, g_server_threads,
+           g_uring ? "io_uring" : "epoll", g_server_threads > 1 ? "s" : "");
+    if (g_workers > 0)
+    {
+        printf(", %d worker%s", g_workers, g_workers > 1 ? "s" : "");
+    }
+    if (g_cork)
+    {
+        printf(", corked");
+    }
+    printf("\n");
+    if (atomic_load(&g_failed) > 0)
+    {
+        printf("  %d client threads failed\n", atomic_load(&g_failed));
+        return 1;
+    }
+    printf("  %10.0f msgs/s %9.1f MB/s   latency p50 %.1f us  p99 %.1f us  p999 %.1f us\n", msgs / elapsed,
+           bytes / elapsed / 1e6, ws_histogram_percentile(&latency, 50) / 1e3,
+           ws_histogram_percentile(&latency, 99) / 1e3, ws_histogram_percentile(&latency, 99.9) / 1e3);
+    printf("  server RSS %.1f MiB idle (%.2f KiB per connection), %.1f MiB after load, peak %.1f MiB\n",
+           rss_idle / 1024.0, (double)(rss_idle - rss_base) / g_conns, rss_load / 1024.0, hwm / 1024.0);
+    free(threads);
+    return 0;
+}
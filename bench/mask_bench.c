@@ -0,0 +1,93 @@
+// Throughput of the payload (un)masking kernels.
+// usage: mask_bench [payload_bytes] [total_megabytes]
+#include "../include/mask.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef void (*kernel_fn)(u_int8_t *data, size_t len, const u_int8_t key[4]);
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const char *name, kernel_fn kernel, u_int8_t *buf, size_t len, size_t total)
+{
+    const u_int8_t key[4] = {0x37, 0xfa, 0x21, 0x3d};
+    size_t iterations = total / len;
+    if (iterations == 0)
+    {
+        iterations = 1;
+    }
+
+    kernel(buf, len, key); // warm up
+    double start = now_sec();
+    for (size_t i = 0; i < iterations; i++)
+    {
+        kernel(buf, len, key);
+        __asm__ volatile("" : : "r"(buf) : "memory");
+    }
+    double elapsed = now_sec() - start;
+
+    printf("%-10s %10zu B  %8.2f GB/s\n", name, len, (double)len * iterations / elapsed / 1e9);
+}
+
+static int check(kernel_fn kernel, size_t len)
+{
+    const u_int8_t key[4] = {1, 2, 3, 4};
+    u_int8_t *a = malloc(len + 1), *b = malloc(len + 1);
+    for (size_t i = 0; i < len; i++)
+    {
+        a[i] = b[i] = (u_int8_t)(i * 131);
+    }
+    // odd offset to exercise unaligned access
+    ws_mask_bytewise(a + 1, len - 1, key);
+    kernel(b + 1, len - 1, key);
+    int ok = memcmp(a, b, len) == 0;
+    free(a);
+    free(b);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    size_t len = argc > 1 ? strtoull(argv[1], NULL, 10) : 1 << 20;
+    size_t total = (argc > 2 ? strtoull(argv[2], NULL, 10) : 4096) << 20;
+
+    struct
+    {
+        const char *name;
+        kernel_fn fn;
+        int available;
+    } kernels[] = {
+        {"bytewise", ws_mask_bytewise, 1},
+        {"scalar64", ws_mask_scalar, 1},
+        {"sse2", ws_mask_sse2, ws_mask_have_sse2()},
+        {"avx2", ws_mask_avx2, ws_mask_have_avx2()},
+    };
+
+    u_int8_t *buf = aligned_alloc(64, (len + 63) / 64 * 64);
+    memset(buf, 0xab, len);
+
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+    {
+        if (!kernels[i].available)
+        {
+            printf("%-10s unsupported on this CPU\n", kernels[i].name);
+            continue;
+        }
+        if (!check(kernels[i].fn, 1000 + 7))
+        {
+            printf("%-10s MISMATCH\n", kernels[i].name);
+            return 1;
+        }
+        run(kernels[i].name, kernels[i].fn, buf, len, total);
+    }
+
+    free(buf);
+    return 0;
+}
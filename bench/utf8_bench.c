@@ -0,0 +1,145 @@
+// Throughput of the UTF-8 validation kernels, on ASCII and on mixed text.
+// usage: utf8_bench [payload_bytes] [total_megabytes]
+#include "../include/utf8.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef int (*kernel_fn)(const u_int8_t *data, size_t len);
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fills buf with len bytes of valid text; wide picks characters of every
+// encoded length, otherwise it is all ASCII.
+static void fill_text(u_int8_t *buf, size_t len, int wide, unsigned *seed)
+{
+    static const char *chars[] = {"a", "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80"};
+    size_t i = 0;
+    while (i < len)
+    {
+        const char *c = chars[wide ? rand_r(seed) % 4 : 0];
+        size_t n = strlen(c);
+        if (i + n > len)
+        {
+            c = "a";
+            n = 1;
+        }
+        memcpy(buf + i, c, n);
+        i += n;
+    }
+}
+
+static void run(const char *name, const char *text, kernel_fn kernel, const u_int8_t *buf, size_t len,
+                size_t total)
+{
+    size_t iterations = total / len;
+    if (iterations == 0)
+    {
+        iterations = 1;
+    }
+
+    int bad = kernel(buf, len); // warm up
+    double start = now_sec();
+    for (size_t i = 0; i < iterations; i++)
+    {
+        bad |= kernel(buf, len);
+        __asm__ volatile("" : : "r"(buf) : "memory");
+    }
+    double elapsed = now_sec() - start;
+
+    printf("%-10s %-6s %10zu B  %8.2f GB/s%s\n", name, text, len, (double)len * iterations / elapsed / 1e9,
+           bad ? "  REJECTED" : "");
+}
+
+// Compares kernel against the scalar one on valid text with single bytes
+// changed at random, whole and fed in random pieces.
+static int check(kernel_fn kernel, size_t len)
+{
+    unsigned seed = 1;
+    u_int8_t *buf = malloc(len);
+    for (int trial = 0; trial < 20000; trial++)
+    {
+        size_t n = rand_r(&seed) % len;
+        fill_text(buf, n, 1, &seed);
+        if (n > 0 && trial % 4 != 0)
+        {
+            buf[rand_r(&seed) % n] = (u_int8_t)rand_r(&seed);
+        }
+        int want = ws_utf8_scalar(buf, n);
+        if (kernel(buf, n) != want)
+        {
+            free(buf);
+            return 0;
+        }
+
+        struct ws_utf8 st = {0};
+        int got = 0;
+        for (size_t i = 0; i < n && got == 0;)
+        {
+            size_t piece = 1 + rand_r(&seed) % 70;
+            piece = piece < n - i ? piece : n - i;
+            got = ws_utf8_feed(&st, buf + i, piece);
+            i += piece;
+        }
+        if (got == 0)
+        {
+            got = ws_utf8_end(&st);
+        }
+        if (got != want)
+        {
+            free(buf);
+            return 0;
+        }
+    }
+    free(buf);
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    size_t len = argc > 1 ? strtoull(argv[1], NULL, 10) : 1 << 20;
+    size_t total = (argc > 2 ? strtoull(argv[2], NULL, 10) : 4096) << 20;
+
+    struct
+    {
+        const char *name;
+        kernel_fn fn;
+        int available;
+    } kernels[] = {
+        {"scalar64", ws_utf8_scalar, 1},
+        {"sse4", ws_utf8_sse4, ws_utf8_have_sse4()},
+        {"avx2", ws_utf8_avx2, ws_utf8_have_avx2()},
+    };
+
+    unsigned seed = 7;
+    u_int8_t *ascii = malloc(len);
+    u_int8_t *mixed = malloc(len);
+    fill_text(ascii, len, 0, &seed);
+    fill_text(mixed, len, 1, &seed);
+
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+    {
+        if (!kernels[i].available)
+        {
+            printf("%-10s unsupported on this CPU\n", kernels[i].name);
+            continue;
+        }
+        if (!check(kernels[i].fn, 300))
+        {
+            printf("%-10s MISMATCH\n", kernels[i].name);
+            return 1;
+        }
+        run(kernels[i].name, "ascii", kernels[i].fn, ascii, len, total);
+        run(kernels[i].name, "mixed", kernels[i].fn, mixed, len, total);
+    }
+
+    free(ascii);
+    free(mixed);
+    return 0;
+}
@@ -1,10 +1,14 @@
+#include <stdatomic.h>
+#include <stdint.h>
 #include <swss/swss.h>
 #include <time.h>
 
-#define MAX_CLIENTS 10
+// callbacks run on several reactor threads at once
+static atomic_int client_count;
+static atomic_int last_id;
 
-int client_count = 0;
-int clients[MAX_CLIENTS];
+// each client is numbered in its connection's user data
+static int client_id(ws_conn_t conn) { return (int)(intptr_t)ws_get_user_data(conn); }
 
 void print_timestamp()
 {
@@ -14,56 +18,39 @@ void print_timestamp()
     printf("[%s] ", time_str);
 }
 
-void my_on_open(int client_fd)
+void my_on_open(ws_conn_t conn)
 {
-    if (client_count < MAX_CLIENTS)
-    {
-        clients[client_count] = client_fd;
-        client_count++;
-        print_timestamp();
-        printf("Client %d connected (Total clients: %d)\n", client_fd, client_count);
-    }
+    ws_set_user_data(conn, (void *)(intptr_t)(atomic_fetch_add(&last_id, 1) + 1));
+    ws_subscribe(conn, "chat");
+    int total = atomic_fetch_add(&client_count, 1) + 1;
+    print_timestamp();
+    printf("Client %d connected (Total clients: %d)\n", client_id(conn), total);
 }
 
-void my_on_message(int client_fd, const char *message, size_t length)
+void my_on_message(ws_conn_t conn, int text, const char *message, size_t length)
 {
     print_timestamp();
-    printf("Broadcasting message from client %d to all other clients\n", client_fd);
+    printf("Broadcasting message from client %d to all other clients\n", client_id(conn));
 
-    for (int j = 0; j < client_count; j++)
-    {
-        if (clients[j] != client_fd)
-        {
-            ws_send_txt(clients[j], message, length);
-        }
-    }
+    // the frame is encoded once and shared by every subscriber
+    ws_publish_from(conn, "chat", text ? 0x1 : 0x2, (const u_int8_t *)message, length);
 }
 
-void my_on_close(int client_fd)
+// the library drops the connection's subscriptions when it closes
+void my_on_close(ws_conn_t conn)
 {
-    for (int i = 0; i < client_count; i++)
-    {
-        if (clients[i] == client_fd)
-        {
-            // Shift remaining clients to fill the gap
-            for (int j = i; j < client_count - 1; j++)
-            {
-                clients[j] = clients[j + 1];
-            }
-            client_count--;
-            break;
-        }
-    }
+    int remaining = atomic_fetch_sub(&client_count, 1) - 1;
     print_timestamp();
-    printf("Client %d disconnected (Remaining clients: %d)\n", client_fd, client_count);
+    printf("Client %d disconnected (Remaining clients: %d)\n", client_id(conn), remaining);
 }
 
-void my_on_error(int client_fd, int error_code)
+void my_on_error(ws_conn_t conn, int error_code)
 {
-    fprintf(stderr, "Error on client %d: %d\n", client_fd, error_code);
+    fprintf(stderr, "Error on client %d: %d\n", client_id(conn), error_code);
 }
 
-int main()
+// usage: chat_server [cert.pem key.pem] for wss://
+int main(int argc, char **argv)
 {
     ws_callbacks_t callbacks = {.on_open = my_on_open,
                                 .on_message = my_on_message,
@@ -72,5 +59,14 @@ int main()
 
     ws_init(&callbacks);
 
-    ws_listen("8080");
+    // without server context takeover a broadcast is compressed only once
+    ws_listen_opts_t opts = {.deflate = {.enabled = 1,
+                                         .server_no_context_takeover = 1,
+                                         .min_size = 64}};
+    if (argc > 2)
+    {
+        opts.tls.cert_file = argv[1];
+        opts.tls.key_file = argv[2];
+    }
+    ws_listen_opts("8080", &opts);
 }
@@ -4,7 +4,8 @@
 #include <stddef.h>
 #include <stdint.h>
 
-char *base64_encode(const unsigned char *data, size_t input_length, size_t *output_length);
-int b64_encode();
+#define BASE64_ENCODED_SIZE(n) (4 * (((n) + 2) / 3))
 
-#endif /* BASE64_H */
\ No newline at end of file
+size_t base64_encode(const unsigned char *data, size_t input_length, char *out);
+
+#endif /* BASE64_H */
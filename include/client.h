@@ -0,0 +1,28 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include "swss.h"
+#include <semaphore.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct ws_reactor;
+
+// A connection ws_connect upgraded on the caller's thread, waiting for the
+// client reactor to take it over. Lives on the caller's stack until done is
+// posted.
+struct ws_client_join
+{
+    int fd;
+    const ws_callbacks_t *callbacks;
+    const u_int8_t *early; // frames that arrived along with the upgrade response
+    size_t early_len;
+    ws_conn_t res; // the connection once adopted, or 0
+    sem_t done;
+    struct ws_client_join *next;
+};
+
+// Adopts every connection waiting on the client reactor. Reactor thread only.
+void ws_client_adopt(struct ws_reactor *reactor);
+
+#endif /* CLIENT_H */
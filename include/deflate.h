@@ -0,0 +1,36 @@
+#ifndef DEFLATE_H
+#define DEFLATE_H
+
+#include "swss.h"
+#include <zlib.h>
+
+#define WS_RSV1 0x40
+#define WS_EXTENSIONS_MAX 160
+
+// permessage-deflate (RFC 7692) state negotiated for one connection. Streams
+// are only kept per connection when context takeover is in effect; without it
+// every message is (de)compressed with a thread-local stream instead.
+struct ws_deflate
+{
+    u_int8_t server_no_context_takeover;
+    u_int8_t client_no_context_takeover;
+    u_int8_t server_max_window_bits;
+    u_int8_t client_max_window_bits;
+    int level;
+    int tx_ready;
+    int rx_ready;
+    z_stream tx;
+    z_stream rx;
+};
+
+struct ws_deflate *ws_deflate_negotiate(const ws_deflate_opts_t *opts, const char *offers,
+                                        char *response, size_t response_size);
+int ws_deflate_compress(struct ws_deflate *d, const u_int8_t *in, size_t len,
+                        u_int8_t **out, size_t *out_len);
+int ws_deflate_decompress(struct ws_deflate *d, const u_int8_t *in, size_t len, size_t max_len,
+                          u_int8_t **out, size_t *out_len);
+int ws_deflate_inflate_stream(struct ws_deflate *d, const u_int8_t *in, size_t len, int last,
+                              int (*emit)(void *ctx, const u_int8_t *data, size_t len), void *ctx);
+void ws_deflate_free(struct ws_deflate *d);
+
+#endif /* DEFLATE_H */
@@ -0,0 +1,37 @@
+#ifndef INBOX_H
+#define INBOX_H
+
+#include "outq.h"
+
+// A connection's inbox holds frames other threads sent it, newest first, until
+// its reactor moves them into the send queue. Producers push with a single
+// compare-and-swap; the reactor takes the whole list at once. The first push
+// onto an empty inbox also puts the connection on its reactor's ready list,
+// and the first connection on an empty ready list writes the reactor's
+// eventfd, so a burst of sends costs one wakeup.
+#define WS_INBOX_CLOSED ((struct ws_outq_entry *)1)
+
+struct ws_conn;
+struct ws_reactor;
+
+// Takes ownership of entry.
+// returns 0 on success, -1 once the connection is closed
+int ws_inbox_push(struct ws_conn *conn, struct ws_outq_entry *entry);
+
+// Empties the inbox. Owning reactor only.
+// returns the entries oldest first, or NULL
+struct ws_outq_entry *ws_inbox_take(struct ws_conn *conn);
+
+// Puts conn on its reactor's ready list with nothing in its inbox, for the
+// reactor to look at it again (see ws_conn_on_inbox).
+void ws_inbox_kick(struct ws_conn *conn);
+
+// Refuses further pushes and frees whatever was still waiting. Owning reactor
+// only, as the connection closes.
+void ws_inbox_close(struct ws_conn *conn);
+
+// Empties the wake eventfd, adopts any client connections waiting and hands
+// every ready connection to ws_conn_on_inbox.
+void ws_reactor_on_wake(struct ws_reactor *reactor);
+
+#endif /* INBOX_H */
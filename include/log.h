@@ -0,0 +1,39 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include "swss.h"
+#include <stdatomic.h>
+
+// Lowest level compiled in. Calls below it are removed entirely, so frame
+// tracing costs nothing unless the library is built with -DWS_LOG_LEVEL=0.
+#ifndef WS_LOG_LEVEL
+#define WS_LOG_LEVEL WS_LOG_DEBUG
+#endif
+
+// Each thread formats its records into its own ring, which a background
+// writer drains into the sink; logging never takes a lock or does I/O.
+#define WS_LOG_SLOTS 256
+#define WS_LOG_LINE 248
+
+extern atomic_int ws_log_threshold;
+
+void ws_log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void ws_log_perror(const char *what);
+
+#define WS_LOG(level, ...)                                                                        \
+    do                                                                                            \
+    {                                                                                             \
+        if ((level) >= WS_LOG_LEVEL &&                                                            \
+            (level) >= atomic_load_explicit(&ws_log_threshold, memory_order_relaxed))            \
+        {                                                                                         \
+            ws_log_write((level), __VA_ARGS__);                                                   \
+        }                                                                                         \
+    } while (0)
+
+#define ws_log_trace(...) WS_LOG(WS_LOG_TRACE, __VA_ARGS__)
+#define ws_log_debug(...) WS_LOG(WS_LOG_DEBUG, __VA_ARGS__)
+#define ws_log_info(...) WS_LOG(WS_LOG_INFO, __VA_ARGS__)
+#define ws_log_warn(...) WS_LOG(WS_LOG_WARN, __VA_ARGS__)
+#define ws_log_error(...) WS_LOG(WS_LOG_ERROR, __VA_ARGS__)
+
+#endif /* LOG_H */
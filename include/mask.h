@@ -0,0 +1,20 @@
+#ifndef MASK_H
+#define MASK_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// XOR data in place with the 4-byte masking key. pos is how many bytes of the
+// same payload were masked before, so a payload can be (un)masked in pieces
+// as it arrives. Masking and unmasking are the same operation.
+void ws_mask(u_int8_t *data, size_t len, const u_int8_t key[4], u_int64_t pos);
+
+// The individual kernels, for benchmarking. key is already rotated for pos 0.
+void ws_mask_bytewise(u_int8_t *data, size_t len, const u_int8_t key[4]);
+void ws_mask_scalar(u_int8_t *data, size_t len, const u_int8_t key[4]);
+void ws_mask_sse2(u_int8_t *data, size_t len, const u_int8_t key[4]);
+void ws_mask_avx2(u_int8_t *data, size_t len, const u_int8_t key[4]);
+int ws_mask_have_sse2(void);
+int ws_mask_have_avx2(void);
+
+#endif /* MASK_H */
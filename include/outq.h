@@ -0,0 +1,79 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// An encoded frame (header and payload back to back). Frames are immutable
+// once built and reference counted, so one frame can sit in the send queues of
+// any number of connections at once.
+struct ws_frame
+{
+    atomic_int refs;
+    size_t len;
+    u_int8_t data[];
+};
+
+// Payload bytes kept outside any frame, so that sending them copies nothing in
+// user space: a read-only mapping of a file (ws_region_map), or a descriptor
+// of the file itself, sent from with sendfile(2). Reference counted like a
+// frame, and shared the same way.
+struct ws_region
+{
+    atomic_int refs;
+    int fd;               // -1 for a mapping
+    const u_int8_t *addr; // NULL for a descriptor
+    size_t len;           // of the mapping
+    void *map;            // the whole mapping, from a page boundary
+    size_t map_len;
+};
+
+struct ws_outq_entry
+{
+    struct ws_frame *frame;
+    struct ws_region *region; // if set, frame is a header whose payload is span bytes of region from start
+    u_int64_t start;          // into the mapping, or a file offset
+    size_t span;
+    size_t offset; // bytes of this entry already written
+    u_int64_t queued_ns;
+    u_int8_t opcode; // in an inbox only: non-zero if frame is a bare payload still to be framed
+    struct ws_outq_entry *next;
+};
+
+// Bytes that could not be written without blocking, in send order.
+struct ws_outq
+{
+    struct ws_outq_entry *head;
+    struct ws_outq_entry *tail;
+    atomic_size_t bytes; // also read without out_lock by senders on other threads
+};
+
+struct ws_frame *ws_frame_alloc(size_t len);
+struct ws_frame *ws_frame_new(u_int8_t opcode, const u_int8_t *payload, u_int64_t payload_len);
+struct ws_frame *ws_frame_new_masked(u_int8_t opcode, const u_int8_t *payload, u_int64_t payload_len);
+void ws_frame_ref(struct ws_frame *frame);
+void ws_frame_unref(struct ws_frame *frame);
+struct ws_frame *ws_frame_header(u_int8_t opcode, u_int64_t payload_len);
+
+int ws_file_range(int fd, off_t offset, size_t *length);
+struct ws_region *ws_region_file(int fd);
+void ws_region_ref(struct ws_region *region);
+int ws_region_read(const struct ws_region *region, u_int64_t start, u_int8_t *buf, size_t len);
+
+static inline size_t ws_outq_entry_len(const struct ws_outq_entry *e) { return e->frame->len + e->span; }
+void ws_outq_entry_free(struct ws_outq_entry *e);
+
+int ws_outq_push(struct ws_outq *q, struct ws_frame *frame, size_t offset);
+void ws_outq_append(struct ws_outq *q, struct ws_outq_entry *entry);
+struct ws_conn;
+
+int ws_outq_write(struct ws_outq *q, struct ws_conn *conn, const struct iovec *iov, int iovcnt);
+int ws_outq_flush(struct ws_outq *q, struct ws_conn *conn);
+int ws_outq_iov(const struct ws_outq *q, struct iovec *iov, int max);
+int ws_outq_file_span(const struct ws_outq *q, int *fd, off_t *offset, size_t *len);
+void ws_outq_consume(struct ws_outq *q, size_t sent);
+void ws_outq_clear(struct ws_outq *q);
+
+#endif /* OUTQ_H */
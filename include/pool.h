@@ -0,0 +1,19 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Power-of-two size classes from 64 B to 16 MiB. Every thread caches freed
+// buffers per class, so steady-state message traffic never reaches malloc
+// and threads never contend on the allocator. Larger requests bypass the pool.
+#define WS_POOL_MIN_SHIFT 6
+#define WS_POOL_MAX_SHIFT 24
+#define WS_POOL_CLASSES (WS_POOL_MAX_SHIFT - WS_POOL_MIN_SHIFT + 1)
+
+void *ws_buf_alloc(size_t size);
+void *ws_buf_grow(void *buf, size_t used, size_t size);
+void ws_buf_free(void *buf);
+size_t ws_buf_capacity(const void *buf);
+
+#endif /* POOL_H */
@@ -0,0 +1,55 @@
+#ifndef PUBSUB_H
+#define PUBSUB_H
+
+#include "swss.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define WS_TOPIC_SHARDS 64
+#define WS_TOPIC_BUCKETS 256 // per shard
+
+#define WS_TOPIC_SEGMENT 256 // subscribers per segment, at most
+
+// A run of connection handles, for fanning one frame out over several arrays.
+struct ws_conn_run
+{
+    const ws_conn_t *conns;
+    size_t len;
+};
+
+// A sorted slice of a topic's subscribers. Never modified once published.
+struct ws_subseg
+{
+    atomic_int refs;
+    u_int32_t len;
+    ws_conn_t conns[];
+};
+
+// A topic's subscribers: segments in handle order, each seen as one run.
+// Subscribing or unsubscribing copies the one segment it touches and this
+// index of runs, sharing every other segment with the previous snapshot, so
+// a publisher holding a reference keeps a consistent view without a lock.
+struct ws_subscribers
+{
+    atomic_int refs;
+    size_t len;
+    size_t nruns;
+    struct ws_conn_run runs[];
+};
+
+struct ws_topic
+{
+    struct ws_topic *next;
+    u_int32_t hash;
+    struct ws_subscribers *subs;
+    char name[];
+};
+
+struct ws_conn;
+
+// Removes conn from every topic it joined. Called with out_lock held once
+// the connection is closed.
+void ws_pubsub_drop(struct ws_conn *conn);
+
+#endif /* PUBSUB_H */
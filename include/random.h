@@ -0,0 +1,11 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <stddef.h>
+
+// Fills buf with unpredictable bytes, for masking keys and handshake nonces.
+// Each thread runs its own ChaCha20 generator, seeded once from getrandom(2),
+// so this takes no lock and makes no system call in the common case.
+void ws_random_bytes(void *buf, size_t len);
+
+#endif /* RANDOM_H */
@@ -0,0 +1,267 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "client.h"
+#include "deflate.h"
+#include "inbox.h"
+#include "outq.h"
+#include "pubsub.h"
+#include "ring.h"
+#include "swss.h"
+#include "table.h"
+#include "timer.h"
+#include "tls.h"
+#include "uring.h"
+#include "utf8.h"
+#include "utils.h"
+#include "worker.h"
+#include <sys/uio.h>
+
+#define WS_HANDSHAKE_MAX 16384 // whole upgrade request
+#define WS_HS_LINE_MAX 1024    // longer header lines are skipped unparsed
+#define WS_HS_OFFERS_MAX 256
+#define WS_MAX_EVENTS 256
+#define WS_MAX_HEADER 14
+#define WS_READ_BUF_SIZE 16384
+
+enum ws_conn_state
+{
+    WS_STATE_TLS, // TLS handshake in progress
+    WS_STATE_HANDSHAKE,
+    WS_STATE_OPEN,
+};
+
+// where the upgrade request parser stopped
+enum ws_hs_state
+{
+    WS_HS_REQUEST_LINE,
+    WS_HS_HEADERS,
+    WS_HS_SKIP_LINE,
+};
+
+// where the frame parser stopped when the read buffer ran dry
+enum ws_read_state
+{
+    WS_READ_HEADER,
+    WS_READ_PAYLOAD,
+};
+
+// upgrade request, parsed a line at a time; only the headers the handshake
+// needs are kept. Borrowed from the buffer pool until the upgrade is done.
+struct ws_hs
+{
+    u_int8_t state;
+    u_int8_t key_len;
+    u_int16_t offers_len;
+    size_t total;
+    char key[WS_KEY_MAX];
+    char offers[WS_HS_OFFERS_MAX];
+};
+
+// One slot of the connection table (see table.h). Everything an idle open
+// connection needs lives here; buffers are borrowed from the pool only while
+// there is something in them.
+struct ws_conn
+{
+    int fd;
+    int state;
+
+    // the slot's place in the table; gen and free_next change only while
+    // the slot is free, published only while a reference is held
+    u_int32_t slot;
+    u_int32_t gen;
+    _Atomic u_int8_t published;
+    u_int32_t free_next;
+
+    // the application's, see ws_set_user_data
+    void *user_data;
+
+    // a server connection gets the callbacks passed to ws_init, a client one
+    // those passed to ws_connect; client connections mask what they send
+    const ws_callbacks_t *callbacks;
+    u_int8_t client;
+
+    // wss:// only; tls_tx and tls_rx say which directions still go through
+    // OpenSSL rather than kTLS
+    SSL *tls;
+    u_int8_t tls_tx;
+    u_int8_t tls_rx;
+
+    // held by the reactor and by any thread currently sending to the fd (and,
+    // with io_uring, by each operation the kernel has pending on it)
+    atomic_int refs;
+
+    // guards everything on the send side; closed is set before the fd is
+    // released so a sender can never write to a recycled descriptor
+    pthread_mutex_t out_lock;
+    int closed;
+    struct ws_outq outq;
+
+    // set once the queue passes the high-water mark, cleared (with on_drain)
+    // when it is back down to the low one; blocked senders wait on drained
+    int backpressured;
+    pthread_cond_t drained;
+
+    // corks (see ws_cork) taken on the owning reactor keep output in the
+    // queue until the last one is released or the event-loop iteration ends,
+    // when the reactor flushes every connection on its corked list; those
+    // taken on other threads only keep pushes from waking the reactor
+    u_int16_t corked;
+    u_int8_t cork_listed;
+    struct ws_conn *cork_next;
+    atomic_int inbox_corks;
+
+    // the reactor that owns the connection; other threads never touch the
+    // socket, they hand frames to it through the inbox (see inbox.h)
+    struct ws_reactor *reactor;
+    _Atomic(struct ws_outq_entry *) inbox;
+    atomic_size_t inbox_bytes;
+    atomic_int inbox_ready; // on the reactor's ready list
+    struct ws_conn *ready_next;
+
+    // with a worker pool: payload bytes of callbacks still queued for this
+    // connection, and whether reads are paused until the workers catch up;
+    // rx_stopped (reactor only) says reading actually stopped and has to be
+    // restarted
+    atomic_size_t task_bytes;
+    atomic_int rx_paused;
+    u_int8_t rx_stopped;
+    struct ws_serial serial;
+
+    // one timer for every deadline (handshake, ping, pong, idle), re-armed
+    // from these timestamps when it fires rather than on every read; ticks of
+    // the reactor's wheel, reactor thread only
+    struct ws_timer timer;
+    u_int64_t last_rx;   // last read that returned data
+    u_int64_t ping_sent; // the ping still unanswered, or 0
+
+    // topics joined, also under out_lock; dropped when the connection closes
+    struct ws_topic **topics;
+    u_int32_t topics_len;
+    u_int32_t topics_cap;
+
+    // per-connection counters; the in side is written by the reactor thread,
+    // the out side under out_lock
+    atomic_uint_least64_t frames_in;
+    atomic_uint_least64_t bytes_in;
+    atomic_uint_least64_t frames_out;
+    atomic_uint_least64_t bytes_out;
+
+    // server side, until the upgrade is done
+    struct ws_hs *hs;
+
+    // inbound bytes not yet parsed, filled with as few reads as possible;
+    // the buffer goes back to the pool whenever it is empty
+    struct ws_ring rbuf;
+
+    // current frame, filled in as bytes arrive
+    int read_state;
+    u_int8_t fin;
+    u_int8_t rsv;
+    u_int8_t opcode;
+    u_int8_t mask;
+    u_int8_t mask_key[4];
+    u_int64_t payload_len;
+    u_int64_t payload_have;
+    u_int8_t *payload; // where this frame's payload lands: msg or ctrl
+    u_int8_t ctrl[125];
+
+    // permessage-deflate, if negotiated
+    struct ws_deflate *deflate;
+
+    // message being reassembled from fragments, in a pooled buffer (unused
+    // when messages are streamed)
+    u_int8_t original_opcode;
+    u_int8_t msg_compressed;
+    struct ws_utf8 utf8; // a text message, checked as far as it has arrived
+    u_int8_t *msg;
+    u_int64_t msg_len;
+    u_int64_t msg_delivered; // inflated bytes handed to on_message_chunk
+
+    // io_uring backend only: the owning ring, the received data being parsed
+    // (rx_len is 0 at EOF, -errno on error) and the batched send, whose
+    // iovecs are borrowed only while it is in flight
+    struct ws_uring *uring;
+    const u_int8_t *rx_buf;
+    int rx_len;
+    u_int8_t tx_dirty;    // on the ring's list of connections to send for
+    u_int8_t tx_inflight; // a sendmsg of the queue head is with the kernel
+    struct ws_conn *tx_next;
+    struct ws_uring_tx *tx;
+} __attribute__((aligned(WS_CACHE_LINE)));
+
+static inline ws_conn_t ws_conn_handle(const struct ws_conn *conn)
+{
+    return ((ws_conn_t)conn->gen << 32) | conn->slot;
+}
+
+// One event loop thread. It owns its listener, its epoll set and every
+// connection accepted through them; no other thread touches that state.
+struct ws_reactor
+{
+    int id;
+    pthread_t thread;
+    int listen_fd;
+    int epfd;
+    int backend; // enum ws_backend
+
+    // connections other threads gave output to, newest first; wake_fd is
+    // written when the list goes from empty to not
+    int wake_fd;
+    _Atomic(struct ws_conn *) ready;
+
+    // client connections waiting to be adopted (client reactor only), also
+    // announced through wake_fd
+    _Atomic(struct ws_client_join *) joining;
+
+    struct ws_timer_wheel timers;
+
+    // out of descriptors: accepting resumes once this goes off. Accept errors
+    // are logged at most once a second; reactor thread only
+    struct ws_timer accept_backoff;
+    u_int64_t accept_log_at; // tick before which errors are only counted
+    unsigned accept_errors;  // not yet logged
+
+    // connections corked during this iteration, reactor thread only
+    struct ws_conn *corked;
+};
+
+int ws_conn_table_init(void);
+struct ws_conn *ws_conn_new(int fd);
+struct ws_conn *ws_conn_lookup(ws_conn_t handle);
+void ws_conn_put(struct ws_conn *conn);
+void ws_conn_open(struct ws_conn *conn);
+int ws_conn_on_readable(struct ws_conn *conn);
+int ws_conn_on_writable(struct ws_conn *conn);
+int ws_conn_on_sent(struct ws_conn *conn, int res);
+int ws_conn_on_inbox(struct ws_conn *conn);
+void ws_conn_on_timer(struct ws_timer *timer);
+void ws_conn_close(struct ws_conn *conn);
+void ws_conn_error(struct ws_conn *conn, int code);
+void ws_conn_release_corks(struct ws_conn *conn, int n);
+void ws_reactor_uncork(struct ws_reactor *reactor);
+
+int ws_conn_send(struct ws_conn *conn, u_int8_t opcode, const u_int8_t *payload,
+                 u_int64_t payload_len);
+int ws_conn_send_frame(struct ws_conn *conn, struct ws_frame *frame);
+int ws_broadcast_runs(const struct ws_conn_run *runs, size_t nruns, ws_conn_t except, u_int8_t opcode,
+                      const u_int8_t *payload, size_t length);
+
+size_t ws_encode_header(u_int8_t *frame, u_int8_t opcode, u_int64_t payload_len,
+                        const u_int8_t *mask_key);
+int ws_sendv_all(int fd, struct iovec *iov, int iovcnt);
+int ws_send_response(int client_fd, u_int8_t opcode, const u_int8_t *payload,
+                     u_int64_t payload_len, u_int8_t mask);
+
+int ws_handshake(struct ws_conn *conn);
+int read_frame(struct ws_conn *conn);
+
+int ws_set_nonblocking(int fd);
+int ws_reactor_add(struct ws_reactor *reactor, struct ws_conn *conn);
+int ws_reactor_run(struct ws_reactor *reactor);
+void ws_reactor_accept_failed(struct ws_reactor *reactor, int err);
+struct ws_reactor *ws_client_reactor(void);
+int ws_client_timeout_ms(void);
+int ws_on_reactor_thread(void);
+
+#endif /* REACTOR_H */
@@ -0,0 +1,39 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Byte ring for inbound socket data. head and tail run freely and are reduced
+// modulo cap (a power of two) only when indexing, so len is tail - head.
+struct ws_ring
+{
+    u_int8_t *data;
+    size_t cap;
+    size_t head;
+    size_t tail;
+};
+
+int ws_ring_init(struct ws_ring *ring, size_t cap);
+void ws_ring_free(struct ws_ring *ring);
+int ws_ring_free_iov(const struct ws_ring *ring, struct iovec iov[2]);
+void ws_ring_peek(const struct ws_ring *ring, void *dst, size_t n);
+void ws_ring_read(struct ws_ring *ring, void *dst, size_t n);
+ssize_t ws_ring_find(const struct ws_ring *ring, u_int8_t c);
+
+static inline size_t ws_ring_len(const struct ws_ring *ring) { return ring->tail - ring->head; }
+static inline size_t ws_ring_space(const struct ws_ring *ring) { return ring->cap - (ring->tail - ring->head); }
+static inline void ws_ring_consume(struct ws_ring *ring, size_t n) { ring->head += n; }
+static inline void ws_ring_commit(struct ws_ring *ring, size_t n) { ring->tail += n; }
+
+// The buffered bytes that sit contiguously at the head, for use in place.
+static inline u_int8_t *ws_ring_head(const struct ws_ring *ring, size_t *n)
+{
+    size_t pos = ring->head & (ring->cap - 1);
+    size_t len = ring->tail - ring->head;
+    *n = (ring->cap - pos < len) ? ring->cap - pos : len;
+    return ring->data + pos;
+}
+
+#endif /* RING_H */
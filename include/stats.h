@@ -0,0 +1,114 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "swss.h"
+#include <stdatomic.h>
+#include <time.h>
+
+// Every counter has one writer at a time (its thread's shard, or a connection
+// under the lock that covers it), so updates are plain relaxed load/store
+// pairs rather than locked read-modify-writes.
+#define WS_COUNTER_ADD(c, n) \
+    atomic_store_explicit(&(c), atomic_load_explicit(&(c), memory_order_relaxed) + (n), memory_order_relaxed)
+
+enum ws_stat
+{
+    WS_STAT_OPENED,
+    WS_STAT_CLOSED,
+    WS_STAT_HANDSHAKE_FAILURES,
+    WS_STAT_FRAMES_IN,
+    WS_STAT_FRAMES_OUT,
+    WS_STAT_MESSAGES_IN,
+    WS_STAT_BYTES_IN,
+    WS_STAT_BYTES_OUT,
+    WS_STAT_SENDS_REFUSED,
+    WS_STAT_QUEUED_BYTES, // wraps below zero in shards that only drain
+    WS_STAT_ERRORS,
+    WS_STAT_CLOSE_CODES,
+    WS_STAT_COUNT = WS_STAT_CLOSE_CODES + WS_STATS_CLOSE_CODES,
+};
+
+struct ws_hist_shard
+{
+    atomic_uint_least64_t count;
+    atomic_uint_least64_t sum;
+    atomic_uint_least64_t max;
+    atomic_uint_least64_t buckets[WS_HIST_BUCKETS];
+};
+
+// One thread's share of the global counters.
+struct ws_stats_shard
+{
+    atomic_uint_least64_t counters[WS_STAT_COUNT];
+    struct ws_hist_shard parse_ns;
+    struct ws_hist_shard send_ns;
+    struct ws_stats_shard *next;
+};
+
+extern __thread struct ws_stats_shard *ws_stats_tls;
+struct ws_stats_shard *ws_stats_shard_get(void);
+
+static inline struct ws_stats_shard *ws_stats_local(void)
+{
+    return ws_stats_tls ? ws_stats_tls : ws_stats_shard_get();
+}
+
+static inline void ws_stat_add(int stat, u_int64_t n)
+{
+    struct ws_stats_shard *shard = ws_stats_local();
+    if (shard)
+    {
+        WS_COUNTER_ADD(shard->counters[stat], n);
+    }
+}
+
+static inline u_int64_t ws_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Log-linear buckets: values below 8 exactly, then 8 per power of two, so a
+// recorded value is off by at most 12.5%.
+static inline int ws_hist_bucket(u_int64_t v)
+{
+    if (v < 8)
+    {
+        return v;
+    }
+    int e = 63 - __builtin_clzll(v);
+    int b = (e - 2) * 8 + ((v >> (e - 3)) & 7);
+    return b < WS_HIST_BUCKETS ? b : WS_HIST_BUCKETS - 1;
+}
+
+static inline void ws_hist_record(struct ws_hist_shard *h, u_int64_t v)
+{
+    WS_COUNTER_ADD(h->count, 1);
+    WS_COUNTER_ADD(h->sum, v);
+    WS_COUNTER_ADD(h->buckets[ws_hist_bucket(v)], 1);
+    if (v > atomic_load_explicit(&h->max, memory_order_relaxed))
+    {
+        atomic_store_explicit(&h->max, v, memory_order_relaxed);
+    }
+}
+
+static inline void ws_stat_parse_ns(u_int64_t ns)
+{
+    struct ws_stats_shard *shard = ws_stats_local();
+    if (shard)
+    {
+        ws_hist_record(&shard->parse_ns, ns);
+    }
+}
+
+static inline void ws_stat_send_ns(u_int64_t ns)
+{
+    struct ws_stats_shard *shard = ws_stats_local();
+    if (shard)
+    {
+        ws_hist_record(&shard->send_ns, ns);
+    }
+}
+
+#endif /* STATS_H */
@@ -16,19 +16,226 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+// Names one connection: its slot in the connection table and the slot's
+// generation. A handle kept past on_close stays invalid, and every call made
+// with it fails, even once the slot holds another connection. 0 is never a
+// connection.
+typedef u_int64_t ws_conn_t;
+
 typedef struct
 {
-    void (*on_open)(int client_fd);
-    void (*on_message)(int client_fd, int text, const char *message, size_t length);
-    void (*on_close)(int client_fd);
-    void (*on_error)(int client_fd, int error_code);
+    void (*on_open)(ws_conn_t conn);
+    void (*on_message)(ws_conn_t conn, int text, const char *message, size_t length);
+    void (*on_close)(ws_conn_t conn);
+    // error_code is the close code sent to the peer (1001 idle timeout, 1002
+    // protocol error, 1007 invalid payload, 1009 message too big), or 1006 if
+    // the connection was lost or stopped answering pings; on_close follows
+    void (*on_error)(ws_conn_t conn, int error_code);
+
+    // Optional streaming delivery. When on_message_chunk is set, messages are
+    // not buffered: each piece of payload is passed on, unmasked (and
+    // inflated), as soon as it arrives, and on_message is not called.
+    void (*on_message_begin)(ws_conn_t conn, int text);
+    void (*on_message_chunk)(ws_conn_t conn, const char *data, size_t length);
+    void (*on_message_end)(ws_conn_t conn);
+
+    // Optional. Called once a connection's send queue, having gone over the
+    // high-water mark, has drained back to the low-water mark.
+    void (*on_drain)(ws_conn_t conn);
 } ws_callbacks_t;
 
+// permessage-deflate (RFC 7692). Without context takeover every message is
+// compressed on its own, which lets a broadcast be compressed once for all
+// recipients and keeps no zlib state per connection.
+typedef struct
+{
+    int enabled;
+    int server_no_context_takeover;
+    int client_no_context_takeover;
+    int server_max_window_bits; // 9..15, else ws_listen_opts fails; 0 = 15
+    int client_max_window_bits; // 9..15, applied only if the client allows it; 0 = 15
+    int level;                  // zlib level 1..9; 0 = zlib default
+    size_t min_size;            // messages shorter than this are sent uncompressed
+} ws_deflate_opts_t;
+
+// What a send does when the connection already has more than the high-water
+// mark queued. Control frames are always queued.
+enum ws_overflow
+{
+    WS_OVERFLOW_DROP,       // refuse the message; the send returns -1
+    WS_OVERFLOW_DISCONNECT, // refuse the message and close the connection
+    WS_OVERFLOW_BLOCK,      // wait for the low-water mark (dropped on a reactor thread)
+};
+
+// wss://. Encryption moves into the kernel (kTLS) after the handshake when
+// the kernel and OpenSSL support it, otherwise it stays in OpenSSL.
+typedef struct
+{
+    const char *cert_file; // PEM certificate chain; NULL = plain ws://
+    const char *key_file;  // PEM private key; NULL = in cert_file
+    int no_ktls;           // keep encryption in user space
+} ws_tls_opts_t;
+
+// How reactors wait for and perform socket I/O.
+enum ws_backend
+{
+    WS_BACKEND_EPOLL,
+    WS_BACKEND_URING, // io_uring; falls back to epoll where it is unavailable, and with TLS
+};
+
+typedef struct
+{
+    int threads; // reactor threads, each with its own listener; 0 = one per online core
+    int backlog; // listen(2) backlog per listener; 0 = SOMAXCONN
+    int backend; // enum ws_backend
+    int workers; // threads running the callbacks, each connection's in order; 0 = the reactor threads
+    ws_deflate_opts_t deflate;
+    size_t max_message_size; // larger messages are refused with 1009; 0 = WS_DEFAULT_MAX_MESSAGE
+    size_t send_high_water;  // queued bytes per connection before overflow; 0 = WS_DEFAULT_SEND_HIGH_WATER
+    size_t send_low_water;   // queued bytes at which on_drain fires; 0 = a quarter of the high mark
+    int send_overflow;       // enum ws_overflow
+    // With workers: payload bytes per connection waiting for a worker before
+    // its reads pause, and the count at which they resume
+    size_t worker_high_water; // 0 = WS_DEFAULT_WORKER_HIGH_WATER
+    size_t worker_low_water;  // 0 = a quarter of the high mark
+    ws_tls_opts_t tls;
+
+    // Timeouts in milliseconds, with 100 ms resolution. Anything read from the
+    // peer, including a pong, counts as hearing from it.
+    int ping_interval_ms;     // ping a peer not heard from for this long; 0 = never
+    int pong_timeout_ms;      // drop a peer not heard from this long after a ping; 0 = the ping interval
+    int idle_timeout_ms;      // close (1001) a peer not heard from for this long; 0 = never
+    int handshake_timeout_ms; // TLS and upgrade handshake; 0 = WS_DEFAULT_HANDSHAKE_TIMEOUT, -1 = none
+} ws_listen_opts_t;
+
+#define WS_DEFAULT_MAX_MESSAGE (16 << 20)
+#define WS_DEFAULT_SEND_HIGH_WATER (1 << 20)
+#define WS_DEFAULT_WORKER_HIGH_WATER (1 << 20)
+#define WS_DEFAULT_HANDSHAKE_TIMEOUT 10000
+
+enum ws_log_level
+{
+    WS_LOG_TRACE,
+    WS_LOG_DEBUG,
+    WS_LOG_INFO,
+    WS_LOG_WARN,
+    WS_LOG_ERROR,
+    WS_LOG_OFF,
+};
+
+// Receives each log record, without a trailing newline, on the library's
+// background log writer thread.
+typedef void (*ws_log_sink_t)(int level, const char *message, size_t length);
+
+void ws_log_set_level(int level);         // default WS_LOG_INFO
+void ws_log_set_sink(ws_log_sink_t sink); // NULL = stderr
+void ws_log_flush(void);
+
+// Latency histogram in nanoseconds. Bucket i < 8 holds the value i; above
+// that each power of two is split into 8 buckets (HDR-style, within 12.5%).
+#define WS_HIST_BUCKETS 320
+#define WS_STATS_CLOSE_CODES 16
+
+typedef struct
+{
+    u_int64_t count;
+    u_int64_t sum;
+    u_int64_t max;
+    u_int64_t buckets[WS_HIST_BUCKETS];
+} ws_histogram_t;
+
+typedef struct
+{
+    u_int64_t connections_opened; // completed handshakes
+    u_int64_t connections_closed; // of those
+    u_int64_t handshake_failures;
+    u_int64_t frames_in;
+    u_int64_t frames_out;
+    u_int64_t messages_in;
+    u_int64_t bytes_in;      // read from sockets
+    u_int64_t bytes_out;     // framed bytes accepted for sending
+    u_int64_t sends_refused; // by the overflow policy
+    int64_t queued_bytes;    // waiting in send queues right now
+    u_int64_t errors;        // connections failed (see on_error)
+    u_int64_t close_codes[WS_STATS_CLOSE_CODES]; // close frames sent, by code - 1000
+    ws_histogram_t parse_ns; // decoding, copying and unmasking one frame
+    ws_histogram_t send_ns;  // from a send call until its last byte is written
+} ws_stats_t;
+
+typedef struct
+{
+    u_int64_t frames_in;
+    u_int64_t frames_out;
+    u_int64_t bytes_in;
+    u_int64_t bytes_out;
+    size_t queued_bytes;
+} ws_conn_stats_t;
+
+void ws_stats_snapshot(ws_stats_t *stats);
+int ws_conn_stats(ws_conn_t conn, ws_conn_stats_t *stats);
+u_int64_t ws_histogram_percentile(const ws_histogram_t *hist, double percentile);
+
 int ws_listen(const char *PORT);
-void *handle_client(void *arg);
-int ws_send_txt(int client_fd, const char *message, size_t length);
-int ws_send_bin(int client_fd, const u_int8_t *payload, size_t length);
+int ws_listen_opts(const char *PORT, const ws_listen_opts_t *opts);
+int ws_send_txt(ws_conn_t conn, const char *message, size_t length);
+int ws_send_bin(ws_conn_t conn, const u_int8_t *payload, size_t length);
+int ws_broadcast(const ws_conn_t *conns, size_t n, u_int8_t opcode, const u_int8_t *payload, size_t length);
+
+// Zero-copy binary messages from files. ws_send_file sends length bytes of the
+// regular file fd from offset with sendfile(2), so they never pass through
+// user space (with TLS in OpenSSL they have to, a record at a time); fd may be
+// closed once the call returns. A region is a read-only mapping of a file that
+// any number of sends share by reference, one copy in memory however many
+// connections it is queued on; the file must not shrink while it is mapped.
+// Regions live until released and until the last send of them is written.
+// Client connections mask a copy of the payload. A length of 0 means the rest
+// of the file or region.
+// returns 0 on success, -1 on error (ws_region_map: NULL)
+typedef struct ws_region ws_region_t;
+int ws_send_file(ws_conn_t conn, int fd, off_t offset, size_t length);
+ws_region_t *ws_region_map(int fd, off_t offset, size_t length);
+void ws_region_release(ws_region_t *region);
+int ws_send_region(ws_conn_t conn, ws_region_t *region, size_t offset, size_t length);
+
+// Corking. Frames sent to conn while it is corked are held back and written
+// together once the last cork is released, in as few system calls and TCP
+// segments as the socket takes. Corks nest. One taken in a callback is
+// released at the latest when the callback returns on a worker, or at the end
+// of the event-loop iteration when callbacks run on the reactor; anywhere
+// else each ws_cork needs its ws_uncork.
+// returns 0 on success, -1 if conn has closed
+int ws_cork(ws_conn_t conn);
+int ws_uncork(ws_conn_t conn);
+
+// Topics. A connection leaves all of its topics when it closes. Publishing
+// sends one shared frame to every subscriber (see ws_broadcast); ws_publish_from
+// skips conn itself.
+int ws_subscribe(ws_conn_t conn, const char *topic);
+int ws_unsubscribe(ws_conn_t conn, const char *topic);
+int ws_publish(const char *topic, u_int8_t opcode, const u_int8_t *payload, size_t length);
+int ws_publish_from(ws_conn_t conn, const char *topic, u_int8_t opcode, const u_int8_t *payload, size_t length);
 void ws_init(ws_callbacks_t *callbacks);
+
+// Client connections. ws_connect blocks until the upgrade is done (or the
+// handshake timeout passes), then hands the connection to a client reactor
+// thread that calls callbacks for it exactly as for a server connection,
+// starting with on_open, which has run by the time ws_connect returns unless
+// callbacks go to workers. The connection works like any other with
+// ws_send_txt, ws_send_bin and ws_close; frames are masked with keys from a
+// per-thread CSPRNG. Plain ws:// only. It must not be called on a reactor
+// thread, so not from a callback unless callbacks go to workers; a callback
+// that wants to reconnect has to hand that to a thread of its own.
+// returns the connection, or 0 on failure
+ws_conn_t ws_connect(const char *host, const char *port, const char *path, ws_callbacks_t *callbacks);
+
+// Starts the closing handshake with code; the connection closes (and
+// on_close runs) once the peer answers.
+int ws_close(ws_conn_t conn, u_int16_t code);
+
+// One pointer of the application's own per connection, NULL until set. Once
+// conn has closed, ws_set_user_data returns -1 and ws_get_user_data NULL.
+int ws_set_user_data(ws_conn_t conn, void *data);
+void *ws_get_user_data(ws_conn_t conn);
 #define MAX_FRAME_SIZE 1024
 
 #endif /* SWSS_H */
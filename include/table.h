@@ -0,0 +1,41 @@
+#ifndef TABLE_H
+#define TABLE_H
+
+#include "swss.h"
+#include <stddef.h>
+
+// The connection table. Connections live in slabs of WS_TABLE_SLAB slots,
+// allocated as the table grows and never moved or freed, so a slot's address
+// is stable and its slot number is all a handle needs to find it. Each slot
+// is cache-line aligned and keeps a generation that changes every time the
+// slot is reused, which is what tells a live handle from a stale one.
+#define WS_TABLE_SLAB_SHIFT 12
+#define WS_TABLE_SLAB (1u << WS_TABLE_SLAB_SHIFT)
+#define WS_CACHE_LINE 64
+
+struct ws_conn;
+
+// Sizes the table for at most slots connections; slabs are only allocated as
+// they fill. returns 0 on success, -1 on error
+int ws_table_init(size_t slots);
+
+// Takes a free slot and zeroes it, keeping its slot number and giving it the
+// next generation. It can't be looked up until it is published.
+// returns the connection, or NULL if the table is full
+struct ws_conn *ws_table_alloc(void);
+void ws_table_publish(struct ws_conn *conn);
+
+// Makes conn's handle invalid; later lookups fail, references already taken
+// stay good.
+void ws_table_remove(struct ws_conn *conn);
+
+// Returns the slot for reuse once the last reference is gone.
+void ws_table_free(struct ws_conn *conn);
+
+// Takes no lock; a lookup racing with the slot's reuse takes a reference
+// briefly and hands it back when the generation doesn't match.
+// returns the connection handle names, with a reference held, or NULL if it
+// has closed
+struct ws_conn *ws_table_get(ws_conn_t handle);
+
+#endif /* TABLE_H */
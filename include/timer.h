@@ -0,0 +1,57 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define WS_TIMER_TICK_MS 100
+#define WS_TIMER_BITS 6
+#define WS_TIMER_SLOTS (1 << WS_TIMER_BITS)
+#define WS_TIMER_LEVELS 4 // 64^4 ticks, about 19 days, ahead at most
+
+// Intrusive timer, embedded in whatever it times out.
+struct ws_timer
+{
+    struct ws_timer *next;
+    struct ws_timer **pprev; // NULL while not scheduled
+    u_int64_t expires;       // tick
+    u_int16_t slot;          // level * WS_TIMER_SLOTS + index
+};
+
+// Hierarchical timer wheel, one per reactor and touched only by its thread.
+// Level 0 has a slot per tick; each level above covers 64 times the span of
+// the one below, and its slots are spilled into the lower levels as the wheel
+// turns past them. Scheduling and cancelling are O(1) however many timers
+// there are, and a tick with nothing due costs nothing.
+struct ws_timer_wheel
+{
+    u_int64_t origin_ms;
+    u_int64_t clock; // tick the event loop last woke up at
+    u_int64_t now;   // last tick whose timers have fired
+    size_t count;
+    u_int64_t occupied[WS_TIMER_LEVELS]; // a bit per non-empty slot
+    struct ws_timer *slots[WS_TIMER_LEVELS * WS_TIMER_SLOTS];
+};
+
+void ws_timer_wheel_init(struct ws_timer_wheel *wheel);
+
+// Reads the clock. Called when the event loop wakes up, before it handles
+// events, so that they are timestamped with wheel->clock.
+void ws_timer_wheel_update(struct ws_timer_wheel *wheel);
+
+// Fires every timer due by wheel->clock. fire may schedule or cancel timers,
+// including the one it was given, which is no longer scheduled.
+void ws_timer_wheel_expire(struct ws_timer_wheel *wheel, void (*fire)(struct ws_timer *timer));
+
+// returns milliseconds until the wheel next has to turn, for the event loop's
+// wait, or -1 if nothing is scheduled
+int ws_timer_wheel_timeout(const struct ws_timer_wheel *wheel);
+
+// (Re)schedules timer for tick expires; a tick already past fires on the next.
+void ws_timer_schedule(struct ws_timer_wheel *wheel, struct ws_timer *timer, u_int64_t expires);
+void ws_timer_cancel(struct ws_timer_wheel *wheel, struct ws_timer *timer);
+
+// Ticks in ms, rounded up.
+static inline u_int64_t ws_timer_ticks(u_int64_t ms) { return (ms + WS_TIMER_TICK_MS - 1) / WS_TIMER_TICK_MS; }
+
+#endif /* TIMER_H */
@@ -0,0 +1,29 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include "swss.h"
+#include <openssl/ssl.h>
+#include <sys/uio.h>
+
+struct ws_conn;
+
+int ws_tls_init(const ws_tls_opts_t *opts);
+int ws_tls_enabled(void);
+int ws_tls_accept(struct ws_conn *conn);
+int ws_tls_handshake(struct ws_conn *conn);
+void ws_tls_shutdown(struct ws_conn *conn);
+
+// Socket I/O for a connection, through the TLS record layer when encryption
+// is done in user space and straight to the socket otherwise (plain or kTLS).
+// With io_uring, reads come from the buffer the kernel already filled and
+// writes on the owning reactor are batched. Same contract as recvmsg/sendmsg
+// with MSG_DONTWAIT.
+ssize_t ws_conn_readv(struct ws_conn *conn, struct iovec *iov, int iovcnt);
+ssize_t ws_conn_writev(struct ws_conn *conn, const struct iovec *iov, int iovcnt);
+
+// Writes up to len bytes of fd from offset, with sendfile(2) unless the bytes
+// have to be encrypted in user space. Same contract as ws_conn_writev; a file
+// that ends early is an error.
+ssize_t ws_conn_sendfile(struct ws_conn *conn, int fd, off_t offset, size_t len);
+
+#endif /* TLS_H */
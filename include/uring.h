@@ -0,0 +1,47 @@
+#ifndef URING_H
+#define URING_H
+
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#define WS_URING_ENTRIES 1024  // submission queue; the completion queue is 4x
+#define WS_URING_BUFS 512      // provided receive buffers per reactor
+#define WS_URING_BUF_SIZE 4096
+#define WS_URING_SEND_IOV 64   // queued pieces per batched sendmsg
+
+struct ws_conn;
+struct ws_reactor;
+struct ws_uring;
+
+// A connection's in-flight sendmsg. The kernel reads it after submission, so
+// it lives as long as the connection.
+struct ws_uring_tx
+{
+    struct msghdr msg;
+    struct iovec iov[WS_URING_SEND_IOV];
+};
+
+int ws_uring_probe(void);
+struct ws_uring *ws_uring_new(void);
+int ws_uring_run(struct ws_reactor *reactor, struct ws_uring *ring);
+
+// Called with out_lock held by a writer about to send on conn. On the
+// reactor that owns conn the write is left in the send queue and submitted
+// with the rest of the loop iteration's output.
+// returns 1 if the write was deferred, 0 if the caller should write itself
+int ws_uring_defer_send(struct ws_conn *conn);
+
+// Copies out of the receive buffer the kernel filled for conn; same contract
+// as recvmsg with MSG_DONTWAIT.
+ssize_t ws_uring_readv(struct ws_conn *conn, struct iovec *iov, int iovcnt);
+
+// Cancels conn's pending operations and closes its socket after them.
+void ws_uring_close(struct ws_conn *conn);
+
+// Stops and restarts conn's receive while its reads are paused. Owning
+// reactor only.
+// ws_uring_resume returns -1 if the receive could not be re-armed
+void ws_uring_pause(struct ws_conn *conn);
+int ws_uring_resume(struct ws_conn *conn);
+
+#endif /* URING_H */
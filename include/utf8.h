@@ -0,0 +1,37 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Where a text message stands between two pieces: how many continuation
+// bytes the character split by the last piece still needs, and the range the
+// next one must fall in. All zero at the start of a message.
+struct ws_utf8
+{
+    u_int8_t need;
+    u_int8_t lo;
+    u_int8_t hi;
+};
+
+// Checks the next piece of a text message as UTF-8 (RFC 3629: no overlong
+// forms, surrogates or code points past U+10FFFF). Pieces may split a
+// character anywhere.
+// returns 0 if the text is valid so far, -1 otherwise
+int ws_utf8_feed(struct ws_utf8 *st, const u_int8_t *data, size_t len);
+
+// returns 0 if the text fed to st ended on a character boundary, -1 otherwise
+static inline int ws_utf8_end(const struct ws_utf8 *st) { return st->need == 0 ? 0 : -1; }
+
+// Checks a whole text.
+// returns 0 if it is valid UTF-8, -1 otherwise
+int ws_utf8_valid(const u_int8_t *data, size_t len);
+
+// The individual kernels, for benchmarking. Each checks a whole text.
+int ws_utf8_scalar(const u_int8_t *data, size_t len);
+int ws_utf8_sse4(const u_int8_t *data, size_t len);
+int ws_utf8_avx2(const u_int8_t *data, size_t len);
+int ws_utf8_have_sse4(void);
+int ws_utf8_have_avx2(void);
+
+#endif /* UTF8_H */
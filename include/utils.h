@@ -1,7 +1,11 @@
-#include <b64/cencode.h>
 #include <openssl/sha.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-char *ws_createAcceptToken(char *key);
-char *ws_generateHTTPResponse(char *key);
+
+#define WS_KEY_MAX 64
+#define WS_ACCEPT_LEN 28 // base64 of a SHA-1 digest
+#define WS_RESPONSE_MAX 512
+
+int ws_createAcceptToken(const char *key, size_t key_len, char accept[WS_ACCEPT_LEN + 1]);
+size_t ws_generateHTTPResponse(char *response, size_t size, const char *accept, const char *extensions);
@@ -0,0 +1,70 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include "swss.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct ws_conn;
+
+// The callbacks a reactor can hand to a worker.
+enum ws_task_type
+{
+    WS_TASK_OPEN,
+    WS_TASK_MESSAGE, // arg: text
+    WS_TASK_BEGIN,   // arg: text
+    WS_TASK_CHUNK,
+    WS_TASK_END,
+    WS_TASK_DRAIN,
+    WS_TASK_ERROR, // arg: close code
+    WS_TASK_CLOSE,
+};
+
+// One deferred callback, holding a reference to its connection.
+struct ws_task
+{
+    struct ws_task *next;
+    struct ws_conn *conn;
+    u_int8_t type;
+    int arg;
+    u_int8_t *data; // pooled buffer owned by the task
+    size_t len;
+};
+
+// Callbacks for one connection, run in order by one worker at a time.
+// Embedded in the connection, which every queued task holds a reference to.
+struct ws_serial
+{
+    _Atomic(struct ws_task *) tasks; // newest first
+    atomic_int queued;               // on a run queue or running; one runner at a time
+    struct ws_serial *next;          // run queue link
+};
+
+// Starts the worker pool. A connection whose queued payloads drop to
+// low_water after its reads were paused is handed back to its reactor.
+// Without a pool callbacks run on the reactor threads.
+// returns 0 on success, -1 on error
+int ws_workers_start(int threads, size_t low_water);
+int ws_workers_enabled(void);
+
+// Runs one of conn's callbacks: right away without a pool, otherwise on a
+// worker, after every callback queued before it for the same connection.
+// _take hands a pooled buffer over with the call; _copy lends data for the
+// call only and copies it if the call is deferred.
+void ws_callback(struct ws_conn *conn, u_int8_t type, int arg);
+void ws_callback_take(struct ws_conn *conn, u_int8_t type, int arg, u_int8_t *buf, size_t len);
+void ws_callback_copy(struct ws_conn *conn, u_int8_t type, const u_int8_t *data, size_t len);
+
+// The connection whose callback the calling worker is running, if handle
+// names it, with a reference held; a handler reaches its own connection even
+// once it has closed.
+// returns NULL otherwise
+struct ws_conn *ws_worker_conn(ws_conn_t handle);
+
+// Counts a cork taken (delta 1) or released (-1) on conn by the calling
+// thread; one the running callback took on its own connection and didn't
+// release is released when the callback returns.
+void ws_worker_count_cork(struct ws_conn *conn, int delta);
+
+#endif /* WORKER_H */
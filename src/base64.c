@@ -4,13 +4,11 @@
 static const char base64_chars[] =
     "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-char *base64_encode(const unsigned char *data, size_t input_length, size_t *output_length)
+// Encodes into out, which must have room for BASE64_ENCODED_SIZE(input_length)
+// bytes plus a terminating NUL. returns the encoded length
+size_t base64_encode(const unsigned char *data, size_t input_length, char *out)
 {
-    *output_length = 4 * ((input_length + 2) / 3);
-    char *encoded_data = malloc(*output_length + 1);
-
-    if (encoded_data == NULL)
-        return NULL;
+    size_t output_length = BASE64_ENCODED_SIZE(input_length);
 
     for (size_t i = 0, j = 0; i < input_length;)
     {
@@ -20,22 +18,22 @@ char *base64_encode(const unsigned char *data, size_t input_length, size_t *outp
 
         uint32_t triple = (octet_a << 16) + (octet_b << 8) + octet_c;
 
-        encoded_data[j++] = base64_chars[(triple >> 18) & 0x3F];
-        encoded_data[j++] = base64_chars[(triple >> 12) & 0x3F];
-        encoded_data[j++] = base64_chars[(triple >> 6) & 0x3F];
-        encoded_data[j++] = base64_chars[triple & 0x3F];
+        out[j++] = base64_chars[(triple >> 18) & 0x3F];
+        out[j++] = base64_chars[(triple >> 12) & 0x3F];
+        out[j++] = base64_chars[(triple >> 6) & 0x3F];
+        out[j++] = base64_chars[triple & 0x3F];
     }
 
     size_t padding = input_length % 3;
     if (padding > 0)
     {
-        encoded_data[*output_length - 1] = '=';
+        out[output_length - 1] = '=';
         if (padding == 1)
         {
-            encoded_data[*output_length - 2] = '=';
+            out[output_length - 2] = '=';
         }
     }
 
-    encoded_data[*output_length] = '\0';
-    return encoded_data;
-}
\ No newline at end of file
+    out[output_length] = '\0';
+    return output_length;
+}
@@ -0,0 +1,328 @@
+#define _GNU_SOURCE
+#include "../include/client.h"
+#include "../include/base64.h"
+#include "../include/log.h"
+#include "../include/random.h"
+#include "../include/reactor.h"
+#include <netinet/tcp.h>
+#include <sys/time.h>
+
+#define WS_CLIENT_NONCE 16
+#define WS_CLIENT_RESPONSE_MAX 4096
+
+// Opens a TCP connection to host:port, giving up after timeout_ms (-1: never).
+// returns the socket, or -1
+static int ws_client_dial(const char *host, const char *port, int timeout_ms)
+{
+    struct addrinfo hints, *res, *p;
+    int fd = -1, yes = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int err = getaddrinfo(host, port, &hints, &res);
+    if (err != 0)
+    {
+        ws_log_error("getaddrinfo %s: %s", host, gai_strerror(err));
+        return -1;
+    }
+
+    struct timeval tv = {0};
+    if (timeout_ms > 0)
+    {
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+    }
+    for (p = res; p != NULL; p = p->ai_next)
+    {
+        fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
+        if (fd == -1)
+        {
+            continue;
+        }
+        // the timeouts bound connect and the blocking upgrade that follows
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+        {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd == -1)
+    {
+        ws_log_perror("connect");
+        return -1;
+    }
+    // frames are written whole, so there is nothing for Nagle to coalesce
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    return fd;
+}
+
+// Finds the value of header name in an upgrade response.
+// returns its length, or -1 if it isn't there
+static int ws_client_header(const char *response, const char *name, const char **value)
+{
+    size_t name_len = strlen(name);
+    const char *line = strstr(response, "\r\n");
+    while (line && line[2] != '\r')
+    {
+        line += 2;
+        const char *end = strstr(line, "\r\n");
+        if (end && (size_t)(end - line) > name_len && line[name_len] == ':' &&
+            strncasecmp(line, name, name_len) == 0)
+        {
+            const char *v = line + name_len + 1;
+            while (v < end && (*v == ' ' || *v == '\t'))
+            {
+                v++;
+            }
+            while (end > v && (end[-1] == ' ' || end[-1] == '\t'))
+            {
+                end--;
+            }
+            *value = v;
+            return end - v;
+        }
+        line = end;
+    }
+    return -1;
+}
+
+// Checks the server agreed to the upgrade asked for with key. No extensions
+// were offered, so the server may not select any.
+// returns 0 if it did, -1 otherwise
+static int ws_client_check_response(const char *response, const char *key)
+{
+    const char *value;
+    int len;
+    char accept[WS_ACCEPT_LEN + 1];
+
+    if (strncmp(response, "HTTP/1.1 101", 12) != 0)
+    {
+        return -1;
+    }
+    len = ws_client_header(response, "Upgrade", &value);
+    if (len != 9 || strncasecmp(value, "websocket", 9) != 0)
+    {
+        return -1;
+    }
+    if (ws_createAcceptToken(key, strlen(key), accept) == -1)
+    {
+        return -1;
+    }
+    len = ws_client_header(response, "Sec-WebSocket-Accept", &value);
+    if (len != WS_ACCEPT_LEN || memcmp(value, accept, WS_ACCEPT_LEN) != 0)
+    {
+        return -1;
+    }
+    if (ws_client_header(response, "Sec-WebSocket-Extensions", &value) != -1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// Sends the upgrade request and reads the response, on the blocking socket.
+// Whatever the server sent after the response is left in buf from *early.
+// returns the number of bytes read, or -1 if the upgrade failed
+static ssize_t ws_client_upgrade(int fd, const char *host, const char *port, const char *path, char *buf,
+                                 size_t size, size_t *early)
+{
+    u_int8_t nonce[WS_CLIENT_NONCE];
+    char key[BASE64_ENCODED_SIZE(WS_CLIENT_NONCE) + 1];
+    ws_random_bytes(nonce, sizeof(nonce));
+    key[base64_encode(nonce, sizeof(nonce), key)] = '\0';
+
+    char request[WS_HANDSHAKE_MAX];
+    int len = snprintf(request, sizeof(request),
+                       "GET %s HTTP/1.1\r\n"
+                       "Host: %s:%s\r\n"
+                       "Upgrade: websocket\r\n"
+                       "Connection: Upgrade\r\n"
+                       "Sec-WebSocket-Key: %s\r\n"
+                       "Sec-WebSocket-Version: 13\r\n"
+                       "\r\n",
+                       path, host, port, key);
+    if (len < 0 || (size_t)len >= sizeof(request))
+    {
+        ws_log_error("upgrade request too long");
+        return -1;
+    }
+    for (int sent = 0; sent < len;)
+    {
+        ssize_t n = send(fd, request + sent, len - sent, MSG_NOSIGNAL);
+        if (n == -1 && errno != EINTR)
+        {
+            ws_log_perror("send");
+            return -1;
+        }
+        sent += n > 0 ? n : 0;
+    }
+
+    size_t have = 0;
+    char *end = NULL;
+    while (end == NULL)
+    {
+        if (have == size - 1)
+        {
+            ws_log_error("upgrade response too long");
+            return -1;
+        }
+        ssize_t n = recv(fd, buf + have, size - 1 - have, 0);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            ws_log_perror("recv");
+            return -1;
+        }
+        have += n;
+        buf[have] = '\0';
+        end = strstr(buf, "\r\n\r\n");
+    }
+
+    *early = end + 4 - buf;
+    end[2] = '\0';
+    if (ws_client_check_response(buf, key) == -1)
+    {
+        ws_log_error("server refused the upgrade");
+        return -1;
+    }
+    return have;
+}
+
+ws_conn_t ws_connect(const char *host, const char *port, const char *path, ws_callbacks_t *callbacks)
+{
+    if (host == NULL || port == NULL || callbacks == NULL)
+    {
+        return 0;
+    }
+    if (path == NULL || path[0] == '\0')
+    {
+        path = "/";
+    }
+
+    // the client reactor would wait on itself, and a server reactor would
+    // stall every connection it serves for the whole handshake
+    if (ws_on_reactor_thread())
+    {
+        ws_log_error("ws_connect called on a reactor thread");
+        return 0;
+    }
+
+    struct ws_reactor *reactor = ws_client_reactor();
+    if (!reactor)
+    {
+        return 0;
+    }
+
+    int fd = ws_client_dial(host, port, ws_client_timeout_ms());
+    if (fd == -1)
+    {
+        return 0;
+    }
+
+    char response[WS_CLIENT_RESPONSE_MAX];
+    size_t early;
+    ssize_t have = ws_client_upgrade(fd, host, port, path, response, sizeof(response), &early);
+    struct timeval none = {0};
+    if (have == -1 || setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &none, sizeof(none)) == -1 ||
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none)) == -1 || ws_set_nonblocking(fd) == -1)
+    {
+        close(fd);
+        return 0;
+    }
+
+    // from here on the socket is the reactor's
+    struct ws_client_join join;
+    join.fd = fd;
+    join.callbacks = callbacks;
+    join.early = (const u_int8_t *)response + early;
+    join.early_len = have - early;
+    join.res = 0;
+    sem_init(&join.done, 0, 0);
+
+    struct ws_client_join *head = atomic_load_explicit(&reactor->joining, memory_order_relaxed);
+    do
+    {
+        join.next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&reactor->joining, &head, &join, memory_order_release,
+                                                    memory_order_relaxed));
+    if (head == NULL)
+    {
+        u_int64_t one = 1;
+        while (write(reactor->wake_fd, &one, sizeof(one)) == -1 && errno == EINTR)
+        {
+        }
+    }
+
+    while (sem_wait(&join.done) == -1 && errno == EINTR)
+    {
+    }
+    sem_destroy(&join.done);
+    return join.res;
+}
+
+// Takes over one upgraded connection: registers it, replays the bytes that
+// came with the upgrade response and opens it. Called on the client reactor.
+// returns the connection, or NULL if it was closed
+static struct ws_conn *ws_client_open(struct ws_reactor *reactor, struct ws_client_join *join)
+{
+    struct ws_conn *conn = ws_conn_new(join->fd);
+    if (!conn)
+    {
+        close(join->fd);
+        return NULL;
+    }
+    conn->callbacks = join->callbacks;
+    conn->client = 1;
+
+    if (ws_ring_init(&conn->rbuf, WS_READ_BUF_SIZE) == -1 || ws_reactor_add(reactor, conn) == -1)
+    {
+        ws_conn_close(conn);
+        return NULL;
+    }
+    if (join->early_len > 0)
+    {
+        // fits: the response buffer is smaller than the ring
+        struct iovec iov[2];
+        int iovcnt = ws_ring_free_iov(&conn->rbuf, iov);
+        size_t copied = 0;
+        for (int i = 0; i < iovcnt && copied < join->early_len; i++)
+        {
+            size_t n = join->early_len - copied < iov[i].iov_len ? join->early_len - copied : iov[i].iov_len;
+            memcpy(iov[i].iov_base, join->early + copied, n);
+            copied += n;
+        }
+        ws_ring_commit(&conn->rbuf, copied);
+    }
+    ws_conn_open(conn);
+    return conn;
+}
+
+void ws_client_adopt(struct ws_reactor *reactor)
+{
+    struct ws_client_join *join = atomic_exchange_explicit(&reactor->joining, NULL, memory_order_acquire);
+    while (join)
+    {
+        // join is gone once done is posted
+        struct ws_client_join *next = join->next;
+        struct ws_conn *conn = ws_client_open(reactor, join);
+        join->res = conn ? ws_conn_handle(conn) : 0;
+        sem_post(&join->done);
+
+        // frames may have arrived with the response, or since
+        if (conn && ws_conn_on_readable(conn) == -1)
+        {
+            ws_conn_close(conn);
+        }
+        join = next;
+    }
+}
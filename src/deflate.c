@@ -0,0 +1,526 @@
+#include "../include/deflate.h"
+#include "../include/pool.h"
+#include <ctype.h>
+
+// The empty stored block Z_SYNC_FLUSH ends with. RFC 7692 strips it from every
+// compressed message and the receiver appends it back before inflating.
+static const u_int8_t deflate_tail[4] = {0x00, 0x00, 0xff, 0xff};
+
+// Streams shared by every connection on a thread that negotiated no context
+// takeover, one compressor per window size. They are reset after each message.
+struct ws_deflate_shared
+{
+    z_stream tx[16];
+    int tx_level[16];
+    u_int8_t tx_ready[16];
+    z_stream rx;
+    u_int8_t rx_ready;
+};
+
+static __thread struct ws_deflate_shared *tls_shared;
+static pthread_key_t g_shared_key;
+static pthread_once_t g_shared_once = PTHREAD_ONCE_INIT;
+
+static void ws_deflate_shared_release(void *arg)
+{
+    struct ws_deflate_shared *shared = arg;
+    for (int i = 0; i < 16; i++)
+    {
+        if (shared->tx_ready[i])
+        {
+            deflateEnd(&shared->tx[i]);
+        }
+    }
+    if (shared->rx_ready)
+    {
+        inflateEnd(&shared->rx);
+    }
+    free(shared);
+}
+
+static void ws_deflate_shared_key_init(void) { pthread_key_create(&g_shared_key, ws_deflate_shared_release); }
+
+static struct ws_deflate_shared *ws_deflate_shared_get(void)
+{
+    if (tls_shared == NULL)
+    {
+        tls_shared = calloc(1, sizeof(struct ws_deflate_shared));
+        if (tls_shared == NULL)
+        {
+            return NULL;
+        }
+        pthread_once(&g_shared_once, ws_deflate_shared_key_init);
+        pthread_setspecific(g_shared_key, tls_shared);
+    }
+    return tls_shared;
+}
+
+// Copies the next ';' or ',' separated token of s into buf, trimmed.
+// returns the separator that ended it ('\0' at the end of the header)
+static char ws_deflate_token(const char **s, char *buf, size_t size)
+{
+    const char *p = *s;
+    while (*p == ' ' || *p == '\t')
+    {
+        p++;
+    }
+
+    size_t n = 0;
+    while (*p && *p != ';' && *p != ',')
+    {
+        if (*p != '"' && n + 1 < size)
+        {
+            buf[n++] = *p;
+        }
+        p++;
+    }
+    while (n > 0 && (buf[n - 1] == ' ' || buf[n - 1] == '\t'))
+    {
+        n--;
+    }
+    buf[n] = '\0';
+
+    char sep = *p;
+    *s = (*p) ? p + 1 : p;
+    return sep;
+}
+
+static int ws_deflate_window_bits(const char *value)
+{
+    if (!isdigit((unsigned char)value[0]))
+    {
+        return -1;
+    }
+    int bits = atoi(value);
+    return (bits >= 8 && bits <= 15) ? bits : -1;
+}
+
+// Reads the parameters of one permessage-deflate offer up to the next ',' and
+// settles them against our options. returns 0 if the offer can be accepted
+static int ws_deflate_accept_offer(const ws_deflate_opts_t *opts, const char **offers,
+                                   struct ws_deflate *d, int *client_bits_offered, char *sep)
+{
+    int seen = 0;
+    int valid = 1;
+    char token[64];
+
+    d->server_no_context_takeover = opts->server_no_context_takeover ? 1 : 0;
+    d->client_no_context_takeover = opts->client_no_context_takeover ? 1 : 0;
+    d->server_max_window_bits = opts->server_max_window_bits ? opts->server_max_window_bits : 15;
+    d->client_max_window_bits = 15;
+    *client_bits_offered = 0;
+
+    while (*sep == ';')
+    {
+        *sep = ws_deflate_token(offers, token, sizeof(token));
+
+        char *value = strchr(token, '=');
+        if (value)
+        {
+            *value++ = '\0';
+            while (*value == ' ')
+            {
+                value++;
+            }
+        }
+
+        int bit;
+        if (strcmp(token, "server_no_context_takeover") == 0 && !value)
+        {
+            bit = 1;
+            d->server_no_context_takeover = 1;
+        }
+        else if (strcmp(token, "client_no_context_takeover") == 0 && !value)
+        {
+            bit = 2;
+            d->client_no_context_takeover = 1;
+        }
+        else if (strcmp(token, "server_max_window_bits") == 0 && value)
+        {
+            bit = 4;
+            int bits = ws_deflate_window_bits(value);
+            // zlib can't produce a raw stream with an 8-bit window
+            if (bits < 9)
+            {
+                valid = 0;
+            }
+            else if (bits < d->server_max_window_bits)
+            {
+                d->server_max_window_bits = bits;
+            }
+        }
+        else if (strcmp(token, "client_max_window_bits") == 0)
+        {
+            bit = 8;
+            int bits = value ? ws_deflate_window_bits(value) : 15;
+            if (bits < 0)
+            {
+                valid = 0;
+            }
+            d->client_max_window_bits = bits;
+            *client_bits_offered = 1;
+        }
+        else
+        {
+            bit = 0;
+            valid = 0;
+        }
+
+        if (seen & bit)
+        {
+            valid = 0;
+        }
+        seen |= bit;
+    }
+
+    if (d->server_max_window_bits < 9)
+    {
+        d->server_max_window_bits = 9;
+    }
+
+    // the client window may only be limited if the client said it can be
+    if (*client_bits_offered && opts->client_max_window_bits >= 9 &&
+        opts->client_max_window_bits < d->client_max_window_bits)
+    {
+        d->client_max_window_bits = opts->client_max_window_bits;
+    }
+
+    return valid ? 0 : -1;
+}
+
+// Picks the first acceptable permessage-deflate offer from the value of the
+// Sec-WebSocket-Extensions request header and writes our answer to response.
+// returns the connection's deflate state, or NULL to run uncompressed
+struct ws_deflate *ws_deflate_negotiate(const ws_deflate_opts_t *opts, const char *offers,
+                                        char *response, size_t response_size)
+{
+    if (!opts->enabled || offers == NULL)
+    {
+        return NULL;
+    }
+
+    char token[64];
+    const char *p = offers;
+
+    while (*p)
+    {
+        char sep = ws_deflate_token(&p, token, sizeof(token));
+
+        if (strcmp(token, "permessage-deflate") != 0)
+        {
+            // skip the parameters of an extension we don't implement
+            while (sep == ';')
+            {
+                sep = ws_deflate_token(&p, token, sizeof(token));
+            }
+            continue;
+        }
+
+        struct ws_deflate d;
+        int client_bits_offered;
+        memset(&d, 0, sizeof(d));
+        if (ws_deflate_accept_offer(opts, &p, &d, &client_bits_offered, &sep) == -1)
+        {
+            continue;
+        }
+
+        int n = snprintf(response, response_size, "permessage-deflate%s%s",
+                         d.server_no_context_takeover ? "; server_no_context_takeover" : "",
+                         d.client_no_context_takeover ? "; client_no_context_takeover" : "");
+        if (d.server_max_window_bits < 15)
+        {
+            n += snprintf(response + n, response_size - n, "; server_max_window_bits=%d",
+                          d.server_max_window_bits);
+        }
+        if (client_bits_offered && d.client_max_window_bits < 15)
+        {
+            n += snprintf(response + n, response_size - n, "; client_max_window_bits=%d",
+                          d.client_max_window_bits);
+        }
+
+        struct ws_deflate *state = malloc(sizeof(struct ws_deflate));
+        if (!state)
+        {
+            return NULL;
+        }
+        *state = d;
+        state->level = opts->level ? opts->level : Z_DEFAULT_COMPRESSION;
+        return state;
+    }
+
+    return NULL;
+}
+
+// Compresses one whole message. The result is a pooled buffer that the caller
+// releases with ws_buf_free, with the trailing 00 00 ff ff already stripped.
+// returns 0 on success, -1 on failure
+int ws_deflate_compress(struct ws_deflate *d, const u_int8_t *in, size_t len,
+                        u_int8_t **out, size_t *out_len)
+{
+    int bits = d->server_max_window_bits;
+    z_stream *zs;
+    struct ws_deflate_shared *shared = NULL;
+
+    if (d->server_no_context_takeover)
+    {
+        shared = ws_deflate_shared_get();
+        if (!shared)
+        {
+            return -1;
+        }
+        zs = &shared->tx[bits];
+        if (shared->tx_ready[bits] && shared->tx_level[bits] != d->level)
+        {
+            deflateEnd(zs);
+            shared->tx_ready[bits] = 0;
+        }
+        if (!shared->tx_ready[bits])
+        {
+            memset(zs, 0, sizeof(*zs));
+            if (deflateInit2(zs, d->level, Z_DEFLATED, -bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            {
+                return -1;
+            }
+            shared->tx_ready[bits] = 1;
+            shared->tx_level[bits] = d->level;
+        }
+    }
+    else
+    {
+        zs = &d->tx;
+        if (!d->tx_ready)
+        {
+            memset(zs, 0, sizeof(*zs));
+            if (deflateInit2(zs, d->level, Z_DEFLATED, -bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            {
+                return -1;
+            }
+            d->tx_ready = 1;
+        }
+    }
+
+    size_t cap = deflateBound(zs, len) + 16;
+    u_int8_t *buf = ws_buf_alloc(cap);
+    if (!buf)
+    {
+        return -1;
+    }
+    cap = ws_buf_capacity(buf);
+
+    zs->next_in = (Bytef *)in;
+    zs->avail_in = len;
+    size_t produced = 0;
+    int res;
+    do
+    {
+        if (produced == cap)
+        {
+            u_int8_t *grown = ws_buf_grow(buf, produced, cap * 2);
+            if (!grown)
+            {
+                ws_buf_free(buf);
+                return -1;
+            }
+            buf = grown;
+            cap = ws_buf_capacity(buf);
+        }
+        zs->next_out = buf + produced;
+        zs->avail_out = cap - produced;
+        res = deflate(zs, Z_SYNC_FLUSH);
+        produced = cap - zs->avail_out;
+    } while (res == Z_OK && (zs->avail_in > 0 || zs->avail_out == 0));
+
+    if (shared)
+    {
+        deflateReset(zs);
+    }
+    if ((res != Z_OK && res != Z_BUF_ERROR) || produced < 4)
+    {
+        ws_buf_free(buf);
+        return -1;
+    }
+
+    *out = buf;
+    *out_len = produced - 4;
+    return 0;
+}
+
+// Inflates one whole message received with RSV1 set into a pooled buffer,
+// giving up once the output passes max_len.
+// returns 0 on success, -1 if the data is not a valid deflate stream, -2 if
+// the inflated message is too big
+int ws_deflate_decompress(struct ws_deflate *d, const u_int8_t *in, size_t len, size_t max_len,
+                          u_int8_t **out, size_t *out_len)
+{
+    z_stream *zs;
+    struct ws_deflate_shared *shared = NULL;
+
+    if (d->client_no_context_takeover)
+    {
+        shared = ws_deflate_shared_get();
+        if (!shared)
+        {
+            return -1;
+        }
+        zs = &shared->rx;
+        if (!shared->rx_ready)
+        {
+            memset(zs, 0, sizeof(*zs));
+            if (inflateInit2(zs, -15) != Z_OK)
+            {
+                return -1;
+            }
+            shared->rx_ready = 1;
+        }
+    }
+    else
+    {
+        zs = &d->rx;
+        if (!d->rx_ready)
+        {
+            memset(zs, 0, sizeof(*zs));
+            // a 15-bit window accepts whatever smaller window the client used
+            if (inflateInit2(zs, -15) != Z_OK)
+            {
+                return -1;
+            }
+            d->rx_ready = 1;
+        }
+    }
+
+    size_t cap = len < 256 ? 1024 : len * 4;
+    if (cap > max_len + 1 && max_len >= 1024)
+    {
+        cap = max_len + 1;
+    }
+    u_int8_t *buf = ws_buf_alloc(cap);
+    if (!buf)
+    {
+        return -1;
+    }
+    cap = ws_buf_capacity(buf);
+
+    size_t produced = 0;
+    int res = Z_OK;
+    for (int pass = 0; pass < 2 && (res == Z_OK || res == Z_BUF_ERROR); pass++)
+    {
+        zs->next_in = (Bytef *)(pass == 0 ? in : deflate_tail);
+        zs->avail_in = pass == 0 ? len : sizeof(deflate_tail);
+
+        do
+        {
+            if (produced > max_len)
+            {
+                res = Z_MEM_ERROR;
+                break;
+            }
+            if (produced == cap)
+            {
+                u_int8_t *grown = ws_buf_grow(buf, produced, cap * 2);
+                if (!grown)
+                {
+                    res = Z_MEM_ERROR;
+                    break;
+                }
+                buf = grown;
+                cap = ws_buf_capacity(buf);
+            }
+            zs->next_out = buf + produced;
+            zs->avail_out = cap - produced;
+            res = inflate(zs, Z_SYNC_FLUSH);
+            produced = cap - zs->avail_out;
+        } while (res == Z_OK && (zs->avail_in > 0 || zs->avail_out == 0));
+    }
+
+    if (shared)
+    {
+        inflateReset(zs);
+    }
+    // a message may end the deflate stream with a final block
+    if (res != Z_OK && res != Z_BUF_ERROR && res != Z_STREAM_END)
+    {
+        ws_buf_free(buf);
+        return res == Z_MEM_ERROR && produced > max_len ? -2 : -1;
+    }
+    if (produced > max_len)
+    {
+        ws_buf_free(buf);
+        return -2;
+    }
+    if (res == Z_STREAM_END && !shared)
+    {
+        inflateReset(zs);
+    }
+
+    *out = buf;
+    *out_len = produced;
+    return 0;
+}
+
+// Inflates the next piece of a compressed message as it arrives and passes the
+// output to emit in bounded chunks, so a message is never held whole. last
+// marks the final piece of the message. A streamed message always uses the
+// connection's own stream, since it spans reads that other connections on the
+// thread interleave with.
+// returns 0 on success, -1 on invalid data, -2 if emit fails
+int ws_deflate_inflate_stream(struct ws_deflate *d, const u_int8_t *in, size_t len, int last,
+                              int (*emit)(void *ctx, const u_int8_t *data, size_t len), void *ctx)
+{
+    z_stream *zs = &d->rx;
+    if (!d->rx_ready)
+    {
+        memset(zs, 0, sizeof(*zs));
+        if (inflateInit2(zs, -15) != Z_OK)
+        {
+            return -1;
+        }
+        d->rx_ready = 1;
+    }
+
+    u_int8_t out[16384];
+    int res = Z_OK;
+    for (int pass = 0; pass < (last ? 2 : 1); pass++)
+    {
+        zs->next_in = (Bytef *)(pass == 0 ? in : deflate_tail);
+        zs->avail_in = pass == 0 ? len : sizeof(deflate_tail);
+
+        do
+        {
+            zs->next_out = out;
+            zs->avail_out = sizeof(out);
+            res = inflate(zs, Z_SYNC_FLUSH);
+            if (res != Z_OK && res != Z_BUF_ERROR && res != Z_STREAM_END)
+            {
+                return -1;
+            }
+            size_t produced = sizeof(out) - zs->avail_out;
+            if (produced > 0 && emit(ctx, out, produced) == -1)
+            {
+                return -2;
+            }
+        } while (res == Z_OK && (zs->avail_in > 0 || zs->avail_out == 0));
+    }
+
+    if (last && (d->client_no_context_takeover || res == Z_STREAM_END))
+    {
+        inflateReset(zs);
+    }
+    return 0;
+}
+
+void ws_deflate_free(struct ws_deflate *d)
+{
+    if (d == NULL)
+    {
+        return;
+    }
+    if (d->tx_ready)
+    {
+        deflateEnd(&d->tx);
+    }
+    if (d->rx_ready)
+    {
+        inflateEnd(&d->rx);
+    }
+    free(d);
+}
@@ -0,0 +1,122 @@
+#include "../include/inbox.h"
+#include "../include/log.h"
+#include "../include/reactor.h"
+
+static void ws_reactor_wake(struct ws_reactor *reactor, struct ws_conn *conn)
+{
+    // the reference is dropped once the reactor has handled the connection
+    atomic_fetch_add_explicit(&conn->refs, 1, memory_order_relaxed);
+    struct ws_conn *head = atomic_load_explicit(&reactor->ready, memory_order_relaxed);
+    do
+    {
+        conn->ready_next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&reactor->ready, &head, conn, memory_order_release,
+                                                    memory_order_relaxed));
+
+    if (head == NULL)
+    {
+        u_int64_t one = 1;
+        if (write(reactor->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        {
+            ws_log_perror("eventfd write");
+        }
+    }
+}
+
+int ws_inbox_push(struct ws_conn *conn, struct ws_outq_entry *entry)
+{
+    size_t len = ws_outq_entry_len(entry);
+    atomic_fetch_add_explicit(&conn->inbox_bytes, len, memory_order_relaxed);
+
+    struct ws_outq_entry *head = atomic_load_explicit(&conn->inbox, memory_order_relaxed);
+    do
+    {
+        if (head == WS_INBOX_CLOSED)
+        {
+            atomic_fetch_sub_explicit(&conn->inbox_bytes, len, memory_order_relaxed);
+            ws_outq_entry_free(entry);
+            return -1;
+        }
+        entry->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&conn->inbox, &head, entry, memory_order_seq_cst,
+                                                    memory_order_relaxed));
+
+    // a connection that is already on the ready list, or whose inbox was not
+    // empty, will be drained anyway; a corked one once the cork is released
+    // (see ws_conn_release_corks)
+    if (head == NULL && atomic_load(&conn->inbox_corks) == 0)
+    {
+        ws_inbox_kick(conn);
+    }
+    return 0;
+}
+
+void ws_inbox_kick(struct ws_conn *conn)
+{
+    if (!atomic_exchange_explicit(&conn->inbox_ready, 1, memory_order_acq_rel))
+    {
+        ws_reactor_wake(conn->reactor, conn);
+    }
+}
+
+struct ws_outq_entry *ws_inbox_take(struct ws_conn *conn)
+{
+    // only the owning reactor closes the inbox, so it cannot close under us
+    struct ws_outq_entry *head = atomic_load_explicit(&conn->inbox, memory_order_relaxed);
+    if (head == NULL || head == WS_INBOX_CLOSED)
+    {
+        return NULL;
+    }
+    head = atomic_exchange_explicit(&conn->inbox, NULL, memory_order_acquire);
+
+    struct ws_outq_entry *oldest = NULL;
+    while (head)
+    {
+        struct ws_outq_entry *next = head->next;
+        head->next = oldest;
+        oldest = head;
+        head = next;
+    }
+    return oldest;
+}
+
+void ws_inbox_close(struct ws_conn *conn)
+{
+    struct ws_outq_entry *e = atomic_exchange_explicit(&conn->inbox, WS_INBOX_CLOSED, memory_order_acquire);
+    while (e && e != WS_INBOX_CLOSED)
+    {
+        struct ws_outq_entry *next = e->next;
+        atomic_fetch_sub_explicit(&conn->inbox_bytes, ws_outq_entry_len(e), memory_order_relaxed);
+        ws_outq_entry_free(e);
+        e = next;
+    }
+}
+
+void ws_reactor_on_wake(struct ws_reactor *reactor)
+{
+    // empty the eventfd before the list: a connection pushed after the
+    // exchange then always leaves a fresh wakeup behind
+    u_int64_t count;
+    while (read(reactor->wake_fd, &count, sizeof(count)) == -1 && errno == EINTR)
+    {
+    }
+    if (atomic_load_explicit(&reactor->joining, memory_order_relaxed))
+    {
+        ws_client_adopt(reactor);
+    }
+
+    struct ws_conn *conn = atomic_exchange_explicit(&reactor->ready, NULL, memory_order_acquire);
+    while (conn)
+    {
+        // read before the flag is cleared; a producer may relink conn after
+        struct ws_conn *next = conn->ready_next;
+        atomic_store_explicit(&conn->inbox_ready, 0, memory_order_release);
+        if (!conn->closed && ws_conn_on_inbox(conn) == -1)
+        {
+            ws_conn_error(conn, 1006);
+            ws_conn_close(conn);
+        }
+        ws_conn_put(conn);
+        conn = next;
+    }
+}
@@ -0,0 +1,191 @@
+#define _GNU_SOURCE
+#include "../include/log.h"
+#include <stdarg.h>
+
+struct ws_log_record
+{
+    int level;
+    u_int32_t len;
+    char text[WS_LOG_LINE];
+};
+
+// Single producer (the owning thread), single consumer (whoever holds
+// g_log_lock). head and tail run freely like the inbound ring's.
+struct ws_log_ring
+{
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_int dead; // owner exited; freed once drained
+    struct ws_log_ring *next;
+    struct ws_log_record slots[WS_LOG_SLOTS];
+};
+
+atomic_int ws_log_threshold = WS_LOG_INFO;
+
+static pthread_mutex_t g_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ws_log_ring *g_log_rings;
+static ws_log_sink_t g_log_sink;
+static atomic_ulong g_log_dropped;
+static pthread_once_t g_log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_log_key;
+static __thread struct ws_log_ring *tls_log_ring;
+
+static const char *ws_log_names[] = {"trace", "debug", "info", "warn", "error"};
+
+static void ws_log_stderr(int level, const char *message, size_t length)
+{
+    fprintf(stderr, "swss %s: %.*s\n", ws_log_names[level], (int)length, message);
+}
+
+// Hands every buffered record to the sink. Caller holds g_log_lock.
+// returns the number of records written
+static size_t ws_log_drain(void)
+{
+    ws_log_sink_t sink = g_log_sink ? g_log_sink : ws_log_stderr;
+    size_t written = 0;
+
+    struct ws_log_ring **link = &g_log_rings;
+    while (*link)
+    {
+        struct ws_log_ring *ring = *link;
+        int dead = atomic_load_explicit(&ring->dead, memory_order_acquire);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+        for (; head != tail; head++, written++)
+        {
+            struct ws_log_record *rec = &ring->slots[head % WS_LOG_SLOTS];
+            sink(rec->level, rec->text, rec->len);
+        }
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+
+        if (dead)
+        {
+            *link = ring->next;
+            free(ring);
+            continue;
+        }
+        link = &ring->next;
+    }
+
+    unsigned long dropped = atomic_exchange_explicit(&g_log_dropped, 0, memory_order_relaxed);
+    if (dropped > 0)
+    {
+        char msg[64];
+        int n = snprintf(msg, sizeof(msg), "%lu log records dropped", dropped);
+        sink(WS_LOG_WARN, msg, n);
+    }
+    return written;
+}
+
+void ws_log_flush(void)
+{
+    pthread_mutex_lock(&g_log_lock);
+    ws_log_drain();
+    pthread_mutex_unlock(&g_log_lock);
+}
+
+// Polls the rings, backing off while nothing is being logged.
+static void *ws_log_writer(void *arg)
+{
+    (void)arg;
+    useconds_t idle = 1000;
+    while (1)
+    {
+        pthread_mutex_lock(&g_log_lock);
+        size_t written = ws_log_drain();
+        pthread_mutex_unlock(&g_log_lock);
+
+        if (written > 0)
+        {
+            idle = 1000;
+            continue;
+        }
+        usleep(idle);
+        if (idle < 64000)
+        {
+            idle *= 2;
+        }
+    }
+    return NULL;
+}
+
+static void ws_log_release(void *arg)
+{
+    struct ws_log_ring *ring = arg;
+    atomic_store_explicit(&ring->dead, 1, memory_order_release);
+}
+
+static void ws_log_init(void)
+{
+    pthread_key_create(&g_log_key, ws_log_release);
+
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, ws_log_writer, NULL) == 0)
+    {
+        pthread_detach(writer);
+    }
+    atexit(ws_log_flush);
+}
+
+static struct ws_log_ring *ws_log_ring_get(void)
+{
+    pthread_once(&g_log_once, ws_log_init);
+
+    struct ws_log_ring *ring = calloc(1, sizeof(struct ws_log_ring));
+    if (!ring)
+    {
+        return NULL;
+    }
+    pthread_mutex_lock(&g_log_lock);
+    ring->next = g_log_rings;
+    g_log_rings = ring;
+    pthread_mutex_unlock(&g_log_lock);
+
+    pthread_setspecific(g_log_key, ring);
+    tls_log_ring = ring;
+    return ring;
+}
+
+// Formats straight into the next slot of this thread's ring. A full ring
+// drops the record rather than wait for the writer.
+void ws_log_write(int level, const char *fmt, ...)
+{
+    struct ws_log_ring *ring = tls_log_ring ? tls_log_ring : ws_log_ring_get();
+    if (!ring)
+    {
+        return;
+    }
+
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == WS_LOG_SLOTS)
+    {
+        atomic_fetch_add_explicit(&g_log_dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    struct ws_log_record *rec = &ring->slots[tail % WS_LOG_SLOTS];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(rec->text, WS_LOG_LINE, fmt, ap);
+    va_end(ap);
+    rec->len = n < 0 ? 0 : (n >= WS_LOG_LINE ? WS_LOG_LINE - 1 : n);
+    rec->level = level;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+// perror(3), through the log.
+void ws_log_perror(const char *what)
+{
+    char buf[128];
+    ws_log_error("%s: %s", what, strerror_r(errno, buf, sizeof(buf)));
+}
+
+void ws_log_set_level(int level) { atomic_store_explicit(&ws_log_threshold, level, memory_order_relaxed); }
+
+void ws_log_set_sink(ws_log_sink_t sink)
+{
+    pthread_mutex_lock(&g_log_lock);
+    g_log_sink = sink;
+    pthread_mutex_unlock(&g_log_lock);
+}
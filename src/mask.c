@@ -0,0 +1,143 @@
+#include "../include/mask.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WS_MASK_X86 1
+#endif
+
+// The reference one-byte-at-a-time loop, kept as the benchmark baseline.
+void ws_mask_bytewise(u_int8_t *data, size_t len, const u_int8_t key[4])
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        data[i] ^= key[i % 4];
+    }
+}
+
+// Portable fallback: eight bytes per step through a 64-bit word. memcpy keeps
+// the unaligned loads and stores legal and compiles to plain moves.
+void ws_mask_scalar(u_int8_t *data, size_t len, const u_int8_t key[4])
+{
+    u_int8_t key8[8];
+    memcpy(key8, key, 4);
+    memcpy(key8 + 4, key, 4);
+    u_int64_t key64;
+    memcpy(&key64, key8, 8);
+
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        u_int64_t word;
+        memcpy(&word, data + i, 8);
+        word ^= key64;
+        memcpy(data + i, &word, 8);
+    }
+    // i is a multiple of 4 here, so the key lines up again from key[0]
+    for (; i < len; i++)
+    {
+        data[i] ^= key[i % 4];
+    }
+}
+
+#ifdef WS_MASK_X86
+__attribute__((target("sse2"))) void ws_mask_sse2(u_int8_t *data, size_t len, const u_int8_t key[4])
+{
+    int32_t key32;
+    memcpy(&key32, key, 4);
+    __m128i k = _mm_set1_epi32(key32);
+
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(data + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(data + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(data + i + 48));
+        _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(a, k));
+        _mm_storeu_si128((__m128i *)(data + i + 16), _mm_xor_si128(b, k));
+        _mm_storeu_si128((__m128i *)(data + i + 32), _mm_xor_si128(c, k));
+        _mm_storeu_si128((__m128i *)(data + i + 48), _mm_xor_si128(d, k));
+    }
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(data + i));
+        _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(a, k));
+    }
+    ws_mask_scalar(data + i, len - i, key);
+}
+
+__attribute__((target("avx2"))) void ws_mask_avx2(u_int8_t *data, size_t len, const u_int8_t key[4])
+{
+    int32_t key32;
+    memcpy(&key32, key, 4);
+    __m256i k = _mm256_set1_epi32(key32);
+
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(data + i + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(data + i + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(data + i + 96));
+        _mm256_storeu_si256((__m256i *)(data + i), _mm256_xor_si256(a, k));
+        _mm256_storeu_si256((__m256i *)(data + i + 32), _mm256_xor_si256(b, k));
+        _mm256_storeu_si256((__m256i *)(data + i + 64), _mm256_xor_si256(c, k));
+        _mm256_storeu_si256((__m256i *)(data + i + 96), _mm256_xor_si256(d, k));
+    }
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(data + i));
+        _mm256_storeu_si256((__m256i *)(data + i), _mm256_xor_si256(a, k));
+    }
+    // gcc turns the call below into a tail jump without clearing the upper
+    // halves, and legacy SSE code running after that pays a state transition
+    _mm256_zeroupper();
+    ws_mask_sse2(data + i, len - i, key);
+}
+
+int ws_mask_have_sse2(void) { return __builtin_cpu_supports("sse2"); }
+int ws_mask_have_avx2(void) { return __builtin_cpu_supports("avx2"); }
+#else
+void ws_mask_sse2(u_int8_t *data, size_t len, const u_int8_t key[4]) { ws_mask_scalar(data, len, key); }
+void ws_mask_avx2(u_int8_t *data, size_t len, const u_int8_t key[4]) { ws_mask_scalar(data, len, key); }
+int ws_mask_have_sse2(void) { return 0; }
+int ws_mask_have_avx2(void) { return 0; }
+#endif
+
+typedef void (*ws_mask_fn)(u_int8_t *data, size_t len, const u_int8_t key[4]);
+
+// Picked on first use; every thread resolves to the same kernel, so the
+// unsynchronised store is harmless.
+static ws_mask_fn g_mask_kernel;
+
+static ws_mask_fn ws_mask_resolve(void)
+{
+    if (ws_mask_have_avx2())
+    {
+        return ws_mask_avx2;
+    }
+    if (ws_mask_have_sse2())
+    {
+        return ws_mask_sse2;
+    }
+    return ws_mask_scalar;
+}
+
+void ws_mask(u_int8_t *data, size_t len, const u_int8_t key[4], u_int64_t pos)
+{
+    ws_mask_fn kernel = __atomic_load_n(&g_mask_kernel, __ATOMIC_RELAXED);
+    if (kernel == NULL)
+    {
+        kernel = ws_mask_resolve();
+        __atomic_store_n(&g_mask_kernel, kernel, __ATOMIC_RELAXED);
+    }
+
+    // rotate the key so the kernels can always start at key[0]
+    u_int8_t rotated[4];
+    for (int i = 0; i < 4; i++)
+    {
+        rotated[i] = key[(pos + i) % 4];
+    }
+    kernel(data, len, rotated);
+}
@@ -0,0 +1,448 @@
+#include "../include/outq.h"
+#include "../include/log.h"
+#include "../include/mask.h"
+#include "../include/random.h"
+#include "../include/reactor.h"
+#include "../include/stats.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct ws_frame *ws_frame_alloc(size_t len)
+{
+    struct ws_frame *frame = malloc(sizeof(struct ws_frame) + len);
+    if (!frame)
+    {
+        return NULL;
+    }
+    atomic_init(&frame->refs, 1);
+    frame->len = len;
+    return frame;
+}
+
+// Encode an unmasked frame once so it can be queued on many connections.
+struct ws_frame *ws_frame_new(u_int8_t opcode, const u_int8_t *payload, u_int64_t payload_len)
+{
+    u_int8_t header[WS_MAX_HEADER];
+    size_t header_len = ws_encode_header(header, opcode, payload_len, NULL);
+
+    struct ws_frame *frame = ws_frame_alloc(header_len + payload_len);
+    if (!frame)
+    {
+        return NULL;
+    }
+    memcpy(frame->data, header, header_len);
+    if (payload_len > 0)
+    {
+        memcpy(frame->data + header_len, payload, payload_len);
+    }
+    return frame;
+}
+
+// A client frame, masked under a fresh key; unlike a server frame it is built
+// for one connection and never shared.
+struct ws_frame *ws_frame_new_masked(u_int8_t opcode, const u_int8_t *payload, u_int64_t payload_len)
+{
+    u_int8_t key[4];
+    ws_random_bytes(key, sizeof(key));
+
+    u_int8_t header[WS_MAX_HEADER];
+    size_t header_len = ws_encode_header(header, opcode, payload_len, key);
+
+    struct ws_frame *frame = ws_frame_alloc(header_len + payload_len);
+    if (!frame)
+    {
+        return NULL;
+    }
+    memcpy(frame->data, header, header_len);
+    if (payload_len > 0)
+    {
+        memcpy(frame->data + header_len, payload, payload_len);
+        ws_mask(frame->data + header_len, payload_len, key, 0);
+    }
+    return frame;
+}
+
+void ws_frame_ref(struct ws_frame *frame)
+{
+    atomic_fetch_add_explicit(&frame->refs, 1, memory_order_relaxed);
+}
+
+void ws_frame_unref(struct ws_frame *frame)
+{
+    if (atomic_fetch_sub_explicit(&frame->refs, 1, memory_order_acq_rel) == 1)
+    {
+        free(frame);
+    }
+}
+
+// A frame holding only the header for payload_len bytes sent from a region.
+struct ws_frame *ws_frame_header(u_int8_t opcode, u_int64_t payload_len)
+{
+    u_int8_t header[WS_MAX_HEADER];
+    size_t header_len = ws_encode_header(header, opcode, payload_len, NULL);
+
+    struct ws_frame *frame = ws_frame_alloc(header_len);
+    if (!frame)
+    {
+        return NULL;
+    }
+    memcpy(frame->data, header, header_len);
+    return frame;
+}
+
+// Checks that length bytes from offset lie within the regular file fd; a
+// length of 0 is taken to mean the rest of the file.
+// returns 0 if they do, -1 otherwise
+int ws_file_range(int fd, off_t offset, size_t *length)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode) || offset < 0 || offset > st.st_size || *length > (u_int64_t)(st.st_size - offset))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (*length == 0)
+    {
+        *length = st.st_size - offset;
+    }
+    return 0;
+}
+
+ws_region_t *ws_region_map(int fd, off_t offset, size_t length)
+{
+    if (ws_file_range(fd, offset, &length) == -1)
+    {
+        return NULL;
+    }
+    if (length == 0)
+    {
+        // nothing to map
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct ws_region *region = malloc(sizeof(struct ws_region));
+    if (!region)
+    {
+        return NULL;
+    }
+    // mappings start on a page boundary
+    off_t skip = offset % sysconf(_SC_PAGESIZE);
+    region->map_len = length + skip;
+    region->map = mmap(NULL, region->map_len, PROT_READ, MAP_SHARED, fd, offset - skip);
+    if (region->map == MAP_FAILED)
+    {
+        ws_log_perror("mmap");
+        free(region);
+        return NULL;
+    }
+    madvise(region->map, region->map_len, MADV_SEQUENTIAL);
+    atomic_init(&region->refs, 1);
+    region->fd = -1;
+    region->addr = (const u_int8_t *)region->map + skip;
+    region->len = length;
+    return region;
+}
+
+// A region sending straight from fd, on a descriptor of its own so the
+// caller may close fd while sends are queued.
+struct ws_region *ws_region_file(int fd)
+{
+    struct ws_region *region = malloc(sizeof(struct ws_region));
+    if (!region)
+    {
+        return NULL;
+    }
+    region->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (region->fd == -1)
+    {
+        ws_log_perror("dup");
+        free(region);
+        return NULL;
+    }
+    atomic_init(&region->refs, 1);
+    region->addr = NULL;
+    region->len = 0;
+    region->map = NULL;
+    region->map_len = 0;
+    return region;
+}
+
+void ws_region_ref(struct ws_region *region)
+{
+    atomic_fetch_add_explicit(&region->refs, 1, memory_order_relaxed);
+}
+
+void ws_region_release(ws_region_t *region)
+{
+    if (region && atomic_fetch_sub_explicit(&region->refs, 1, memory_order_acq_rel) == 1)
+    {
+        if (region->map)
+        {
+            munmap(region->map, region->map_len);
+        }
+        if (region->fd != -1)
+        {
+            close(region->fd);
+        }
+        free(region);
+    }
+}
+
+// Copies len bytes of region from start into buf, for the senders that have
+// to see them.
+// returns 0 on success, -1 if the file is shorter than that or unreadable
+int ws_region_read(const struct ws_region *region, u_int64_t start, u_int8_t *buf, size_t len)
+{
+    if (region->addr)
+    {
+        memcpy(buf, region->addr + start, len);
+        return 0;
+    }
+    while (len > 0)
+    {
+        ssize_t n = pread(region->fd, buf, len, start);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        buf += n;
+        start += n;
+        len -= n;
+    }
+    return 0;
+}
+
+void ws_outq_entry_free(struct ws_outq_entry *e)
+{
+    ws_frame_unref(e->frame);
+    if (e->region)
+    {
+        ws_region_release(e->region);
+    }
+    free(e);
+}
+
+// Queue the unsent tail of frame, starting at offset. Takes its own reference.
+int ws_outq_push(struct ws_outq *q, struct ws_frame *frame, size_t offset)
+{
+    struct ws_outq_entry *entry = malloc(sizeof(struct ws_outq_entry));
+    if (!entry)
+    {
+        return -1;
+    }
+    ws_frame_ref(frame);
+    entry->frame = frame;
+    entry->region = NULL;
+    entry->span = 0;
+    entry->offset = offset;
+    entry->queued_ns = ws_now_ns();
+    entry->opcode = 0;
+    ws_outq_append(q, entry);
+    return 0;
+}
+
+// Queue an entry built elsewhere, keeping its frame reference and timestamp.
+void ws_outq_append(struct ws_outq *q, struct ws_outq_entry *entry)
+{
+    entry->next = NULL;
+    if (q->tail)
+    {
+        q->tail->next = entry;
+    }
+    else
+    {
+        q->head = entry;
+    }
+    q->tail = entry;
+    q->bytes += ws_outq_entry_len(entry) - entry->offset;
+    ws_stat_add(WS_STAT_QUEUED_BYTES, ws_outq_entry_len(entry) - entry->offset);
+}
+
+// Write iov straight to the socket if nothing is queued ahead of it, and queue
+// a copy of whatever the socket doesn't take. Never blocks.
+// returns 0 on success, -1 on error
+int ws_outq_write(struct ws_outq *q, struct ws_conn *conn, const struct iovec *iov, int iovcnt)
+{
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        total += iov[i].iov_len;
+    }
+
+    ssize_t sent = 0;
+    if (q->head == NULL)
+    {
+        sent = ws_conn_writev(conn, iov, iovcnt);
+        if (sent == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                return -1;
+            }
+            sent = 0;
+        }
+        if ((size_t)sent == total)
+        {
+            return 0;
+        }
+    }
+
+    struct ws_frame *rest = ws_frame_alloc(total - sent);
+    if (!rest)
+    {
+        return -1;
+    }
+    size_t copied = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        size_t len = iov[i].iov_len;
+        const u_int8_t *base = iov[i].iov_base;
+        if ((size_t)sent >= len)
+        {
+            sent -= len;
+            continue;
+        }
+        memcpy(rest->data + copied, base + sent, len - sent);
+        copied += len - sent;
+        sent = 0;
+    }
+
+    int res = ws_outq_push(q, rest, 0);
+    ws_frame_unref(rest);
+    return res;
+}
+
+static void ws_outq_pop(struct ws_outq *q)
+{
+    struct ws_outq_entry *entry = q->head;
+    q->head = entry->next;
+    if (q->head == NULL)
+    {
+        q->tail = NULL;
+    }
+    ws_outq_entry_free(entry);
+}
+
+// Point iov at up to max of the oldest unsent pieces, stopping at a span of
+// a file (see ws_outq_file_span).
+// returns the number of entries filled in
+int ws_outq_iov(const struct ws_outq *q, struct iovec *iov, int max)
+{
+    int iovcnt = 0;
+    for (struct ws_outq_entry *e = q->head; e && iovcnt < max; e = e->next)
+    {
+        size_t done = e->offset;
+        if (done < e->frame->len)
+        {
+            iov[iovcnt].iov_base = e->frame->data + done;
+            iov[iovcnt].iov_len = e->frame->len - done;
+            iovcnt++;
+            done = e->frame->len;
+        }
+        if (e->span > 0)
+        {
+            if (!e->region->addr || iovcnt == max)
+            {
+                break;
+            }
+            done -= e->frame->len;
+            iov[iovcnt].iov_base = (u_int8_t *)e->region->addr + e->start + done;
+            iov[iovcnt].iov_len = e->span - done;
+            iovcnt++;
+        }
+    }
+    return iovcnt;
+}
+
+// Finds the rest of a span of a file at the head of the queue, once its
+// header is written, which goes out with sendfile(2) rather than sendmsg.
+// returns 1 if there is one, 0 otherwise
+int ws_outq_file_span(const struct ws_outq *q, int *fd, off_t *offset, size_t *len)
+{
+    struct ws_outq_entry *e = q->head;
+    if (!e || e->span == 0 || e->region->addr || e->offset < e->frame->len)
+    {
+        return 0;
+    }
+    size_t done = e->offset - e->frame->len;
+    *fd = e->region->fd;
+    *offset = e->start + done;
+    *len = e->span - done;
+    return 1;
+}
+
+// Drop sent bytes from the front of the queue.
+void ws_outq_consume(struct ws_outq *q, size_t sent)
+{
+    q->bytes -= sent;
+    ws_stat_add(WS_STAT_QUEUED_BYTES, -(u_int64_t)sent);
+    u_int64_t now = 0;
+    while (sent > 0)
+    {
+        struct ws_outq_entry *e = q->head;
+        size_t left = ws_outq_entry_len(e) - e->offset;
+        if (sent < left)
+        {
+            e->offset += sent;
+            break;
+        }
+        sent -= left;
+        now = now ? now : ws_now_ns();
+        ws_stat_send_ns(now - e->queued_ns);
+        ws_outq_pop(q);
+    }
+}
+
+// Write as much of the queue as the socket takes, several frames per sendmsg.
+// returns 1 once the queue is empty, 0 if the socket is full, -1 on error
+int ws_outq_flush(struct ws_outq *q, struct ws_conn *conn)
+{
+    struct iovec iov[64];
+
+    while (q->head)
+    {
+        int fd;
+        off_t offset;
+        size_t len;
+        ssize_t sent;
+        if (ws_outq_file_span(q, &fd, &offset, &len))
+        {
+            sent = ws_conn_sendfile(conn, fd, offset, len);
+        }
+        else
+        {
+            sent = ws_conn_writev(conn, iov, ws_outq_iov(q, iov, 64));
+        }
+        if (sent == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            return -1;
+        }
+        ws_outq_consume(q, sent);
+    }
+
+    return 1;
+}
+
+void ws_outq_clear(struct ws_outq *q)
+{
+    while (q->head)
+    {
+        ws_outq_pop(q);
+    }
+    ws_stat_add(WS_STAT_QUEUED_BYTES, -(u_int64_t)q->bytes);
+    q->bytes = 0;
+}
@@ -0,0 +1,161 @@
+#include "../include/pool.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Sits in front of every buffer; keeps the payload 16-byte aligned.
+struct ws_buf_hdr
+{
+    size_t capacity;
+    union
+    {
+        struct ws_buf_hdr *next; // while cached
+        u_int64_t pad;
+    };
+};
+
+struct ws_pool_class
+{
+    struct ws_buf_hdr *free;
+    size_t count;
+};
+
+// Each class caches at most this many bytes (and at least a few buffers).
+#define WS_POOL_CLASS_BYTES (4u << 20)
+
+static __thread struct ws_pool_class tls_pool[WS_POOL_CLASSES];
+static __thread int tls_pool_registered;
+static pthread_key_t g_pool_key;
+static pthread_once_t g_pool_once = PTHREAD_ONCE_INIT;
+
+// Gives a thread's cached buffers back to malloc when the thread exits.
+static void ws_pool_release(void *arg)
+{
+    struct ws_pool_class *pool = arg;
+    for (int i = 0; i < WS_POOL_CLASSES; i++)
+    {
+        while (pool[i].free)
+        {
+            struct ws_buf_hdr *hdr = pool[i].free;
+            pool[i].free = hdr->next;
+            free(hdr);
+        }
+        pool[i].count = 0;
+    }
+}
+
+static void ws_pool_key_init(void) { pthread_key_create(&g_pool_key, ws_pool_release); }
+
+static int ws_pool_class_of(size_t size)
+{
+    int shift = WS_POOL_MIN_SHIFT;
+    while (shift <= WS_POOL_MAX_SHIFT && ((size_t)1 << shift) < size)
+    {
+        shift++;
+    }
+    return shift - WS_POOL_MIN_SHIFT;
+}
+
+static size_t ws_pool_class_max(int cls)
+{
+    size_t max = WS_POOL_CLASS_BYTES >> (cls + WS_POOL_MIN_SHIFT);
+    return max < 4 ? 4 : max;
+}
+
+void *ws_buf_alloc(size_t size)
+{
+    int cls = ws_pool_class_of(size);
+    if (cls >= WS_POOL_CLASSES)
+    {
+        struct ws_buf_hdr *hdr = malloc(sizeof(struct ws_buf_hdr) + size);
+        if (!hdr)
+        {
+            return NULL;
+        }
+        hdr->capacity = size;
+        return hdr + 1;
+    }
+
+    struct ws_pool_class *pool = &tls_pool[cls];
+    struct ws_buf_hdr *hdr = pool->free;
+    if (hdr)
+    {
+        pool->free = hdr->next;
+        pool->count--;
+        return hdr + 1;
+    }
+
+    size_t capacity = (size_t)1 << (cls + WS_POOL_MIN_SHIFT);
+    hdr = malloc(sizeof(struct ws_buf_hdr) + capacity);
+    if (!hdr)
+    {
+        return NULL;
+    }
+    hdr->capacity = capacity;
+    return hdr + 1;
+}
+
+void ws_buf_free(void *buf)
+{
+    if (buf == NULL)
+    {
+        return;
+    }
+
+    struct ws_buf_hdr *hdr = (struct ws_buf_hdr *)buf - 1;
+    int cls = ws_pool_class_of(hdr->capacity);
+    if (cls >= WS_POOL_CLASSES || ((size_t)1 << (cls + WS_POOL_MIN_SHIFT)) != hdr->capacity)
+    {
+        free(hdr);
+        return;
+    }
+
+    struct ws_pool_class *pool = &tls_pool[cls];
+    if (pool->count >= ws_pool_class_max(cls))
+    {
+        free(hdr);
+        return;
+    }
+
+    if (!tls_pool_registered)
+    {
+        pthread_once(&g_pool_once, ws_pool_key_init);
+        pthread_setspecific(g_pool_key, tls_pool);
+        tls_pool_registered = 1;
+    }
+
+    hdr->next = pool->free;
+    pool->free = hdr;
+    pool->count++;
+}
+
+size_t ws_buf_capacity(const void *buf) { return ((const struct ws_buf_hdr *)buf - 1)->capacity; }
+
+// Make room for size bytes, keeping the first used. Classes double, so a
+// message that grows fragment by fragment is moved O(log n) times, not once
+// per fragment. buf may be NULL.
+void *ws_buf_grow(void *buf, size_t used, size_t size)
+{
+    if (buf && ws_buf_capacity(buf) >= size)
+    {
+        return buf;
+    }
+
+    // grow at least geometrically past the pooled classes too
+    if (buf && size < 2 * ws_buf_capacity(buf))
+    {
+        size = 2 * ws_buf_capacity(buf);
+    }
+
+    void *grown = ws_buf_alloc(size);
+    if (!grown)
+    {
+        return NULL;
+    }
+    if (buf)
+    {
+        memcpy(grown, buf, used);
+        ws_buf_free(buf);
+    }
+    return grown;
+}
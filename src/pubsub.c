@@ -0,0 +1,428 @@
+#include "../include/pubsub.h"
+#include "../include/reactor.h"
+
+// Topics are found through a hash table split into shards, each with its own
+// lock. A lock is held only to look up a topic and swap or take a reference
+// to its subscriber snapshot, never while sending.
+struct ws_topic_shard
+{
+    pthread_mutex_t lock;
+    struct ws_topic *buckets[WS_TOPIC_BUCKETS];
+};
+
+static struct ws_topic_shard g_topics[WS_TOPIC_SHARDS];
+static pthread_once_t g_topics_once = PTHREAD_ONCE_INIT;
+
+static void ws_topics_init(void)
+{
+    for (int i = 0; i < WS_TOPIC_SHARDS; i++)
+    {
+        pthread_mutex_init(&g_topics[i].lock, NULL);
+    }
+}
+
+// FNV-1a
+static u_int32_t ws_topic_hash(const char *name)
+{
+    u_int32_t h = 2166136261u;
+    for (const u_int8_t *p = (const u_int8_t *)name; *p; p++)
+    {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h;
+}
+
+static struct ws_topic_shard *ws_topic_shard(u_int32_t hash)
+{
+    pthread_once(&g_topics_once, ws_topics_init);
+    return &g_topics[hash % WS_TOPIC_SHARDS];
+}
+
+static struct ws_topic **ws_topic_slot(struct ws_topic_shard *shard, u_int32_t hash, const char *name)
+{
+    struct ws_topic **slot = &shard->buckets[(hash / WS_TOPIC_SHARDS) % WS_TOPIC_BUCKETS];
+    while (*slot && ((*slot)->hash != hash || strcmp((*slot)->name, name) != 0))
+    {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+static struct ws_subseg *ws_subseg_of(const struct ws_conn_run *run)
+{
+    return (struct ws_subseg *)((char *)run->conns - offsetof(struct ws_subseg, conns));
+}
+
+static struct ws_subseg *ws_subseg_new(const ws_conn_t *conns, size_t len)
+{
+    struct ws_subseg *seg = malloc(sizeof(struct ws_subseg) + len * sizeof(ws_conn_t));
+    if (!seg)
+    {
+        return NULL;
+    }
+    atomic_init(&seg->refs, 1);
+    seg->len = len;
+    memcpy(seg->conns, conns, len * sizeof(ws_conn_t));
+    return seg;
+}
+
+static void ws_subseg_unref(struct ws_subseg *seg)
+{
+    if (atomic_fetch_sub_explicit(&seg->refs, 1, memory_order_acq_rel) == 1)
+    {
+        free(seg);
+    }
+}
+
+static void ws_subscribers_unref(struct ws_subscribers *subs)
+{
+    if (subs && atomic_fetch_sub_explicit(&subs->refs, 1, memory_order_acq_rel) == 1)
+    {
+        for (size_t i = 0; i < subs->nruns; i++)
+        {
+            ws_subseg_unref(ws_subseg_of(&subs->runs[i]));
+        }
+        free(subs);
+    }
+}
+
+// Index of the last run starting at or before conn: the one that holds it,
+// or would hold it once added.
+static size_t ws_subscribers_find(const struct ws_subscribers *subs, ws_conn_t conn)
+{
+    size_t lo = 0, hi = subs->nruns;
+    while (hi - lo > 1)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (subs->runs[mid].conns[0] <= conn)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Copy of the run index of subs with drop runs at at replaced by segs. The
+// copy takes over segs and a reference to every segment it keeps.
+// returns NULL if out of memory
+static struct ws_subscribers *ws_subscribers_splice(const struct ws_subscribers *subs, size_t at, size_t drop,
+                                                    struct ws_subseg *const *segs, size_t nsegs)
+{
+    size_t old = subs ? subs->nruns : 0;
+    size_t nruns = old - drop + nsegs;
+    struct ws_subscribers *copy = malloc(sizeof(struct ws_subscribers) + nruns * sizeof(struct ws_conn_run));
+    if (!copy)
+    {
+        return NULL;
+    }
+    atomic_init(&copy->refs, 1);
+    copy->len = 0;
+    copy->nruns = 0;
+    for (size_t i = 0; i < old; i++)
+    {
+        if (i == at)
+        {
+            for (size_t j = 0; j < nsegs; j++)
+            {
+                copy->runs[copy->nruns++] = (struct ws_conn_run){segs[j]->conns, segs[j]->len};
+                copy->len += segs[j]->len;
+            }
+            i += drop;
+            if (i >= old)
+            {
+                break;
+            }
+        }
+        atomic_fetch_add_explicit(&ws_subseg_of(&subs->runs[i])->refs, 1, memory_order_relaxed);
+        copy->runs[copy->nruns++] = subs->runs[i];
+        copy->len += subs->runs[i].len;
+    }
+    if (old == 0)
+    {
+        for (size_t j = 0; j < nsegs; j++)
+        {
+            copy->runs[copy->nruns++] = (struct ws_conn_run){segs[j]->conns, segs[j]->len};
+            copy->len += segs[j]->len;
+        }
+    }
+    return copy;
+}
+
+// Copy of subs with conn added (add) or removed. Only the segment holding
+// conn is rebuilt; a segment that outgrows WS_TOPIC_SEGMENT splits in two and
+// one left empty is dropped.
+// returns NULL if out of memory
+static struct ws_subscribers *ws_subscribers_with(const struct ws_subscribers *subs, ws_conn_t conn, int add)
+{
+    ws_conn_t merged[WS_TOPIC_SEGMENT + 1];
+    size_t at = 0, drop = 0, len = 1;
+    merged[0] = conn;
+    if (subs)
+    {
+        at = ws_subscribers_find(subs, conn);
+        drop = 1;
+        const struct ws_conn_run *run = &subs->runs[at];
+        size_t pos = 0;
+        while (pos < run->len && run->conns[pos] < conn)
+        {
+            pos++;
+        }
+        memcpy(merged, run->conns, pos * sizeof(ws_conn_t));
+        if (add)
+        {
+            merged[pos] = conn;
+            memcpy(merged + pos + 1, run->conns + pos, (run->len - pos) * sizeof(ws_conn_t));
+            len = run->len + 1;
+        }
+        else
+        {
+            memcpy(merged + pos, run->conns + pos + 1, (run->len - pos - 1) * sizeof(ws_conn_t));
+            len = run->len - 1;
+        }
+    }
+
+    struct ws_subseg *segs[2];
+    size_t nsegs = len > WS_TOPIC_SEGMENT ? 2 : (len > 0 ? 1 : 0);
+    size_t half = nsegs == 2 ? len / 2 : len;
+    for (size_t i = 0; i < nsegs; i++)
+    {
+        segs[i] = i == 0 ? ws_subseg_new(merged, half) : ws_subseg_new(merged + half, len - half);
+        if (!segs[i])
+        {
+            while (i-- > 0)
+            {
+                ws_subseg_unref(segs[i]);
+            }
+            return NULL;
+        }
+    }
+
+    struct ws_subscribers *copy = ws_subscribers_splice(subs, at, drop, segs, nsegs);
+    if (!copy)
+    {
+        for (size_t i = 0; i < nsegs; i++)
+        {
+            ws_subseg_unref(segs[i]);
+        }
+    }
+    return copy;
+}
+
+// Removes conn from topic; frees the topic once nobody is subscribed. Called
+// with the shard lock held.
+static int ws_topic_leave(struct ws_topic_shard *shard, struct ws_topic *topic, ws_conn_t conn)
+{
+    struct ws_subscribers *old = topic->subs;
+    if (old->len == 1)
+    {
+        struct ws_topic **slot = ws_topic_slot(shard, topic->hash, topic->name);
+        *slot = topic->next;
+        ws_subscribers_unref(old);
+        free(topic);
+        return 0;
+    }
+
+    struct ws_subscribers *subs = ws_subscribers_with(old, conn, 0);
+    if (!subs)
+    {
+        return -1;
+    }
+    topic->subs = subs;
+    ws_subscribers_unref(old);
+    return 0;
+}
+
+// Whether conn is in subs: a binary search of the one run it could be in.
+static int ws_subscribers_has(const struct ws_subscribers *subs, ws_conn_t conn)
+{
+    const struct ws_conn_run *run = &subs->runs[ws_subscribers_find(subs, conn)];
+    size_t lo = 0, hi = run->len;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (run->conns[mid] < conn)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo < run->len && run->conns[lo] == conn;
+}
+
+// The connection's own list of topics, so closing it needs no search.
+static u_int32_t ws_conn_topic_index(const struct ws_conn *conn, const struct ws_topic *topic)
+{
+    u_int32_t i = 0;
+    while (i < conn->topics_len && conn->topics[i] != topic)
+    {
+        i++;
+    }
+    return i;
+}
+
+// Adds conn to topic. Called with out_lock held.
+static int ws_conn_join(struct ws_conn *conn, const char *topic)
+{
+    if (conn->closed)
+    {
+        return -1;
+    }
+    if (conn->topics_len == conn->topics_cap)
+    {
+        if (conn->topics_cap > UINT32_MAX / 2)
+        {
+            return -1;
+        }
+        u_int32_t cap = conn->topics_cap ? conn->topics_cap * 2 : 4;
+        struct ws_topic **topics = realloc(conn->topics, cap * sizeof(struct ws_topic *));
+        if (!topics)
+        {
+            return -1;
+        }
+        conn->topics = topics;
+        conn->topics_cap = cap;
+    }
+
+    u_int32_t hash = ws_topic_hash(topic);
+    struct ws_topic_shard *shard = ws_topic_shard(hash);
+    pthread_mutex_lock(&shard->lock);
+    struct ws_topic **slot = ws_topic_slot(shard, hash, topic);
+    struct ws_topic *t = *slot;
+    if (t && ws_subscribers_has(t->subs, ws_conn_handle(conn)))
+    {
+        pthread_mutex_unlock(&shard->lock);
+        return 0;
+    }
+    if (!t)
+    {
+        size_t name_len = strlen(topic);
+        t = malloc(sizeof(struct ws_topic) + name_len + 1);
+        if (!t)
+        {
+            pthread_mutex_unlock(&shard->lock);
+            return -1;
+        }
+        t->next = NULL;
+        t->hash = hash;
+        t->subs = NULL;
+        memcpy(t->name, topic, name_len + 1);
+    }
+
+    struct ws_subscribers *subs = ws_subscribers_with(t->subs, ws_conn_handle(conn), 1);
+    if (!subs)
+    {
+        if (!t->subs)
+        {
+            free(t);
+        }
+        pthread_mutex_unlock(&shard->lock);
+        return -1;
+    }
+    struct ws_subscribers *old = t->subs;
+    t->subs = subs;
+    *slot = t;
+    pthread_mutex_unlock(&shard->lock);
+    ws_subscribers_unref(old);
+
+    conn->topics[conn->topics_len++] = t;
+    return 0;
+}
+
+int ws_subscribe(ws_conn_t handle, const char *topic)
+{
+    struct ws_conn *conn = ws_conn_lookup(handle);
+    if (!conn)
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&conn->out_lock);
+    int res = ws_conn_join(conn, topic);
+    pthread_mutex_unlock(&conn->out_lock);
+    ws_conn_put(conn);
+    return res;
+}
+
+int ws_unsubscribe(ws_conn_t handle, const char *topic)
+{
+    struct ws_conn *conn = ws_conn_lookup(handle);
+    if (!conn)
+    {
+        return -1;
+    }
+
+    int res = -1;
+    u_int32_t hash = ws_topic_hash(topic);
+    struct ws_topic_shard *shard = ws_topic_shard(hash);
+    pthread_mutex_lock(&conn->out_lock);
+    pthread_mutex_lock(&shard->lock);
+    struct ws_topic *t = *ws_topic_slot(shard, hash, topic);
+    if (t && ws_subscribers_has(t->subs, handle))
+    {
+        // found before leaving, which may free the topic
+        u_int32_t i = ws_conn_topic_index(conn, t);
+        res = ws_topic_leave(shard, t, handle);
+        if (res == 0)
+        {
+            conn->topics[i] = conn->topics[--conn->topics_len];
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    pthread_mutex_unlock(&conn->out_lock);
+    ws_conn_put(conn);
+    return res;
+}
+
+void ws_pubsub_drop(struct ws_conn *conn)
+{
+    for (u_int32_t i = 0; i < conn->topics_len; i++)
+    {
+        struct ws_topic *t = conn->topics[i];
+        struct ws_topic_shard *shard = ws_topic_shard(t->hash);
+        pthread_mutex_lock(&shard->lock);
+        // only fails when out of memory, leaving a stale handle subscribed
+        ws_topic_leave(shard, t, ws_conn_handle(conn));
+        pthread_mutex_unlock(&shard->lock);
+    }
+    conn->topics_len = 0;
+}
+
+static int ws_publish_except(const char *topic, ws_conn_t except, u_int8_t opcode, const u_int8_t *payload,
+                             size_t length)
+{
+    u_int32_t hash = ws_topic_hash(topic);
+    struct ws_topic_shard *shard = ws_topic_shard(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    struct ws_topic *t = *ws_topic_slot(shard, hash, topic);
+    struct ws_subscribers *subs = t ? t->subs : NULL;
+    if (subs)
+    {
+        atomic_fetch_add_explicit(&subs->refs, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    if (!subs)
+    {
+        return 0;
+    }
+    int delivered = ws_broadcast_runs(subs->runs, subs->nruns, except, opcode, payload, length);
+    ws_subscribers_unref(subs);
+    return delivered;
+}
+
+int ws_publish(const char *topic, u_int8_t opcode, const u_int8_t *payload, size_t length)
+{
+    return ws_publish_except(topic, 0, opcode, payload, length);
+}
+
+int ws_publish_from(ws_conn_t conn, const char *topic, u_int8_t opcode, const u_int8_t *payload, size_t length)
+{
+    return ws_publish_except(topic, conn, opcode, payload, length);
+}
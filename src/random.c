@@ -0,0 +1,131 @@
+#include "../include/random.h"
+#include "../include/log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WS_RANDOM_BLOCKS 4 // ChaCha20 blocks per refill
+
+// Fast key erasure: every refill encrypts a fresh batch under the current key,
+// and the first 32 bytes of it replace the key. Output already handed out is
+// wiped from the buffer, so neither past output nor past keys can be recovered
+// from the state.
+struct ws_random
+{
+    u_int32_t key[8];
+    u_int8_t buf[64 * WS_RANDOM_BLOCKS];
+    size_t pos;
+    pid_t pid; // reseeded in a forked child, which must not repeat the parent
+};
+
+static __thread struct ws_random t_random = {.pos = sizeof(t_random.buf)};
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTER(a, b, c, d) \
+    a += b;                 \
+    d = ROTL(d ^ a, 16);    \
+    c += d;                 \
+    b = ROTL(b ^ c, 12);    \
+    a += b;                 \
+    d = ROTL(d ^ a, 8);     \
+    c += d;                 \
+    b = ROTL(b ^ c, 7)
+
+// One 64-byte ChaCha20 block (RFC 8439) with a zero nonce.
+static void ws_chacha20_block(const u_int32_t key[8], u_int32_t counter, u_int8_t out[64])
+{
+    u_int32_t in[16] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+    memcpy(in + 4, key, 32);
+    in[12] = counter;
+    in[13] = in[14] = in[15] = 0;
+
+    u_int32_t x[16];
+    memcpy(x, in, sizeof(x));
+    for (int i = 0; i < 10; i++)
+    {
+        QUARTER(x[0], x[4], x[8], x[12]);
+        QUARTER(x[1], x[5], x[9], x[13]);
+        QUARTER(x[2], x[6], x[10], x[14]);
+        QUARTER(x[3], x[7], x[11], x[15]);
+        QUARTER(x[0], x[5], x[10], x[15]);
+        QUARTER(x[1], x[6], x[11], x[12]);
+        QUARTER(x[2], x[7], x[8], x[13]);
+        QUARTER(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; i++)
+    {
+        x[i] += in[i];
+    }
+    memcpy(out, x, 64);
+}
+
+static void ws_random_seed(struct ws_random *r)
+{
+    ssize_t n;
+    while ((n = getrandom(r->key, sizeof(r->key), 0)) == -1 && errno == EINTR)
+    {
+    }
+    if (n != (ssize_t)sizeof(r->key))
+    {
+        int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+        if (fd == -1 || read(fd, r->key, sizeof(r->key)) != (ssize_t)sizeof(r->key))
+        {
+            // nothing better left; still differs between threads and runs
+            ws_log_error("no entropy source, random bytes are predictable");
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            r->key[0] ^= ts.tv_nsec;
+            r->key[1] ^= ts.tv_sec;
+            r->key[2] ^= getpid();
+            r->key[3] ^= (u_int32_t)(uintptr_t)r;
+        }
+        if (fd != -1)
+        {
+            close(fd);
+        }
+    }
+    r->pid = getpid();
+}
+
+static void ws_random_refill(struct ws_random *r)
+{
+    if (r->pid != getpid())
+    {
+        ws_random_seed(r);
+    }
+    for (int i = 0; i < WS_RANDOM_BLOCKS; i++)
+    {
+        ws_chacha20_block(r->key, i, r->buf + 64 * i);
+    }
+    memcpy(r->key, r->buf, sizeof(r->key));
+    memset(r->buf, 0, sizeof(r->key));
+    r->pos = sizeof(r->key);
+}
+
+void ws_random_bytes(void *buf, size_t len)
+{
+    struct ws_random *r = &t_random;
+    u_int8_t *out = buf;
+    while (len > 0)
+    {
+        if (r->pos == sizeof(r->buf))
+        {
+            ws_random_refill(r);
+        }
+        size_t n = sizeof(r->buf) - r->pos;
+        if (n > len)
+        {
+            n = len;
+        }
+        memcpy(out, r->buf + r->pos, n);
+        memset(r->buf + r->pos, 0, n);
+        r->pos += n;
+        out += n;
+        len -= n;
+    }
+}
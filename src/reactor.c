@@ -0,0 +1,242 @@
+#define _GNU_SOURCE
+#include "../include/reactor.h"
+#include "../include/log.h"
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+int ws_set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1)
+    {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Registers conn with the reactor's epoll set.
+// returns 0 on success, -1 on error
+int ws_reactor_add(struct ws_reactor *reactor, struct ws_conn *conn)
+{
+    struct epoll_event ev;
+    // EPOLLOUT stays armed; with edge triggering it only fires when a
+    // full send buffer drains, which is exactly when the queue needs it
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, conn->fd, &ev) == -1)
+    {
+        ws_log_perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+static __thread struct ws_reactor *t_epoll_reactor;
+
+// A failing accept fails again every time it is retried, so errors are logged
+// at most once a second along with how many were held back. With no
+// descriptor to spare, accepting waits a tick for connections to close.
+void ws_reactor_accept_failed(struct ws_reactor *reactor, int err)
+{
+    u_int64_t now = reactor->timers.clock;
+    if (err == EMFILE || err == ENFILE)
+    {
+        ws_timer_schedule(&reactor->timers, &reactor->accept_backoff, now + 1);
+    }
+
+    reactor->accept_errors++;
+    if (now < reactor->accept_log_at)
+    {
+        return;
+    }
+    char buf[128];
+    if (reactor->accept_errors > 1)
+    {
+        ws_log_error("accept: %s (%u times)", strerror_r(err, buf, sizeof(buf)), reactor->accept_errors);
+    }
+    else
+    {
+        ws_log_error("accept: %s", strerror_r(err, buf, sizeof(buf)));
+    }
+    reactor->accept_errors = 0;
+    reactor->accept_log_at = now + ws_timer_ticks(1000);
+}
+
+// drain the accept queue; with edge triggering we only hear about it once
+static void ws_reactor_accept(struct ws_reactor *reactor)
+{
+    struct sockaddr_storage their_addr;
+    socklen_t sin_size;
+
+    while (1)
+    {
+        sin_size = sizeof(their_addr);
+        // OpenSSL reads and writes with plain read/write, so the socket itself
+        // has to be non-blocking
+        int clientfd = accept4(reactor->listen_fd, (struct sockaddr *)&their_addr, &sin_size, SOCK_NONBLOCK);
+        if (clientfd == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // connections left in the backlog raise no new edge, so after
+            // running out of descriptors the backoff timer drains it
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                ws_reactor_accept_failed(reactor, errno);
+            }
+            return;
+        }
+
+        struct ws_conn *conn = ws_conn_new(clientfd);
+        if (!conn)
+        {
+            close(clientfd);
+            continue;
+        }
+        if (ws_tls_enabled() && ws_tls_accept(conn) == -1)
+        {
+            ws_conn_close(conn);
+            continue;
+        }
+
+        if (ws_reactor_add(reactor, conn) == -1)
+        {
+            ws_conn_close(conn);
+            continue;
+        }
+
+        // the request may already be waiting, in which case no edge will fire
+        if (ws_conn_on_readable(conn) == -1)
+        {
+            ws_conn_close(conn);
+        }
+    }
+}
+
+// The reactor's timers are its connections' and the accept backoff.
+static void ws_reactor_on_timer(struct ws_timer *timer)
+{
+    if (timer == &t_epoll_reactor->accept_backoff)
+    {
+        ws_reactor_accept(t_epoll_reactor);
+        return;
+    }
+    ws_conn_on_timer(timer);
+}
+
+// Edge-triggered event loop for one reactor thread. Every connection is a
+// state machine advanced from here whenever its socket becomes readable.
+int ws_reactor_run(struct ws_reactor *reactor)
+{
+    ws_timer_wheel_init(&reactor->timers);
+
+    if (reactor->backend == WS_BACKEND_URING)
+    {
+        struct ws_uring *ring = ws_uring_new();
+        if (ring)
+        {
+            return ws_uring_run(reactor, ring);
+        }
+        ws_log_warn("reactor %d: io_uring setup failed, using epoll", reactor->id);
+    }
+
+    // the client reactor has no listener
+    int listen_fd = reactor->listen_fd;
+
+    if (listen_fd != -1 && ws_set_nonblocking(listen_fd) == -1)
+    {
+        ws_log_perror("fcntl");
+        return -1;
+    }
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1)
+    {
+        ws_log_perror("epoll_create1");
+        return -1;
+    }
+    reactor->epfd = epfd;
+
+    // the listener and the wake eventfd are the only entries without a
+    // connection attached
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    struct epoll_event wake;
+    wake.events = EPOLLIN | EPOLLET;
+    wake.data.ptr = reactor;
+    if ((listen_fd != -1 && epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) ||
+        epoll_ctl(epfd, EPOLL_CTL_ADD, reactor->wake_fd, &wake) == -1)
+    {
+        ws_log_perror("epoll_ctl");
+        close(epfd);
+        return -1;
+    }
+
+    struct epoll_event events[WS_MAX_EVENTS];
+    t_epoll_reactor = reactor;
+
+    while (1)
+    {
+        // sleeps no longer than until the next timer is due
+        int n = epoll_wait(epfd, events, WS_MAX_EVENTS, ws_timer_wheel_timeout(&reactor->timers));
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            ws_log_perror("epoll_wait");
+            break;
+        }
+        ws_timer_wheel_update(&reactor->timers);
+
+        for (int i = 0; i < n; i++)
+        {
+            struct ws_conn *conn = events[i].data.ptr;
+            if (conn == NULL)
+            {
+                ws_reactor_accept(reactor);
+                continue;
+            }
+            if (events[i].data.ptr == reactor)
+            {
+                ws_reactor_on_wake(reactor);
+                continue;
+            }
+
+            if (events[i].events & EPOLLERR)
+            {
+                ws_conn_error(conn, 1006);
+                ws_conn_close(conn);
+                continue;
+            }
+
+            if ((events[i].events & EPOLLOUT) && ws_conn_on_writable(conn) == -1)
+            {
+                ws_conn_error(conn, 1006);
+                ws_conn_close(conn);
+                continue;
+            }
+
+            // read even on hangup so a trailing close frame is answered
+            if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) &&
+                ws_conn_on_readable(conn) == -1)
+            {
+                ws_conn_close(conn);
+            }
+        }
+
+        // after the events, so none of them refers to a connection a timer closed
+        ws_timer_wheel_expire(&reactor->timers, ws_reactor_on_timer);
+        ws_reactor_uncork(reactor);
+    }
+
+    ws_timer_cancel(&reactor->timers, &reactor->accept_backoff);
+    t_epoll_reactor = NULL;
+    close(epfd);
+    reactor->epfd = -1;
+    return -1;
+}
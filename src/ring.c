@@ -0,0 +1,82 @@
+#include "../include/ring.h"
+#include "../include/pool.h"
+#include <string.h>
+#include <sys/uio.h>
+
+// The buffer comes from the pool, so a connection can hand it back whenever
+// it runs empty and take another on its next read at little cost.
+int ws_ring_init(struct ws_ring *ring, size_t cap)
+{
+    ring->data = ws_buf_alloc(cap);
+    if (!ring->data)
+    {
+        return -1;
+    }
+    ring->cap = cap;
+    ring->head = 0;
+    ring->tail = 0;
+    return 0;
+}
+
+void ws_ring_free(struct ws_ring *ring)
+{
+    ws_buf_free(ring->data);
+    ring->data = NULL;
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+// Describes all of the free space, which is at most two segments once the
+// write position has wrapped, so it can be filled with one read.
+// returns the number of iovecs used
+int ws_ring_free_iov(const struct ws_ring *ring, struct iovec iov[2])
+{
+    size_t space = ws_ring_space(ring);
+    size_t pos = ring->tail & (ring->cap - 1);
+    size_t first = ring->cap - pos;
+    if (first > space)
+    {
+        first = space;
+    }
+
+    iov[0].iov_base = ring->data + pos;
+    iov[0].iov_len = first;
+    iov[1].iov_base = ring->data;
+    iov[1].iov_len = space - first;
+    return (space > first) ? 2 : 1;
+}
+
+// Offset of the first occurrence of c among the buffered bytes, or -1.
+ssize_t ws_ring_find(const struct ws_ring *ring, u_int8_t c)
+{
+    size_t n;
+    const u_int8_t *first = ws_ring_head(ring, &n);
+    const u_int8_t *hit = memchr(first, c, n);
+    if (hit)
+    {
+        return hit - first;
+    }
+
+    size_t rest = ws_ring_len(ring) - n;
+    hit = memchr(ring->data, c, rest);
+    return hit ? (ssize_t)(n + (hit - ring->data)) : -1;
+}
+
+// Copy the first n buffered bytes out without consuming them.
+void ws_ring_peek(const struct ws_ring *ring, void *dst, size_t n)
+{
+    size_t pos = ring->head & (ring->cap - 1);
+    size_t first = ring->cap - pos;
+    if (first > n)
+    {
+        first = n;
+    }
+    memcpy(dst, ring->data + pos, first);
+    memcpy((u_int8_t *)dst + first, ring->data, n - first);
+}
+
+void ws_ring_read(struct ws_ring *ring, void *dst, size_t n)
+{
+    ws_ring_peek(ring, dst, n);
+    ring->head += n;
+}
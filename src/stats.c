@@ -0,0 +1,158 @@
+#include "../include/stats.h"
+#include "../include/reactor.h"
+
+__thread struct ws_stats_shard *ws_stats_tls;
+
+static pthread_mutex_t g_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ws_stats_shard *g_stats_shards;
+static struct ws_stats_shard g_stats_retired; // folded in from exited threads
+static pthread_once_t g_stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_stats_key;
+
+static void ws_hist_merge(struct ws_hist_shard *dst, struct ws_hist_shard *src)
+{
+    WS_COUNTER_ADD(dst->count, atomic_load_explicit(&src->count, memory_order_relaxed));
+    WS_COUNTER_ADD(dst->sum, atomic_load_explicit(&src->sum, memory_order_relaxed));
+    u_int64_t max = atomic_load_explicit(&src->max, memory_order_relaxed);
+    if (max > atomic_load_explicit(&dst->max, memory_order_relaxed))
+    {
+        atomic_store_explicit(&dst->max, max, memory_order_relaxed);
+    }
+    for (int i = 0; i < WS_HIST_BUCKETS; i++)
+    {
+        WS_COUNTER_ADD(dst->buckets[i], atomic_load_explicit(&src->buckets[i], memory_order_relaxed));
+    }
+}
+
+static void ws_stats_merge(struct ws_stats_shard *dst, struct ws_stats_shard *src)
+{
+    for (int i = 0; i < WS_STAT_COUNT; i++)
+    {
+        WS_COUNTER_ADD(dst->counters[i], atomic_load_explicit(&src->counters[i], memory_order_relaxed));
+    }
+    ws_hist_merge(&dst->parse_ns, &src->parse_ns);
+    ws_hist_merge(&dst->send_ns, &src->send_ns);
+}
+
+// A thread's counts outlive it: fold them into the retired shard.
+static void ws_stats_release(void *arg)
+{
+    struct ws_stats_shard *shard = arg;
+
+    pthread_mutex_lock(&g_stats_lock);
+    for (struct ws_stats_shard **link = &g_stats_shards; *link; link = &(*link)->next)
+    {
+        if (*link == shard)
+        {
+            *link = shard->next;
+            break;
+        }
+    }
+    ws_stats_merge(&g_stats_retired, shard);
+    pthread_mutex_unlock(&g_stats_lock);
+    free(shard);
+}
+
+static void ws_stats_key_init(void) { pthread_key_create(&g_stats_key, ws_stats_release); }
+
+struct ws_stats_shard *ws_stats_shard_get(void)
+{
+    pthread_once(&g_stats_once, ws_stats_key_init);
+
+    struct ws_stats_shard *shard = calloc(1, sizeof(struct ws_stats_shard));
+    if (!shard)
+    {
+        return NULL;
+    }
+    pthread_mutex_lock(&g_stats_lock);
+    shard->next = g_stats_shards;
+    g_stats_shards = shard;
+    pthread_mutex_unlock(&g_stats_lock);
+
+    pthread_setspecific(g_stats_key, shard);
+    ws_stats_tls = shard;
+    return shard;
+}
+
+static void ws_hist_export(ws_histogram_t *dst, struct ws_hist_shard *src)
+{
+    dst->count = atomic_load_explicit(&src->count, memory_order_relaxed);
+    dst->sum = atomic_load_explicit(&src->sum, memory_order_relaxed);
+    dst->max = atomic_load_explicit(&src->max, memory_order_relaxed);
+    for (int i = 0; i < WS_HIST_BUCKETS; i++)
+    {
+        dst->buckets[i] = atomic_load_explicit(&src->buckets[i], memory_order_relaxed);
+    }
+}
+
+// Sums every thread's shard. Only the shard registry is locked; writers never
+// see the reader.
+void ws_stats_snapshot(ws_stats_t *stats)
+{
+    struct ws_stats_shard *total = calloc(1, sizeof(struct ws_stats_shard));
+    memset(stats, 0, sizeof(*stats));
+    if (!total)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&g_stats_lock);
+    ws_stats_merge(total, &g_stats_retired);
+    for (struct ws_stats_shard *shard = g_stats_shards; shard; shard = shard->next)
+    {
+        ws_stats_merge(total, shard);
+    }
+    pthread_mutex_unlock(&g_stats_lock);
+
+    u_int64_t c[WS_STAT_COUNT];
+    for (int i = 0; i < WS_STAT_COUNT; i++)
+    {
+        c[i] = atomic_load_explicit(&total->counters[i], memory_order_relaxed);
+    }
+    stats->connections_opened = c[WS_STAT_OPENED];
+    stats->connections_closed = c[WS_STAT_CLOSED];
+    stats->handshake_failures = c[WS_STAT_HANDSHAKE_FAILURES];
+    stats->frames_in = c[WS_STAT_FRAMES_IN];
+    stats->frames_out = c[WS_STAT_FRAMES_OUT];
+    stats->messages_in = c[WS_STAT_MESSAGES_IN];
+    stats->bytes_in = c[WS_STAT_BYTES_IN];
+    stats->bytes_out = c[WS_STAT_BYTES_OUT];
+    stats->sends_refused = c[WS_STAT_SENDS_REFUSED];
+    stats->queued_bytes = (int64_t)c[WS_STAT_QUEUED_BYTES];
+    stats->errors = c[WS_STAT_ERRORS];
+    memcpy(stats->close_codes, c + WS_STAT_CLOSE_CODES, sizeof(stats->close_codes));
+    ws_hist_export(&stats->parse_ns, &total->parse_ns);
+    ws_hist_export(&stats->send_ns, &total->send_ns);
+    free(total);
+}
+
+// Highest value in the bucket that holds the given percentile (0..100).
+u_int64_t ws_histogram_percentile(const ws_histogram_t *hist, double percentile)
+{
+    if (hist->count == 0)
+    {
+        return 0;
+    }
+    u_int64_t rank = (u_int64_t)(hist->count * percentile / 100.0);
+    if (rank >= hist->count)
+    {
+        rank = hist->count - 1;
+    }
+
+    u_int64_t seen = 0;
+    for (int i = 0; i < WS_HIST_BUCKETS; i++)
+    {
+        seen += hist->buckets[i];
+        if (seen > rank)
+        {
+            if (i < 8)
+            {
+                return i;
+            }
+            int e = i / 8 + 2;
+            u_int64_t top = ((u_int64_t)(8 + i % 8 + 1) << (e - 3)) - 1;
+            return top < hist->max ? top : hist->max;
+        }
+    }
+    return hist->max;
+}
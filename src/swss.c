@@ -1,10 +1,31 @@
+#define _GNU_SOURCE
 #include "../include/swss.h"
+#include "../include/deflate.h"
+#include "../include/log.h"
+#include "../include/mask.h"
+#include "../include/pool.h"
+#include "../include/random.h"
+#include "../include/reactor.h"
+#include "../include/stats.h"
 #include "../include/utils.h"
 #include <endian.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
-static const char *protocol_error = "\x03\xea"; // 1002
+static const u_int8_t *going_away = (const u_int8_t *)"\x03\xe9";     // 1001
+static const u_int8_t *protocol_error = (const u_int8_t *)"\x03\xea"; // 1002
+static const u_int8_t *invalid_payload = (const u_int8_t *)"\x03\xef"; // 1007
+static const u_int8_t *message_too_big = (const u_int8_t *)"\x03\xf1"; // 1009
 static ws_callbacks_t *g_callbacks;
+static ws_listen_opts_t g_opts;
+// g_opts is written by ws_listen_opts and by the first ws_connect, which may
+// run on different threads
+static pthread_mutex_t g_opts_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct ws_reactor *t_reactor;
 
 void ws_exit()
 {
@@ -13,44 +34,181 @@ void ws_exit()
     exit(0);
 }
 
-int ws_handshake(int sockfd)
+// Keeps the headers the handshake needs out of one request line.
+static void ws_handshake_header(struct ws_hs *hs, const char *line, size_t len)
 {
-    char buf[1024], *key;
-    recv(sockfd, buf, 1024, 0);
+    const char *colon = memchr(line, ':', len);
+    if (colon == NULL)
+    {
+        return;
+    }
+    size_t name_len = colon - line;
+    const char *value = colon + 1;
+    const char *end = line + len;
+    while (value < end && (*value == ' ' || *value == '\t'))
+    {
+        value++;
+    }
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+    {
+        end--;
+    }
+    size_t value_len = end - value;
 
-    key = strstr(buf, "Sec-WebSocket-Key:") + 19;
-    key = strtok(key, "\r\n");
+    if (name_len == 17 && strncasecmp(line, "Sec-WebSocket-Key", 17) == 0)
+    {
+        if (value_len <= WS_KEY_MAX)
+        {
+            memcpy(hs->key, value, value_len);
+            hs->key_len = value_len;
+        }
+    }
+    else if (name_len == 24 && strncasecmp(line, "Sec-WebSocket-Extensions", 24) == 0)
+    {
+        // offers may be split over several header lines
+        size_t have = hs->offers_len;
+        size_t sep = have > 0 ? 2 : 0;
+        if (have + sep + value_len < WS_HS_OFFERS_MAX)
+        {
+            memcpy(hs->offers + have, ", ", sep);
+            memcpy(hs->offers + have + sep, value, value_len);
+            hs->offers_len = have + sep + value_len;
+        }
+    }
+}
 
-    if (key == NULL)
+// Answers a complete upgrade request. The accept token and the response are
+// built in stack buffers, so a handshake costs no allocation.
+// returns 1 once the response is sent or queued, -1 on error
+static int ws_handshake_respond(struct ws_conn *conn)
+{
+    struct ws_hs *hs = conn->hs;
+    if (hs->key_len == 0)
     {
         return -1;
     }
 
-    char *response = ws_createAcceptToken(key);
+    char extensions[WS_EXTENSIONS_MAX];
+    if (hs->offers_len > 0)
+    {
+        hs->offers[hs->offers_len] = '\0';
+        conn->deflate = ws_deflate_negotiate(&g_opts.deflate, hs->offers, extensions, sizeof(extensions));
+    }
 
-    if ((send(sockfd, response, strlen(response), 0)) == -1)
+    char accept[WS_ACCEPT_LEN + 1];
+    if (ws_createAcceptToken(hs->key, hs->key_len, accept) == -1)
     {
-        perror("send");
         return -1;
     }
 
-    free(response);
-    // TODO: FREE THE KEY WITHOUT SEGFAULT
-    return 0;
+    char response[WS_RESPONSE_MAX];
+    struct iovec iov;
+    iov.iov_base = response;
+    iov.iov_len = ws_generateHTTPResponse(response, sizeof(response), accept, conn->deflate ? extensions : NULL);
+    if (iov.iov_len == 0)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&conn->out_lock);
+    int res = ws_outq_write(&conn->outq, conn, &iov, 1);
+    pthread_mutex_unlock(&conn->out_lock);
+    if (res == -1)
+    {
+        ws_log_perror("send");
+        return -1;
+    }
+    return 1;
 }
 
-int ws_send_response(int client_fd, u_int8_t opcode, u_int8_t *payload,
-                     u_int64_t payload_len, u_int8_t mask)
+// Parses the upgrade request a line at a time straight out of the read buffer,
+// across as many reads as it takes. Lines too long to hold a header we need
+// (large cookies, say) are skipped as they arrive rather than buffered, so
+// only the total size is bounded. Nothing past the blank line is consumed, so
+// a frame pipelined right behind the request stays buffered for read_frame.
+// returns 1 once the response is sent, 0 if more input is needed, -1 on error
+int ws_handshake(struct ws_conn *conn)
 {
-    if (client_fd < 0)
+    struct ws_ring *ring = &conn->rbuf;
+    char line[WS_HS_LINE_MAX];
+
+    if (conn->hs == NULL)
     {
-        return -1;
+        conn->hs = ws_buf_alloc(sizeof(struct ws_hs));
+        if (conn->hs == NULL)
+        {
+            return -1;
+        }
+        memset(conn->hs, 0, sizeof(struct ws_hs));
+    }
+    struct ws_hs *hs = conn->hs;
+
+    while (1)
+    {
+        ssize_t eol = ws_ring_find(ring, '\n');
+        size_t n = (eol == -1) ? ws_ring_len(ring) : (size_t)eol + 1;
+
+        if (eol == -1 && (n < WS_HS_LINE_MAX && hs->state != WS_HS_SKIP_LINE))
+        {
+            return 0;
+        }
+        if (hs->total + n > WS_HANDSHAKE_MAX)
+        {
+            return -1;
+        }
+        hs->total += n;
+
+        if (eol == -1 || n > WS_HS_LINE_MAX || hs->state == WS_HS_SKIP_LINE)
+        {
+            if (hs->state == WS_HS_REQUEST_LINE)
+            {
+                return -1;
+            }
+            ws_ring_consume(ring, n);
+            hs->state = (eol == -1) ? WS_HS_SKIP_LINE : WS_HS_HEADERS;
+            if (eol == -1)
+            {
+                return 0;
+            }
+            continue;
+        }
+
+        ws_ring_read(ring, line, n);
+        size_t len = n - 1;
+        if (len > 0 && line[len - 1] == '\r')
+        {
+            len--;
+        }
+
+        if (hs->state == WS_HS_REQUEST_LINE)
+        {
+            if (len < 4 || memcmp(line, "GET ", 4) != 0)
+            {
+                return -1;
+            }
+            hs->state = WS_HS_HEADERS;
+        }
+        else if (len == 0)
+        {
+            return ws_handshake_respond(conn);
+        }
+        else
+        {
+            ws_handshake_header(hs, line, len);
+        }
     }
+}
 
+// Writes the frame header for a payload of payload_len bytes into frame, which
+// must have room for WS_MAX_HEADER bytes. A non-NULL mask_key sets the MASK bit
+// and appends the key. returns the header size
+size_t ws_encode_header(u_int8_t *frame, u_int8_t opcode, u_int64_t payload_len,
+                        const u_int8_t *mask_key)
+{
     size_t frame_header_size = 2;
     u_int8_t payload_len_specifier = 0;
 
-    if (payload_len == NULL || payload_len <= 125)
+    if (payload_len <= 125)
     {
         payload_len_specifier = payload_len;
     }
@@ -65,507 +223,2097 @@ int ws_send_response(int client_fd, u_int8_t opcode, u_int8_t *payload,
         frame_header_size += 8;
     }
 
-    u_int8_t *frame = malloc(frame_header_size + payload_len);
-    if (!frame)
-    {
-        return -1;
-    }
-
     // 0x80 -> 1000 0000, fin rsrv1 rsrv2 rsrv3 opcode(4 bit)
     frame[0] = 0x80 | opcode;
 
     // if mask is enabled then first bit of second byte is set to 1 and rest is
     // payload length specifier
-    if (mask)
-    {
-        frame[1] = 0x80;
-    }
-    else
-    {
-        frame[1] = 0x00;
-    }
-
+    frame[1] = mask_key ? 0x80 : 0x00;
     frame[1] |= payload_len_specifier;
 
     if (payload_len_specifier == 126)
     {
-        // host order to network order (little endian to big endian) for length of 2
-        // bytes
-        size_t len = htons(payload_len);
+        // host order to network order for length of 2 bytes
+        u_int16_t len = htons(payload_len);
         memcpy(frame + 2, &len, 2);
     }
     else if (payload_len_specifier == 127)
     {
-        // host order to network order (little endian to big endian) for length of
-        // 64 bytes
-        size_t len = htobe64(payload_len);
+        // host order to network order for length of 8 bytes
+        u_int64_t len = htobe64(payload_len);
         memcpy(frame + 2, &len, 8);
     }
 
-    if (mask)
+    if (mask_key)
     {
-        u_int8_t mask_key[4];
-        mask_key[0] = rand() % 256;
-        mask_key[1] = rand() % 256;
-        mask_key[2] = rand() % 256;
-        mask_key[3] = rand() % 256;
-
         memcpy(frame + frame_header_size, mask_key, 4);
         frame_header_size += 4;
     }
 
-    // Copy payload at correct offset
-    if (payload != NULL && payload_len > 0)
-    {
-        memcpy(frame + frame_header_size, payload, payload_len);
-    }
-
-    size_t total_size = frame_header_size + payload_len;
-    ssize_t bytes_sent = send(client_fd, frame, total_size, 0);
-    free(frame);
-
-    if (bytes_sent == -1)
-    {
-        return -1;
-    }
-
-    return 0;
+    return frame_header_size;
 }
 
-// reads one control frame (exit, ping, pong)
-// OR
-// reads one message frame, possibly interspersed with any number of control frames (if fragmented)
-int read_frame(int sock_fd)
+// Sends everything described by iov, resuming after short writes. The iovec
+// array is consumed in the process.
+int ws_sendv_all(int fd, struct iovec *iov, int iovcnt)
 {
-    if (sock_fd < 0)
-    {
-        return -1;
-    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
 
-    printf("\nReading frame\n");
-    u_int8_t original_opcode = 0; // for fragmented messages
-    u_int8_t *final_payload = NULL;
-    u_int64_t final_payload_len = 0;
-    ssize_t recv_result;
-
-    while (1)
+    while (iovcnt > 0)
     {
-        u_int8_t buf[2];
-        u_int64_t received_len = 0;
-        while (received_len != 2)
-        {
-            recv_result = recv(sock_fd, buf + received_len, 2 - received_len, 0);
-            if (recv_result <= 0)
-            {
-                free(final_payload);
-                return -1;
-            }
-            received_len += recv_result;
-        }
-
-        u_int8_t fin = (buf[0] & 0x80) >> 7;
-        u_int8_t rsv = buf[0] & 0x70;
-        u_int8_t opcode = buf[0] & 0x0F;
-
-        printf("FIN: %d\n", fin);
-
-        u_int8_t mask = (buf[1] & 0x80) >> 7;
-        printf("Mask: %d\n", mask);
-
-        switch (opcode)
-        {
-        case 0x0:
-            printf("Continuation Frame\n");
-            break;
-        case 0x1:
-            printf("Text Frame\n");
-            break;
-        case 0x2:
-            printf("Binary Frame\n");
-            break;
-        case 0x8:
-            printf("Close Frame\n");
-            break;
-        case 0x9:
-            printf("Ping Frame\n");
-            break;
-        case 0xA:
-            printf("Pong Frame\n");
-            break;
-        }
-
-        u_int64_t payload_len = buf[1] & 0x7F;
-
-        printf("Payload Length: %lu\n", payload_len);
-
-        if (opcode >= 0x8 && payload_len > 125)
-        {
-            printf("Invalid Extended Payload Frame\n");
-            free(final_payload);
-            return -1;
-        }
-        if (payload_len == 126)
-        {
-            u_int64_t received_len = 0;
-            while (received_len != 2)
-            {
-                recv_result = recv(sock_fd, ((char *)&payload_len) + received_len, 2 - received_len, 0);
-                if (recv_result <= 0)
-                {
-                    free(final_payload);
-                    return -1;
-                }
-                received_len += recv_result;
-            }
-            payload_len = be64toh(payload_len);
-            payload_len = payload_len >> (6*8);
-            printf("2-Extended Payload Length: %lu\n", payload_len);
-        }
-        else if (payload_len == 127)
-        {
-            u_int64_t received_len = 0;
-            while (received_len != 8)
-            {
-                recv_result = recv(sock_fd, ((char *)&payload_len) + received_len, 8 - received_len, 0);
-                if (recv_result <= 0)
-                {
-                    free(final_payload);
-                    return -1;
-                }
-                received_len += recv_result;
-            }
-            payload_len = be64toh(payload_len);
-            printf("8-Extended Payload Length: %lu\n", payload_len);
-        }
-
-        u_int8_t mask_key[4];
-        if (mask == 1)
-        {
-            u_int64_t received_len = 0;
-            while (received_len != 4)
-            {
-                recv_result = recv(sock_fd, mask_key + received_len, 4 - received_len, 0);
-                if (recv_result <= 0)
-                {
-                    free(final_payload);
-                    return -1;
-                }
-                received_len += recv_result;
-            }
-            printf("Mask Key: %d %d %d %d\n", mask_key[0], mask_key[1], mask_key[2],
-                   mask_key[3]);
-        }
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
 
-        u_int8_t *payload = NULL;
-        if (payload_len > 0)
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent == -1)
         {
-            payload = malloc(payload_len);
-            if (!payload)
-            {
-                free(final_payload);
-                return -1;
-            }
-
-            u_int64_t received_len = 0;
-            while (received_len != payload_len)
-            {
-                recv_result = recv(sock_fd, payload + received_len, payload_len - received_len, 0);
-                if (recv_result <= 0)
-                {
-                    free(payload);
-                    free(final_payload);
-                    return -1;
-                }
-                received_len += recv_result;
-            }
-
-            if (mask == 1)
+            if (errno == EINTR)
             {
-                for (int i = 0; i < payload_len; i++)
-                {
-                    payload[i] = payload[i] ^ mask_key[i % 4];
-                }
+                continue;
             }
-
-            if (opcode <= 0x2)
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
             {
-                u_int8_t *new_final_payload = realloc(final_payload, final_payload_len + payload_len);
-                if (!new_final_payload)
-                {
-                    free(payload);
-                    free(final_payload);
-                    return -1;
-                }
-                final_payload = new_final_payload;
-
-                memcpy(final_payload + final_payload_len, payload, payload_len);
-                final_payload_len += payload_len;
+                struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+                poll(&pfd, 1, -1);
+                continue;
             }
-        }
-
-        // reserved / future (not supported) opcodes
-        if ((3 <= opcode && opcode <= 7) || opcode > 10)
-        {
-            ws_send_response(sock_fd, 0x8, protocol_error, 2, 0);
-            free(payload);
-            free(final_payload);
-            return -1;
-        }
-        // this does not support any protocol extensions
-        if (rsv != 0)
-        {
-            ws_send_response(sock_fd, 0x8, protocol_error, 2, 0);
-            free(payload);
-            free(final_payload);
             return -1;
         }
 
-        switch (opcode)
+        // skip the iovecs that went out whole, trim the one cut short
+        while (iovcnt > 0 && (size_t)sent >= iov->iov_len)
         {
-        case 0x0:
-            if (original_opcode == 0)
-            {
-                // continuing, but never got a non-fin start?
-                ws_send_response(sock_fd, 0x8, protocol_error, 2, 0);
-                free(payload);
-                free(final_payload);
-                return -1;
-            }
-            // fall through
-        case 0x1:
-        case 0x2:
-            if (opcode != 0)
-            {
-                if (original_opcode != 0)
-                {
-                    // tried to start a new message while a fragmented one was in-progress
-                    ws_send_response(sock_fd, 0x8, protocol_error, 2, 0);
-                    free(payload);
-                    free(final_payload);
-                    return -1;
-                }
-                original_opcode = opcode;
-            }
-            if (fin != 1)
-            {
-                free(payload);
-                continue;
-            }
-            break;
-        case 0x8:
-        case 0x9:
-        case 0xA:
-            if (fin != 1 || (opcode == 0x8 && payload_len == 1))
-            {
-                ws_send_response(sock_fd, 0x8, protocol_error, 2, 0);
-                free(payload);
-                free(final_payload);
-                return -1;
-            }
-            break;
+            sent -= iov->iov_len;
+            iov++;
+            iovcnt--;
         }
-
-        switch (opcode)
+        if (iovcnt > 0)
         {
-        case 0x0:
-            if (original_opcode == 0)
-            {
-                // finished a continue, but never got a non-fin start?
-                ws_send_response(sock_fd, 0x8, protocol_error, 2, 0);
-                free(payload);
-                free(final_payload);
-                return -1;
-            }
-            // fall through
-        case 0x1:
-        case 0x2:
-            g_callbacks->on_message(sock_fd, (original_opcode == 0x1) ? 1 : 0,
-                (final_payload_len > 0 && final_payload != NULL) ? (const char *)final_payload : "\0",
-                (final_payload_len > 0) ? final_payload_len : 0
-            );
-            free(payload);
-            free(final_payload);
-            return 1;
-            break;
-        case 0x8:
-            u_int16_t reason = 1000;
-            if(payload_len != 0 && payload != NULL)
-            {
-                reason = be16toh((((u_int16_t)payload[1]) << 8) | payload[0]);
-            }
-            switch (reason)
-            {
-            case 1000 ... 1003:
-            case 1007 ... 1011:
-            case 3000:
-            case 3999:
-            case 4000:
-            case 4999:
-                ws_send_response(sock_fd, 0x8,
-                    (payload_len != 0 && payload != NULL) ? (const char *)payload : "\x03\xe8", // 1000
-                2, 0);
-                break;
-            default:
-                ws_send_response(sock_fd, 0x8, protocol_error, 2, 0);
-                break;
-            }
-            free(payload);
-            free(final_payload);
-            return -1;
-        case 0x9:
-            ws_send_response(sock_fd, 0xA,
-                (payload_len > 0 && payload != NULL) ? payload : NULL,
-                (payload_len > 0) ? payload_len : 0,
-            0);
-            // fall through
-        case 0xA:
-            free(payload);
-            if (original_opcode == 0)
-            {
-                free(final_payload);
-                return 1;
-            }
-            break;
+            iov->iov_base = (u_int8_t *)iov->iov_base + sent;
+            iov->iov_len -= sent;
         }
     }
 
-    // should never be hit, will have to explicitly return after a fin above
-    return 1;
+    return 0;
 }
 
-void *handle_client(void *arg)
+// The header is built on the stack and goes out in the same sendmsg as the
+// caller's payload, so the payload is never copied. Masked (client) frames
+// can't be sent from the caller's buffer and are masked through a stack
+// buffer a chunk at a time instead.
+int ws_send_response(int client_fd, u_int8_t opcode, const u_int8_t *payload,
+                     u_int64_t payload_len, u_int8_t mask)
 {
-    int clientfd = *((int *)arg);
-    free(arg);
+    if (client_fd < 0)
+    {
+        return -1;
+    }
+    if (payload == NULL)
+    {
+        payload_len = 0;
+    }
+
+    u_int8_t frame[WS_MAX_HEADER];
+    u_int8_t mask_key[4];
 
-    // handshake failed
-    if (ws_handshake(clientfd) != 0)
+    if (mask)
     {
-        perror("ws_handshake");
-        printf("Client Disconnected\n");
-        send(clientfd, "HTTP/1.1 400 Bad Request\r\n", 25, 0);
-        close(clientfd);
+        ws_random_bytes(mask_key, sizeof(mask_key));
     }
 
-    char buf[4096];
+    struct iovec iov[2];
+    iov[0].iov_base = frame;
+    iov[0].iov_len = ws_encode_header(frame, opcode, payload_len, mask ? mask_key : NULL);
 
-    while (1)
+    if (!mask)
     {
-        int res = read_frame(clientfd);
-        if (res == -1)
+        iov[1].iov_base = (void *)payload;
+        iov[1].iov_len = payload_len;
+        return ws_sendv_all(client_fd, iov, payload_len > 0 ? 2 : 1);
+    }
+
+    u_int8_t chunk[4096];
+    u_int64_t offset = 0;
+    int iovcnt = 1;
+    do
+    {
+        u_int64_t n = payload_len - offset;
+        if (n > sizeof(chunk))
         {
-            break;
+            n = sizeof(chunk);
         }
-    }
+        memcpy(chunk, payload + offset, n);
+        ws_mask(chunk, n, mask_key, offset);
+        iov[iovcnt].iov_base = chunk;
+        iov[iovcnt].iov_len = n;
+        if (ws_sendv_all(client_fd, iov, iovcnt + 1) == -1)
+        {
+            return -1;
+        }
+        offset += n;
+        iovcnt = 0;
+    } while (offset < payload_len);
 
-    g_callbacks->on_close(clientfd);
-    close(clientfd);
-    return NULL;
+    return 0;
 }
 
-void ws_init(ws_callbacks_t *callbacks) { g_callbacks = callbacks; }
-
-// Wrapper function for sending text messages
-int ws_send_txt(int client_fd, const char *message, size_t length)
+// Closes the connection with the given close code (a 2-byte payload) and
+// reports the failure.
+// returns -1, for the caller to pass on
+static int ws_conn_fail(struct ws_conn *conn, const u_int8_t *code)
 {
-    return ws_send_response(client_fd, 0x1, (u_int8_t *)message, length, 0);
+    ws_conn_send(conn, 0x8, code, 2);
+    ws_conn_error(conn, (code[0] << 8) | code[1]);
+    return -1;
 }
 
-// Wrapper function for sending binary payloads
-int ws_send_bin(int client_fd, const u_int8_t *payload, size_t length)
+static void ws_reset_frame(struct ws_conn *conn)
 {
-    return ws_send_response(client_fd, 0x2, (u_int8_t *)payload, length, 0);
+    conn->payload = NULL;
+    conn->payload_have = 0;
+    conn->read_state = WS_READ_HEADER;
 }
 
-// Setup TCP server and listen for incoming connections
-int ws_listen(const char *PORT)
+// Checks a frame header against the opcode and fragmentation rules before any
+// of its payload is read, so a bad frame never costs an allocation.
+// returns 0 if the frame is acceptable, -1 after sending a protocol error
+static int ws_check_frame(struct ws_conn *conn)
 {
+    u_int8_t opcode = conn->opcode;
 
-    if (g_callbacks == NULL)
+    // reserved / future (not supported) opcodes
+    if ((3 <= opcode && opcode <= 7) || opcode > 10)
     {
-        fprintf(stderr, "ws_init must be called before ws_listen\n");
-        return -1;
+        return ws_conn_fail(conn, protocol_error);
     }
-
-    struct addrinfo hints, *res, *p;
-    int sockfd, clientfd, yes = 1;
-
-    struct sockaddr_storage their_addr;
-    socklen_t sin_size = sizeof(their_addr);
-
-    memset(&hints, 0, sizeof(hints));
-
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
-
-    if (getaddrinfo(NULL, PORT, &hints, &res) != 0)
+    // a server never masks what it sends
+    if (conn->client && conn->mask)
     {
-        perror("getaddrinfo");
-        return -1;
+        return ws_conn_fail(conn, protocol_error);
     }
-    for (p = res; p != NULL; p = p->ai_next)
+    // RSV1 marks the first frame of a compressed message, if deflate was
+    // negotiated; nothing else may set a reserved bit
+    if (conn->rsv != 0 && !(conn->rsv == WS_RSV1 && conn->deflate && (opcode == 0x1 || opcode == 0x2)))
     {
-        if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+        return ws_conn_fail(conn, protocol_error);
+    }
+
+    switch (opcode)
+    {
+    case 0x0:
+        if (conn->original_opcode == 0)
         {
-            continue;
+            // continuing, but never got a non-fin start?
+            return ws_conn_fail(conn, protocol_error);
         }
-
-        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1)
+        break;
+    case 0x1:
+    case 0x2:
+        if (conn->original_opcode != 0)
         {
-            close(sockfd);
-            continue;
+            // tried to start a new message while a fragmented one was in-progress
+            return ws_conn_fail(conn, protocol_error);
         }
-
-        if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1)
+        break;
+    case 0x8:
+    case 0x9:
+    case 0xA:
+        if (conn->fin != 1 || (opcode == 0x8 && conn->payload_len == 1))
         {
-            close(sockfd);
-            continue;
+            return ws_conn_fail(conn, protocol_error);
         }
-
         break;
     }
 
-    freeaddrinfo(res);
+    return 0;
+}
 
-    if (p == NULL)
+static int ws_streaming(const struct ws_conn *conn) { return conn->callbacks->on_message_chunk != NULL; }
+
+// With a worker pool, stops reading from conn once more of its payloads wait
+// for a worker than the worker high-water mark allows. The worker that brings
+// it back down to the low-water mark hands it back to the reactor (see
+// ws_conn_on_inbox).
+static void ws_conn_throttle(struct ws_conn *conn)
+{
+    if (atomic_load(&conn->task_bytes) <= g_opts.worker_high_water || atomic_load(&conn->rx_paused))
     {
-        perror("socket");
-        return -1;
+        return;
     }
-
-    if (listen(sockfd, 10) == -1)
+    atomic_store(&conn->rx_paused, 1);
+    // the workers may have caught up in the meantime
+    if (atomic_load(&conn->task_bytes) <= g_opts.worker_low_water && atomic_exchange(&conn->rx_paused, 0))
+    {
+        return;
+    }
+    if (conn->uring)
+    {
+        ws_uring_pause(conn);
+    }
+}
+
+// Decides where the payload of the frame just parsed will land. Message
+// fragments are read straight onto the end of the pooled message buffer, so
+// reassembly needs no per-fragment buffer and no second copy; control frame
+// payloads fit in the connection itself. A streamed message has no buffer.
+// The size limit is checked against the declared length, before anything is
+// allocated for it.
+// returns 0 on success, -1 if the message is too big or the buffer can't grow
+static int ws_prepare_payload(struct ws_conn *conn)
+{
+    if (conn->opcode >= 0x8)
+    {
+        conn->payload = conn->ctrl;
+        return 0;
+    }
+
+    u_int64_t need = conn->msg_len + conn->payload_len;
+    if (need < conn->msg_len || need > g_opts.max_message_size)
+    {
+        return ws_conn_fail(conn, message_too_big);
+    }
+
+    if (conn->opcode != 0)
+    {
+        conn->original_opcode = conn->opcode;
+        conn->msg_compressed = (conn->rsv == WS_RSV1);
+        if (ws_streaming(conn) && conn->callbacks->on_message_begin)
+        {
+            ws_callback(conn, WS_TASK_BEGIN, conn->opcode == 0x1);
+        }
+    }
+
+    if (ws_streaming(conn))
+    {
+        conn->payload = NULL;
+        return 0;
+    }
+    if (need > 0)
+    {
+        u_int8_t *msg = ws_buf_grow(conn->msg, conn->msg_len, need);
+        if (!msg)
+        {
+            return -1;
+        }
+        conn->msg = msg;
+    }
+    conn->payload = conn->msg ? conn->msg + conn->msg_len : NULL;
+    return 0;
+}
+
+// Checks the next piece of the text message being received as UTF-8; last
+// also requires the message to end on a character boundary. Binary messages
+// pass unchecked.
+// returns 0 on success, -1 after failing the connection with 1007
+static int ws_check_text(struct ws_conn *conn, const u_int8_t *data, size_t len, int last)
+{
+    if (conn->original_opcode != 0x1)
+    {
+        return 0;
+    }
+    if (ws_utf8_feed(&conn->utf8, data, len) == -1 || (last && ws_utf8_end(&conn->utf8) == -1))
+    {
+        ws_log_debug("fd %d: text message is not UTF-8", conn->fd);
+        return ws_conn_fail(conn, invalid_payload);
+    }
+    return 0;
+}
+
+// Unmasks the next n bytes of the frame's payload in place and, for text that
+// wasn't compressed, checks them while they are still in cache, so a bad
+// message fails as soon as its first bad fragment arrives.
+// returns 0 on success, -1 after failing the connection
+static int ws_take_payload(struct ws_conn *conn, u_int8_t *data, size_t n)
+{
+    if (conn->mask == 1)
+    {
+        ws_mask(data, n, conn->mask_key, conn->payload_have);
+    }
+    if (conn->opcode < 0x8 && !conn->msg_compressed)
+    {
+        return ws_check_text(conn, data, n, 0);
+    }
+    return 0;
+}
+
+static int ws_emit_chunk(void *ctx, const u_int8_t *data, size_t len)
+{
+    struct ws_conn *conn = ctx;
+    conn->msg_delivered += len;
+    if (conn->msg_delivered > g_opts.max_message_size)
+    {
+        return ws_conn_fail(conn, message_too_big);
+    }
+    if (ws_check_text(conn, data, len, 0) == -1)
+    {
+        return -1;
+    }
+    ws_callback_copy(conn, WS_TASK_CHUNK, data, len);
+    ws_conn_throttle(conn);
+    return 0;
+}
+
+// Hands one piece of a streamed message to the application, inflating it
+// first if the message is compressed. last flushes the end of the message.
+// returns 0 on success, -1 after sending a close
+static int ws_stream_chunk(struct ws_conn *conn, const u_int8_t *data, size_t len, int last)
+{
+    if (!conn->msg_compressed)
+    {
+        if (len > 0)
+        {
+            ws_callback_copy(conn, WS_TASK_CHUNK, data, len);
+            ws_conn_throttle(conn);
+        }
+        return 0;
+    }
+
+    int res = ws_deflate_inflate_stream(conn->deflate, data, len, last, ws_emit_chunk, conn);
+    if (res == -1)
+    {
+        return ws_conn_fail(conn, invalid_payload);
+    }
+    return res == 0 ? 0 : -1;
+}
+
+static void ws_end_message(struct ws_conn *conn)
+{
+    ws_buf_free(conn->msg);
+    conn->msg = NULL;
+    conn->msg_len = 0;
+    conn->msg_delivered = 0;
+    conn->original_opcode = 0;
+    conn->msg_compressed = 0;
+    memset(&conn->utf8, 0, sizeof(conn->utf8));
+}
+
+// Acts on a frame once its payload is complete: fragments extend the message
+// being reassembled, which is delivered on FIN; control frames are answered.
+// returns 1 to keep reading, -1 to close the connection
+static int ws_process_frame(struct ws_conn *conn)
+{
+    u_int8_t *payload = conn->payload;
+    u_int64_t payload_len = conn->payload_len;
+
+    switch (conn->opcode)
+    {
+    case 0x0:
+    case 0x1:
+    case 0x2:
+        conn->msg_len += payload_len;
+        if (conn->fin != 1)
+        {
+            return 1;
+        }
+        ws_stat_add(WS_STAT_MESSAGES_IN, 1);
+        if (ws_streaming(conn))
+        {
+            if (ws_stream_chunk(conn, NULL, 0, 1) == -1 || ws_check_text(conn, NULL, 0, 1) == -1)
+            {
+                return -1;
+            }
+            if (conn->callbacks->on_message_end)
+            {
+                ws_callback(conn, WS_TASK_END, 0);
+            }
+            ws_end_message(conn);
+            return 1;
+        }
+    {
+        // the message goes with the callback, which frees it
+        u_int8_t *message = conn->msg;
+        size_t length = conn->msg_len;
+        if (conn->msg_compressed)
+        {
+            int res = ws_deflate_decompress(conn->deflate, conn->msg, conn->msg_len, g_opts.max_message_size,
+                                            &message, &length);
+            if (res < 0)
+            {
+                return ws_conn_fail(conn, res == -2 ? message_too_big : invalid_payload);
+            }
+        }
+        else
+        {
+            conn->msg = NULL;
+        }
+        // compressed text could only be checked once inflated
+        if (ws_check_text(conn, conn->msg_compressed ? message : NULL, conn->msg_compressed ? length : 0, 1) == -1)
+        {
+            ws_buf_free(message);
+            return -1;
+        }
+
+        ws_callback_take(conn, WS_TASK_MESSAGE, conn->original_opcode == 0x1, message, length);
+        ws_conn_throttle(conn);
+        ws_end_message(conn);
+        return 1;
+    }
+    case 0x8:
+    {
+        u_int16_t reason = 1000;
+        if (payload_len != 0)
+        {
+            reason = be16toh((((u_int16_t)payload[1]) << 8) | payload[0]);
+        }
+        // the reason after the code is text too
+        if (payload_len > 2 && ws_utf8_valid(payload + 2, payload_len - 2) == -1)
+        {
+            ws_conn_fail(conn, invalid_payload);
+            return -1;
+        }
+        switch (reason)
+        {
+        case 1000 ... 1003:
+        case 1007 ... 1011:
+        case 3000:
+        case 3999:
+        case 4000:
+        case 4999:
+            ws_conn_send(conn, 0x8,
+                (payload_len != 0) ? payload : (const u_int8_t *)"\x03\xe8", // 1000
+            2);
+            break;
+        default:
+            ws_conn_fail(conn, protocol_error);
+            break;
+        }
+        return -1;
+    }
+    case 0x9:
+        ws_conn_send(conn, 0xA, payload, payload_len);
+        break;
+    case 0xA:
+        conn->ping_sent = 0;
+        break;
+    }
+
+    return 1;
+}
+
+// Parses one frame (control or message fragment) out of the connection's read
+// buffer. Nothing is consumed until the whole header is buffered; the payload
+// is taken as it arrives, so the next call resumes where this one stopped.
+// returns 1 after a complete frame, 0 if more input is needed, -1 to close
+int read_frame(struct ws_conn *conn)
+{
+    struct ws_ring *ring = &conn->rbuf;
+    u_int64_t start = ws_now_ns();
+
+    if (conn->read_state == WS_READ_HEADER)
+    {
+        u_int8_t hdr[WS_MAX_HEADER];
+        size_t avail = ws_ring_len(ring);
+        if (avail < 2)
+        {
+            return 0;
+        }
+
+        ws_ring_peek(ring, hdr, 2);
+        size_t header_len = 2;
+        u_int8_t len7 = hdr[1] & 0x7F;
+        if (len7 == 126)
+        {
+            header_len += 2;
+        }
+        else if (len7 == 127)
+        {
+            header_len += 8;
+        }
+        if (hdr[1] & 0x80)
+        {
+            header_len += 4;
+        }
+        if (avail < header_len)
+        {
+            return 0;
+        }
+        ws_ring_read(ring, hdr, header_len);
+
+        conn->fin = (hdr[0] & 0x80) >> 7;
+        conn->rsv = hdr[0] & 0x70;
+        conn->opcode = hdr[0] & 0x0F;
+        conn->mask = (hdr[1] & 0x80) >> 7;
+        conn->payload_len = len7;
+
+        if (conn->opcode >= 0x8 && conn->payload_len > 125)
+        {
+            ws_log_debug("fd %d: control frame with extended payload length", conn->fd);
+            return ws_conn_fail(conn, protocol_error);
+        }
+
+        size_t pos = 2;
+        if (len7 == 126 || len7 == 127)
+        {
+            u_int64_t ext_len = (len7 == 126) ? 2 : 8;
+            u_int64_t payload_len = 0;
+            memcpy(((u_int8_t *)&payload_len) + 8 - ext_len, hdr + pos, ext_len);
+            conn->payload_len = be64toh(payload_len);
+            pos += ext_len;
+        }
+
+        if (conn->mask == 1)
+        {
+            memcpy(conn->mask_key, hdr + pos, 4);
+        }
+
+        ws_log_trace("fd %d: frame fin=%d rsv=%x opcode=%x mask=%d len=%lu", conn->fd, conn->fin, conn->rsv >> 4,
+                     conn->opcode, conn->mask, conn->payload_len);
+
+        WS_COUNTER_ADD(conn->frames_in, 1);
+        ws_stat_add(WS_STAT_FRAMES_IN, 1);
+
+        if (ws_check_frame(conn) == -1 || ws_prepare_payload(conn) == -1)
+        {
+            return -1;
+        }
+        conn->payload_have = 0;
+        conn->read_state = WS_READ_PAYLOAD;
+    }
+
+    // a streamed fragment is unmasked in the ring and passed on from there,
+    // one contiguous piece at a time
+    while (conn->opcode < 0x8 && ws_streaming(conn) && conn->payload_have < conn->payload_len)
+    {
+        size_t n;
+        u_int8_t *piece = ws_ring_head(ring, &n);
+        if (n == 0)
+        {
+            return 0;
+        }
+        if (n > conn->payload_len - conn->payload_have)
+        {
+            n = conn->payload_len - conn->payload_have;
+        }
+        if (ws_take_payload(conn, piece, n) == -1 || ws_stream_chunk(conn, piece, n, 0) == -1)
+        {
+            return -1;
+        }
+        ws_ring_consume(ring, n);
+        conn->payload_have += n;
+    }
+
+    u_int64_t want = conn->payload_len - conn->payload_have;
+    size_t avail = ws_ring_len(ring);
+    if (want > avail)
+    {
+        want = avail;
+    }
+    if (want > 0)
+    {
+        ws_ring_read(ring, conn->payload + conn->payload_have, want);
+        if (ws_take_payload(conn, conn->payload + conn->payload_have, want) == -1)
+        {
+            return -1;
+        }
+        conn->payload_have += want;
+    }
+
+    if (conn->payload_have < conn->payload_len)
+    {
+        return 0;
+    }
+
+    ws_stat_parse_ns(ws_now_ns() - start);
+    int res = ws_process_frame(conn);
+    ws_reset_frame(conn);
+    return res;
+}
+
+// Sized to the hard descriptor limit, which bounds how many connections can
+// be open at once; slabs of the table are only allocated as they are needed.
+int ws_conn_table_init(void)
+{
+    struct rlimit rl;
+    size_t size = 65536;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        size = (rl.rlim_max == RLIM_INFINITY || rl.rlim_max > (1 << 24)) ? rl.rlim_cur : rl.rlim_max;
+    }
+    return ws_table_init(size);
+}
+
+struct ws_conn *ws_conn_new(int fd)
+{
+    struct ws_conn *conn = ws_table_alloc();
+    if (!conn)
+    {
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->state = WS_STATE_HANDSHAKE;
+    conn->callbacks = g_callbacks;
+    conn->read_state = WS_READ_HEADER;
+    // release: a lookup that takes a reference sees the slot zeroed
+    atomic_store_explicit(&conn->refs, 1, memory_order_release);
+    conn->reactor = t_reactor;
+    pthread_mutex_init(&conn->out_lock, NULL);
+    pthread_cond_init(&conn->drained, NULL);
+
+    struct ws_timer_wheel *timers = &conn->reactor->timers;
+    conn->last_rx = timers->clock;
+    if (g_opts.handshake_timeout_ms > 0)
+    {
+        ws_timer_schedule(timers, &conn->timer, timers->clock + ws_timer_ticks(g_opts.handshake_timeout_ms));
+    }
+
+    ws_table_publish(conn);
+    return conn;
+}
+
+// Returns the connection handle names with a reference held, or NULL.
+struct ws_conn *ws_conn_lookup(ws_conn_t handle)
+{
+    // a worker's handler reaches the connection it was called for even once
+    // it has closed
+    struct ws_conn *conn = ws_worker_conn(handle);
+    if (conn)
+    {
+        return conn;
+    }
+    return ws_table_get(handle);
+}
+
+void ws_conn_put(struct ws_conn *conn)
+{
+    if (atomic_fetch_sub_explicit(&conn->refs, 1, memory_order_acq_rel) != 1)
+    {
+        return;
+    }
+    pthread_mutex_destroy(&conn->out_lock);
+    pthread_cond_destroy(&conn->drained);
+    ws_buf_free(conn->hs);
+    ws_ring_free(&conn->rbuf);
+    ws_buf_free(conn->msg);
+    ws_deflate_free(conn->deflate);
+    SSL_free(conn->tls);
+    ws_buf_free(conn->tx);
+    free(conn->topics);
+    ws_table_free(conn);
+}
+
+// Bytes accepted for conn but not yet written: its send queue plus whatever
+// other threads left in its inbox.
+static size_t ws_conn_backlog(struct ws_conn *conn)
+{
+    return atomic_load_explicit(&conn->outq.bytes, memory_order_relaxed) +
+           atomic_load_explicit(&conn->inbox_bytes, memory_order_relaxed);
+}
+
+// Applies the overflow policy before len more bytes of a message are queued on
+// conn. Called with out_lock held; a blocking sender releases it while it waits.
+// returns 0 if the message may go out, -1 if it is refused
+static int ws_conn_admit(struct ws_conn *conn, size_t len)
+{
+    struct ws_outq *q = &conn->outq;
+    size_t backlog = ws_conn_backlog(conn);
+    if (backlog == 0 || backlog + len <= g_opts.send_high_water)
+    {
+        return 0;
+    }
+
+    conn->backpressured = 1;
+    switch (g_opts.send_overflow)
+    {
+    case WS_OVERFLOW_BLOCK:
+        // a reactor thread has sockets of its own to flush and must not wait
+        if (!t_reactor)
+        {
+            while (!conn->closed && ws_conn_backlog(conn) > g_opts.send_low_water)
+            {
+                // other senders refill the inbox without out_lock, so the
+                // mark may have been cleared while this one slept
+                conn->backpressured = 1;
+                pthread_cond_wait(&conn->drained, &conn->out_lock);
+            }
+            if (!conn->closed)
+            {
+                return 0;
+            }
+        }
+        break;
+    case WS_OVERFLOW_DISCONNECT:
+        // the owning reactor sees the hangup and closes the connection; an
+        // in-flight io_uring send still points into the queue
+        shutdown(conn->fd, SHUT_RDWR);
+        if (!conn->tx_inflight)
+        {
+            ws_outq_clear(q);
+        }
+        break;
+    }
+
+    ws_stat_add(WS_STAT_SENDS_REFUSED, 1);
+    return -1;
+}
+
+// Counts a frame accepted for sending. Called with out_lock held.
+static void ws_conn_count_out(struct ws_conn *conn, const u_int8_t *frame, size_t header_len,
+                              const u_int8_t *payload, size_t frame_len, u_int64_t start)
+{
+    WS_COUNTER_ADD(conn->frames_out, 1);
+    WS_COUNTER_ADD(conn->bytes_out, frame_len);
+    ws_stat_add(WS_STAT_FRAMES_OUT, 1);
+    ws_stat_add(WS_STAT_BYTES_OUT, frame_len);
+
+    if ((frame[0] & 0x0F) == 0x8 && frame_len - header_len >= 2)
+    {
+        // a client's close frame is masked; the key ends the header
+        const u_int8_t *key = (frame[1] & 0x80) ? payload - 4 : (const u_int8_t *)"\0\0\0\0";
+        int code = (((payload[0] ^ key[0]) << 8) | (payload[1] ^ key[1])) - 1000;
+        if (code >= 0 && code < WS_STATS_CLOSE_CODES)
+        {
+            ws_stat_add(WS_STAT_CLOSE_CODES + code, 1);
+        }
+    }
+    // a frame that had to be queued is timed when the queue drains
+    if (start && conn->outq.head == NULL)
+    {
+        ws_stat_send_ns(ws_now_ns() - start);
+    }
+}
+
+// frame_len covers a payload sent from a region after the frame.
+static void ws_conn_count_frame(struct ws_conn *conn, const struct ws_frame *frame, size_t frame_len,
+                                u_int64_t start)
+{
+    u_int8_t len7 = frame->data[1] & 0x7F;
+    size_t header_len = len7 == 127 ? 10 : (len7 == 126 ? 4 : 2);
+    if (frame->data[1] & 0x80)
+    {
+        header_len += 4;
+    }
+    ws_conn_count_out(conn, frame->data, header_len, frame->data + header_len, frame_len, start);
+}
+
+// Hands entry to the reactor that owns conn, for a sender on any other thread.
+// No lock is taken unless conn is over its high-water mark. Consumes entry.
+// returns 0 on success, -1 if the entry is refused or conn is closed
+static int ws_conn_post_entry(struct ws_conn *conn, struct ws_outq_entry *entry)
+{
+    size_t len = ws_outq_entry_len(entry);
+    size_t backlog = ws_conn_backlog(conn);
+    if (backlog != 0 && backlog + len > g_opts.send_high_water)
+    {
+        pthread_mutex_lock(&conn->out_lock);
+        int res = ws_conn_admit(conn, len);
+        pthread_mutex_unlock(&conn->out_lock);
+        if (res == -1)
+        {
+            ws_outq_entry_free(entry);
+            return -1;
+        }
+    }
+    return ws_inbox_push(conn, entry);
+}
+
+// Posts frame (see ws_conn_post_entry). A non-zero opcode means frame holds
+// only the payload, to be compressed and framed in send order by the
+// reactor. Consumes the caller's reference to frame.
+static int ws_conn_post(struct ws_conn *conn, struct ws_frame *frame, u_int8_t opcode)
+{
+    struct ws_outq_entry *entry = malloc(sizeof(struct ws_outq_entry));
+    if (!entry)
+    {
+        ws_frame_unref(frame);
+        return -1;
+    }
+    entry->frame = frame;
+    entry->region = NULL;
+    entry->span = 0;
+    entry->offset = 0;
+    entry->queued_ns = ws_now_ns();
+    entry->opcode = opcode;
+    return ws_conn_post_entry(conn, entry);
+}
+
+// Moves what other threads sent conn into its send queue, each sender's frames
+// in the order it sent them, and writes the batch with as few syscalls as the
+// socket allows. Owning reactor only, with out_lock held.
+// returns 0 on success, -1 if the connection failed
+static int ws_conn_take_inbox(struct ws_conn *conn)
+{
+    struct ws_outq_entry *e = ws_inbox_take(conn);
+    if (!e)
+    {
+        return 0;
+    }
+
+    // a non-empty queue is waiting for the socket to drain already
+    int idle = conn->outq.head == NULL;
+    while (e)
+    {
+        struct ws_outq_entry *next = e->next;
+        atomic_fetch_sub_explicit(&conn->inbox_bytes, ws_outq_entry_len(e), memory_order_relaxed);
+
+        if (e->opcode)
+        {
+            // compressed here so that, with context takeover, messages are
+            // compressed in the order the peer will inflate them
+            struct ws_frame *payload = e->frame;
+            u_int8_t *compressed;
+            size_t compressed_len;
+            if (ws_deflate_compress(conn->deflate, payload->data, payload->len, &compressed, &compressed_len) == 0)
+            {
+                e->frame = ws_frame_new(e->opcode | WS_RSV1, compressed, compressed_len);
+                ws_buf_free(compressed);
+            }
+            else
+            {
+                e->frame = ws_frame_new(e->opcode, payload->data, payload->len);
+            }
+            ws_frame_unref(payload);
+        }
+
+        if (e->frame)
+        {
+            ws_conn_count_frame(conn, e->frame, ws_outq_entry_len(e), 0);
+            ws_outq_append(&conn->outq, e);
+        }
+        else
+        {
+            free(e);
+        }
+        e = next;
+    }
+
+    if (ws_conn_backlog(conn) > g_opts.send_high_water)
+    {
+        conn->backpressured = 1;
+    }
+    if (idle && ws_outq_flush(&conn->outq, conn) == -1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// Send one frame to conn, behind anything already queued for it. Only when the
+// queue is empty may the frame go straight to the socket; what it doesn't take
+// is queued, so the caller never waits on the peer. Senders on other threads
+// go through the owning reactor instead.
+int ws_conn_send(struct ws_conn *conn, u_int8_t opcode, const u_int8_t *payload,
+                 u_int64_t payload_len)
+{
+    int res;
+    u_int8_t *compressed = NULL;
+    size_t compressed_len;
+    u_int64_t start = ws_now_ns();
+
+    // a client masks every frame under its own key, so the payload is always
+    // copied; no extension is negotiated on the client side
+    if (conn->client)
+    {
+        struct ws_frame *frame = ws_frame_new_masked(opcode, payload, payload_len);
+        if (!frame)
+        {
+            return -1;
+        }
+        res = ws_conn_send_frame(conn, frame);
+        ws_frame_unref(frame);
+        return res;
+    }
+
+    if (conn->reactor != t_reactor)
+    {
+        struct ws_frame *frame;
+        u_int8_t raw = 0;
+        if (conn->deflate && (opcode == 0x1 || opcode == 0x2) && payload_len >= g_opts.deflate.min_size)
+        {
+            frame = ws_frame_alloc(payload_len);
+            if (frame)
+            {
+                memcpy(frame->data, payload, payload_len);
+            }
+            raw = opcode;
+        }
+        else
+        {
+            frame = ws_frame_new(opcode, payload, payload_len);
+        }
+        return frame ? ws_conn_post(conn, frame, raw) : -1;
+    }
+
+    pthread_mutex_lock(&conn->out_lock);
+
+    // compress under the send lock: with context takeover the peer inflates
+    // messages in the order they were compressed
+    if (!conn->closed && conn->deflate && (opcode == 0x1 || opcode == 0x2) &&
+        payload_len >= g_opts.deflate.min_size &&
+        ws_deflate_compress(conn->deflate, payload, payload_len, &compressed, &compressed_len) == 0)
+    {
+        payload = compressed;
+        payload_len = compressed_len;
+        opcode |= WS_RSV1;
+    }
+
+    u_int8_t header[WS_MAX_HEADER];
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = ws_encode_header(header, opcode, payload_len, NULL);
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = payload_len;
+
+    if (conn->closed || ws_conn_take_inbox(conn) == -1 ||
+        ((opcode & 0x0F) < 0x8 && ws_conn_admit(conn, iov[0].iov_len + payload_len) == -1))
+    {
+        res = -1;
+    }
+    else
+    {
+        res = ws_outq_write(&conn->outq, conn, iov, payload_len > 0 ? 2 : 1);
+        if (res == 0)
+        {
+            ws_conn_count_out(conn, header, iov[0].iov_len, payload, iov[0].iov_len + payload_len, start);
+        }
+        if (ws_conn_backlog(conn) > g_opts.send_high_water)
+        {
+            conn->backpressured = 1;
+        }
+    }
+    pthread_mutex_unlock(&conn->out_lock);
+    ws_buf_free(compressed);
+    return res;
+}
+
+// Send a pre-encoded frame without blocking. Whatever the socket doesn't take
+// right away is queued by reference and written when it drains.
+int ws_conn_send_frame(struct ws_conn *conn, struct ws_frame *frame)
+{
+    int res = 0;
+    u_int64_t start = ws_now_ns();
+
+    if (conn->reactor != t_reactor)
+    {
+        ws_frame_ref(frame);
+        return ws_conn_post(conn, frame, 0);
+    }
+
+    pthread_mutex_lock(&conn->out_lock);
+    if (conn->closed || ws_conn_take_inbox(conn) == -1 ||
+        ((frame->data[0] & 0x0F) < 0x8 && ws_conn_admit(conn, frame->len) == -1))
+    {
+        res = -1;
+    }
+    else if (conn->outq.head != NULL)
+    {
+        res = ws_outq_push(&conn->outq, frame, 0);
+    }
+    else
+    {
+        struct iovec iov;
+        iov.iov_base = frame->data;
+        iov.iov_len = frame->len;
+        ssize_t sent = ws_conn_writev(conn, &iov, 1);
+
+        if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            res = -1;
+        }
+        else if (sent < (ssize_t)frame->len)
+        {
+            res = ws_outq_push(&conn->outq, frame, sent > 0 ? sent : 0);
+        }
+    }
+    if (res == 0)
+    {
+        ws_conn_count_frame(conn, frame, frame->len, start);
+    }
+    if (ws_conn_backlog(conn) > g_opts.send_high_water)
+    {
+        conn->backpressured = 1;
+    }
+    pthread_mutex_unlock(&conn->out_lock);
+    return res;
+}
+
+// Sends span bytes of region from start as one binary frame. The payload is
+// queued by reference, so the bytes the socket doesn't take right away are
+// never copied; a client masks a copy of its own. Nothing is compressed.
+// returns 0 on success, -1 if the frame is refused or conn is closed
+static int ws_conn_send_region(struct ws_conn *conn, struct ws_region *region, u_int64_t start, size_t span)
+{
+    if (span == 0)
+    {
+        return ws_conn_send(conn, 0x2, NULL, 0);
+    }
+
+    if (conn->client)
+    {
+        const u_int8_t *payload = region->addr ? region->addr + start : NULL;
+        u_int8_t *copy = NULL;
+        if (!payload)
+        {
+            copy = malloc(span);
+            if (!copy || ws_region_read(region, start, copy, span) == -1)
+            {
+                free(copy);
+                return -1;
+            }
+            payload = copy;
+        }
+        struct ws_frame *frame = ws_frame_new_masked(0x2, payload, span);
+        free(copy);
+        if (!frame)
+        {
+            return -1;
+        }
+        int res = ws_conn_send_frame(conn, frame);
+        ws_frame_unref(frame);
+        return res;
+    }
+
+    struct ws_frame *header = ws_frame_header(0x2, span);
+    struct ws_outq_entry *entry = header ? malloc(sizeof(struct ws_outq_entry)) : NULL;
+    if (!entry)
+    {
+        if (header)
+        {
+            ws_frame_unref(header);
+        }
+        return -1;
+    }
+    ws_region_ref(region);
+    entry->frame = header;
+    entry->region = region;
+    entry->start = start;
+    entry->span = span;
+    entry->offset = 0;
+    entry->queued_ns = ws_now_ns();
+    entry->opcode = 0;
+
+    if (conn->reactor != t_reactor)
+    {
+        return ws_conn_post_entry(conn, entry);
+    }
+
+    int res = 0;
+    pthread_mutex_lock(&conn->out_lock);
+    if (conn->closed || ws_conn_take_inbox(conn) == -1 || ws_conn_admit(conn, ws_outq_entry_len(entry)) == -1)
+    {
+        ws_outq_entry_free(entry);
+        res = -1;
+    }
+    else
+    {
+        // queued first even when the socket is idle, and timed as it leaves
+        int idle = conn->outq.head == NULL;
+        ws_conn_count_frame(conn, header, ws_outq_entry_len(entry), 0);
+        ws_outq_append(&conn->outq, entry);
+        if (idle && ws_outq_flush(&conn->outq, conn) == -1)
+        {
+            res = -1;
+        }
+        if (ws_conn_backlog(conn) > g_opts.send_high_water)
+        {
+            conn->backpressured = 1;
+        }
+    }
+    pthread_mutex_unlock(&conn->out_lock);
+    return res;
+}
+
+// Called with out_lock held after the queue shrank; wakes blocked senders
+// once it is down to the low-water mark.
+// returns 1 if on_drain is due
+static int ws_conn_check_drain(struct ws_conn *conn)
+{
+    if (!conn->closed && conn->backpressured && ws_conn_backlog(conn) <= g_opts.send_low_water)
+    {
+        conn->backpressured = 0;
+        pthread_cond_broadcast(&conn->drained);
+        return 1;
+    }
+    return 0;
+}
+
+// Pushes out as much of conn's queue as the socket takes now, and releases
+// anyone waiting for the queue to come back under the low-water mark.
+// returns 0 on success, -1 if the connection must be closed
+static int ws_conn_flush(struct ws_conn *conn)
+{
+    int res = 0;
+    pthread_mutex_lock(&conn->out_lock);
+    if (!conn->closed && conn->outq.head != NULL)
+    {
+        res = ws_outq_flush(&conn->outq, conn) == -1 ? -1 : 0;
+    }
+    int drained = ws_conn_check_drain(conn);
+    pthread_mutex_unlock(&conn->out_lock);
+
+    if (drained && res == 0 && conn->callbacks->on_drain)
+    {
+        ws_callback(conn, WS_TASK_DRAIN, 0);
+    }
+    return res;
+}
+
+// The send buffer drained.
+// returns 0 on success, -1 if the connection must be closed
+int ws_conn_on_writable(struct ws_conn *conn)
+{
+    // the TLS handshake may be waiting to write a flight
+    if (conn->state == WS_STATE_TLS)
+    {
+        return ws_conn_on_readable(conn);
+    }
+    return ws_conn_flush(conn);
+}
+
+// io_uring: a batched sendmsg of the head of conn's queue wrote res bytes.
+// returns -1 if the connection failed
+int ws_conn_on_sent(struct ws_conn *conn, int res)
+{
+    pthread_mutex_lock(&conn->out_lock);
+    conn->tx_inflight = 0;
+    ws_buf_free(conn->tx);
+    conn->tx = NULL;
+    if (res > 0)
+    {
+        ws_outq_consume(&conn->outq, res);
+    }
+    if (conn->closed)
+    {
+        ws_outq_clear(&conn->outq);
+        pthread_mutex_unlock(&conn->out_lock);
+        return 0;
+    }
+    if (res < 0 && res != -EAGAIN && res != -EINTR)
+    {
+        pthread_mutex_unlock(&conn->out_lock);
+        return -1;
+    }
+    if (conn->outq.head != NULL)
+    {
+        ws_uring_defer_send(conn);
+    }
+    int drained = ws_conn_check_drain(conn);
+    pthread_mutex_unlock(&conn->out_lock);
+
+    if (drained && conn->callbacks->on_drain)
+    {
+        ws_callback(conn, WS_TASK_DRAIN, 0);
+    }
+    return 0;
+}
+
+// Other threads sent conn output; the reactor was woken to write it.
+// returns -1 if the connection failed
+int ws_conn_on_inbox(struct ws_conn *conn)
+{
+    pthread_mutex_lock(&conn->out_lock);
+    int res = ws_conn_take_inbox(conn);
+    int drained = ws_conn_check_drain(conn);
+    pthread_mutex_unlock(&conn->out_lock);
+
+    if (drained && res == 0 && conn->callbacks->on_drain)
+    {
+        ws_callback(conn, WS_TASK_DRAIN, 0);
+    }
+
+    // the workers caught up with a connection whose reads were paused
+    if (res == 0 && conn->rx_stopped && !atomic_load(&conn->rx_paused))
+    {
+        conn->rx_stopped = 0;
+        if ((conn->uring ? ws_uring_resume(conn) : ws_conn_on_readable(conn)) == -1)
+        {
+            ws_conn_close(conn);
+        }
+    }
+    return res;
+}
+
+// Arms conn's timer for its next deadline once it is open: the pong timeout
+// while a ping is unanswered, otherwise the ping interval and idle timeout,
+// all counted from the last time the peer was heard from.
+static void ws_conn_schedule(struct ws_conn *conn)
+{
+    u_int64_t due = UINT64_MAX;
+    if (g_opts.idle_timeout_ms > 0)
+    {
+        due = conn->last_rx + ws_timer_ticks(g_opts.idle_timeout_ms);
+    }
+    if (conn->ping_sent && conn->ping_sent + ws_timer_ticks(g_opts.pong_timeout_ms) < due)
+    {
+        due = conn->ping_sent + ws_timer_ticks(g_opts.pong_timeout_ms);
+    }
+    else if (!conn->ping_sent && g_opts.ping_interval_ms > 0 &&
+             conn->last_rx + ws_timer_ticks(g_opts.ping_interval_ms) < due)
+    {
+        due = conn->last_rx + ws_timer_ticks(g_opts.ping_interval_ms);
+    }
+
+    if (due == UINT64_MAX)
+    {
+        ws_timer_cancel(&conn->reactor->timers, &conn->timer);
+    }
+    else
+    {
+        ws_timer_schedule(&conn->reactor->timers, &conn->timer, due);
+    }
+}
+
+// The upgrade is done, on either side; frames may flow from here on.
+void ws_conn_open(struct ws_conn *conn)
+{
+    conn->state = WS_STATE_OPEN;
+    ws_buf_free(conn->hs);
+    conn->hs = NULL;
+    ws_stat_add(WS_STAT_OPENED, 1);
+    ws_conn_schedule(conn);
+    ws_callback(conn, WS_TASK_OPEN, 0);
+}
+
+// Pulls bytes off the socket with as few syscalls as possible: one read fills
+// the whole free ring, and a large payload with nothing buffered ahead of it is
+// read straight into its destination instead of bouncing through the ring.
+// returns 1 if more may be waiting, 0 once the socket is drained, -1 on EOF/error
+static int ws_conn_fill(struct ws_conn *conn)
+{
+    struct ws_ring *ring = &conn->rbuf;
+    ssize_t n;
+    size_t asked;
+
+    if (conn->state == WS_STATE_OPEN && conn->read_state == WS_READ_PAYLOAD && conn->payload != NULL &&
+        ws_ring_len(ring) == 0 && conn->payload_len - conn->payload_have >= ring->cap)
+    {
+        asked = conn->payload_len - conn->payload_have;
+        struct iovec iov;
+        iov.iov_base = conn->payload + conn->payload_have;
+        iov.iov_len = asked;
+        n = ws_conn_readv(conn, &iov, 1);
+        if (n > 0)
+        {
+            if (ws_take_payload(conn, conn->payload + conn->payload_have, n) == -1)
+            {
+                return -1;
+            }
+            conn->payload_have += n;
+        }
+    }
+    else
+    {
+        asked = ws_ring_space(ring);
+        if (asked == 0)
+        {
+            return 1;
+        }
+        struct iovec iov[2];
+        n = ws_conn_readv(conn, iov, ws_ring_free_iov(ring, iov));
+        if (n > 0)
+        {
+            ws_ring_commit(ring, n);
+        }
+    }
+
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        return 0;
+    }
+    if (n <= 0)
+    {
+        return -1;
+    }
+    WS_COUNTER_ADD(conn->bytes_in, n);
+    ws_stat_add(WS_STAT_BYTES_IN, n);
+    conn->last_rx = conn->reactor->timers.clock;
+    // a short read means the socket buffer is empty; the next arrival raises
+    // a fresh edge, so there is no need to spend a syscall on EAGAIN
+    return (size_t)n == asked ? 1 : 0;
+}
+
+// Reads whatever the socket holds and parses every complete frame in it, so
+// pipelined frames cost one read between them.
+// returns 0 once the socket is drained, -1 if the connection must be closed
+int ws_conn_on_readable(struct ws_conn *conn)
+{
+    if (conn->rbuf.data == NULL && ws_ring_init(&conn->rbuf, WS_READ_BUF_SIZE) == -1)
+    {
+        return -1;
+    }
+
+    if (conn->state == WS_STATE_TLS)
+    {
+        int res = ws_tls_handshake(conn);
+        if (res == -1)
+        {
+            ws_log_debug("fd %d: TLS handshake failed", conn->fd);
+            ws_stat_add(WS_STAT_HANDSHAKE_FAILURES, 1);
+            return -1;
+        }
+        if (res == 0)
+        {
+            return 0;
+        }
+    }
+
+    while (1)
+    {
+        // io_uring has already received the data and pauses its receive
+        if (atomic_load_explicit(&conn->rx_paused, memory_order_relaxed) && !conn->uring)
+        {
+            conn->rx_stopped = 1;
+            return 0;
+        }
+        int filled = ws_conn_fill(conn);
+
+        if (conn->state == WS_STATE_HANDSHAKE)
+        {
+            int res = ws_handshake(conn);
+            if (res == -1)
+            {
+                ws_log_debug("fd %d: bad upgrade request", conn->fd);
+                ws_stat_add(WS_STAT_HANDSHAKE_FAILURES, 1);
+                struct iovec iov;
+                iov.iov_base = "HTTP/1.1 400 Bad Request\r\n\r\n";
+                iov.iov_len = 28;
+                pthread_mutex_lock(&conn->out_lock);
+                ws_outq_write(&conn->outq, conn, &iov, 1);
+                pthread_mutex_unlock(&conn->out_lock);
+                return -1;
+            }
+            if (res == 1)
+            {
+                ws_conn_open(conn);
+            }
+        }
+
+        if (conn->state == WS_STATE_OPEN)
+        {
+            int res;
+            while ((res = read_frame(conn)) == 1)
+            {
+            }
+            if (res == -1)
+            {
+                return -1;
+            }
+        }
+
+        if (filled <= 0)
+        {
+            // an idle connection holds no read buffer; the next read
+            // borrows one from the pool again
+            if (ws_ring_len(&conn->rbuf) == 0)
+            {
+                ws_ring_free(&conn->rbuf);
+            }
+            return filled;
+        }
+    }
+}
+
+void ws_conn_close(struct ws_conn *conn)
+{
+    ws_timer_cancel(&conn->reactor->timers, &conn->timer);
+
+    if (conn->state == WS_STATE_OPEN)
+    {
+        ws_stat_add(WS_STAT_CLOSED, 1);
+        ws_callback(conn, WS_TASK_CLOSE, 0);
+    }
+
+    ws_table_remove(conn);
+
+    pthread_mutex_lock(&conn->out_lock);
+    conn->closed = 1;
+    ws_inbox_close(conn);
+    ws_pubsub_drop(conn);
+    if (conn->corked)
+    {
+        // what a cork held back, such as a close frame, still goes out
+        conn->corked = 0;
+        if (!conn->uring && conn->outq.head != NULL)
+        {
+            ws_outq_flush(&conn->outq, conn);
+        }
+    }
+    ws_tls_shutdown(conn);
+    if (conn->uring)
+    {
+        // deferred output, such as a close frame, is written before the
+        // socket goes unless the kernel is still busy with an earlier send
+        if (!conn->tx_inflight && conn->outq.head != NULL)
+        {
+            ws_outq_flush(&conn->outq, conn);
+        }
+        ws_uring_close(conn);
+    }
+    else
+    {
+        close(conn->fd);
+    }
+    // an in-flight send still points into the queue; its completion clears it
+    if (!conn->tx_inflight)
+    {
+        ws_outq_clear(&conn->outq);
+    }
+    pthread_cond_broadcast(&conn->drained);
+    pthread_mutex_unlock(&conn->out_lock);
+
+    ws_conn_put(conn);
+}
+
+void ws_conn_release_corks(struct ws_conn *conn, int n)
+{
+    int corks = atomic_load(&conn->inbox_corks);
+    do
+    {
+        if (n > corks)
+        {
+            n = corks;
+        }
+        if (n == 0)
+        {
+            return;
+        }
+    } while (!atomic_compare_exchange_weak(&conn->inbox_corks, &corks, corks - n));
+
+    // pushes made while the inbox was corked didn't wake the reactor; pairs
+    // with ws_inbox_push checking the corks after its push
+    struct ws_outq_entry *head = atomic_load(&conn->inbox);
+    if (corks == n && head != NULL && head != WS_INBOX_CLOSED)
+    {
+        ws_inbox_kick(conn);
+    }
+}
+
+// Called once every event-loop iteration: corks last no longer than that, so
+// whatever the connections corked since held back goes out now.
+void ws_reactor_uncork(struct ws_reactor *reactor)
+{
+    // a drain callback may cork again, and has to be flushed too
+    while (reactor->corked)
+    {
+        struct ws_conn *conn = reactor->corked;
+        reactor->corked = NULL;
+        while (conn)
+        {
+            struct ws_conn *next = conn->cork_next;
+            conn->cork_listed = 0;
+            conn->corked = 0;
+            // also runs on_drain for a connection uncorked earlier
+            if (!conn->closed && ws_conn_flush(conn) == -1)
+            {
+                ws_conn_error(conn, 1006);
+                ws_conn_close(conn);
+            }
+            ws_conn_put(conn);
+            conn = next;
+        }
+    }
+}
+
+// conn's timer went off; the deadline it was set for may have moved since, in
+// which case it is armed again for the new one.
+void ws_conn_on_timer(struct ws_timer *timer)
+{
+    struct ws_conn *conn = (struct ws_conn *)((char *)timer - offsetof(struct ws_conn, timer));
+    u_int64_t now = conn->reactor->timers.clock;
+
+    if (conn->state != WS_STATE_OPEN)
+    {
+        ws_log_debug("fd %d: handshake timed out", conn->fd);
+        ws_stat_add(WS_STAT_HANDSHAKE_FAILURES, 1);
+        ws_conn_close(conn);
+        return;
+    }
+
+    // a connection that isn't read from while the workers catch up can't be
+    // heard from either
+    if (atomic_load_explicit(&conn->rx_paused, memory_order_relaxed))
+    {
+        conn->last_rx = now;
+    }
+    // anything read after the ping is as good as a pong
+    if (conn->ping_sent && conn->last_rx > conn->ping_sent)
+    {
+        conn->ping_sent = 0;
+    }
+    if (conn->ping_sent && now >= conn->ping_sent + ws_timer_ticks(g_opts.pong_timeout_ms))
+    {
+        ws_log_debug("fd %d: ping unanswered", conn->fd);
+        ws_conn_error(conn, 1006);
+        ws_conn_close(conn);
+        return;
+    }
+    if (g_opts.idle_timeout_ms > 0 && now >= conn->last_rx + ws_timer_ticks(g_opts.idle_timeout_ms))
+    {
+        ws_log_debug("fd %d: idle timeout", conn->fd);
+        ws_conn_fail(conn, going_away);
+        ws_conn_close(conn);
+        return;
+    }
+    if (!conn->ping_sent && g_opts.ping_interval_ms > 0 &&
+        now >= conn->last_rx + ws_timer_ticks(g_opts.ping_interval_ms))
+    {
+        conn->ping_sent = now;
+        ws_conn_send(conn, 0x9, (const u_int8_t *)"", 0);
+    }
+    ws_conn_schedule(conn);
+}
+
+// Counts a failed connection and reports it to the application, before the
+// caller closes it. code is the close code sent, or 1006 if the link was lost.
+void ws_conn_error(struct ws_conn *conn, int code)
+{
+    ws_stat_add(WS_STAT_ERRORS, 1);
+    ws_log_debug("fd %d: failed with %d", conn->fd, code);
+    if (conn->state == WS_STATE_OPEN && conn->callbacks->on_error)
+    {
+        ws_callback(conn, WS_TASK_ERROR, code);
+    }
+}
+
+int ws_conn_stats(ws_conn_t handle, ws_conn_stats_t *stats)
+{
+    struct ws_conn *conn = ws_conn_lookup(handle);
+    if (!conn)
+    {
+        return -1;
+    }
+    stats->frames_in = atomic_load_explicit(&conn->frames_in, memory_order_relaxed);
+    stats->bytes_in = atomic_load_explicit(&conn->bytes_in, memory_order_relaxed);
+    pthread_mutex_lock(&conn->out_lock);
+    stats->frames_out = atomic_load_explicit(&conn->frames_out, memory_order_relaxed);
+    stats->bytes_out = atomic_load_explicit(&conn->bytes_out, memory_order_relaxed);
+    stats->queued_bytes = conn->outq.bytes;
+    pthread_mutex_unlock(&conn->out_lock);
+    ws_conn_put(conn);
+    return 0;
+}
+
+void ws_init(ws_callbacks_t *callbacks) { g_callbacks = callbacks; }
+
+int ws_set_user_data(ws_conn_t handle, void *data)
+{
+    struct ws_conn *conn = ws_conn_lookup(handle);
+    if (!conn)
+    {
+        return -1;
+    }
+    conn->user_data = data;
+    ws_conn_put(conn);
+    return 0;
+}
+
+void *ws_get_user_data(ws_conn_t handle)
+{
+    struct ws_conn *conn = ws_conn_lookup(handle);
+    if (!conn)
+    {
+        return NULL;
+    }
+    void *data = conn->user_data;
+    ws_conn_put(conn);
+    return data;
+}
+
+int ws_cork(ws_conn_t handle)
+{
+    struct ws_conn *conn = ws_conn_lookup(handle);
+    if (!conn)
+    {
+        return -1;
+    }
+    if (conn->reactor == t_reactor)
+    {
+        conn->corked++;
+        if (!conn->cork_listed)
+        {
+            // listed with a reference until the iteration ends
+            atomic_fetch_add_explicit(&conn->refs, 1, memory_order_relaxed);
+            conn->cork_listed = 1;
+            conn->cork_next = t_reactor->corked;
+            t_reactor->corked = conn;
+        }
+    }
+    else
+    {
+        atomic_fetch_add(&conn->inbox_corks, 1);
+        ws_worker_count_cork(conn, 1);
+    }
+    ws_conn_put(conn);
+    return 0;
+}
+
+int ws_uncork(ws_conn_t handle)
+{
+    struct ws_conn *conn = ws_conn_lookup(handle);
+    if (!conn)
+    {
+        return -1;
+    }
+    if (conn->reactor == t_reactor)
+    {
+        // the end of an iteration may have released the cork already; the
+        // drain check waits for the end of this one, rather than calling
+        // on_drain from inside the caller's callback
+        if (conn->corked > 0 && --conn->corked == 0)
+        {
+            pthread_mutex_lock(&conn->out_lock);
+            if (!conn->closed && conn->outq.head != NULL && ws_outq_flush(&conn->outq, conn) == -1)
+            {
+                // the reactor sees the hangup and closes the connection
+                shutdown(conn->fd, SHUT_RDWR);
+            }
+            pthread_mutex_unlock(&conn->out_lock);
+        }
+    }
+    else
+    {
+        ws_worker_count_cork(conn, -1);
+        ws_conn_release_corks(conn, 1);
+    }
+    ws_conn_put(conn);
+    return 0;
+}
+
+static int ws_send_handle(ws_conn_t handle, u_int8_t opcode, const u_int8_t *payload, size_t length)
+{
+    struct ws_conn *conn = ws_conn_lookup(handle);
+    if (!conn)
     {
-        perror("listen");
         return -1;
     }
+    if (conn->state != WS_STATE_OPEN)
+    {
+        ws_conn_put(conn);
+        return -1;
+    }
+    int res = ws_conn_send(conn, opcode, payload, length);
+    ws_conn_put(conn);
+    return res;
+}
 
-    printf("Listening on port %s\n", PORT);
+int ws_close(ws_conn_t conn, u_int16_t code)
+{
+    u_int8_t payload[2] = {code >> 8, code & 0xFF};
+    return ws_send_handle(conn, 0x8, payload, sizeof(payload));
+}
 
-    while (1)
+// Wrapper function for sending text messages
+int ws_send_txt(ws_conn_t conn, const char *message, size_t length)
+{
+    return ws_send_handle(conn, 0x1, (const u_int8_t *)message, length);
+}
+
+// Wrapper function for sending binary payloads
+int ws_send_bin(ws_conn_t conn, const u_int8_t *payload, size_t length)
+{
+    return ws_send_handle(conn, 0x2, payload, length);
+}
+
+int ws_send_region(ws_conn_t handle, ws_region_t *region, size_t offset, size_t length)
+{
+    if (!region || offset > region->len || length > region->len - offset)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (length == 0)
+    {
+        length = region->len - offset;
+    }
+
+    struct ws_conn *conn = ws_conn_lookup(handle);
+    if (!conn)
+    {
+        return -1;
+    }
+    int res = conn->state == WS_STATE_OPEN ? ws_conn_send_region(conn, region, offset, length) : -1;
+    ws_conn_put(conn);
+    return res;
+}
+
+int ws_send_file(ws_conn_t handle, int fd, off_t offset, size_t length)
+{
+    if (ws_file_range(fd, offset, &length) == -1)
+    {
+        return -1;
+    }
+
+    struct ws_conn *conn = ws_conn_lookup(handle);
+    if (!conn)
+    {
+        return -1;
+    }
+    int res = -1;
+    if (conn->state == WS_STATE_OPEN)
+    {
+        struct ws_region *region = ws_region_file(fd);
+        if (region)
+        {
+            res = ws_conn_send_region(conn, region, offset, length);
+            ws_region_release(region);
+        }
+    }
+    ws_conn_put(conn);
+    return res;
+}
+
+// Encode the frame once and hand the same buffer to every recipient. Sockets
+// that can't take it immediately keep a reference in their send queue.
+// Recipients that negotiated deflate without server context takeover share
+// one compressed frame per window size; with context takeover the message has
+// to be compressed against that connection's own stream, and a client
+// connection masks its own copy.
+// returns the number of connections the frame was sent or queued to
+int ws_broadcast(const ws_conn_t *conns, size_t n, u_int8_t opcode, const u_int8_t *payload, size_t length)
+{
+    struct ws_conn_run run = {conns, n};
+    return ws_broadcast_runs(&run, 1, 0, opcode, payload, length);
+}
+
+// The same over several runs of handles at once, so a frame is encoded and
+// compressed once however the recipients are stored.
+int ws_broadcast_runs(const struct ws_conn_run *runs, size_t nruns, ws_conn_t except, u_int8_t opcode,
+                      const u_int8_t *payload, size_t length)
+{
+    struct ws_frame *frame = ws_frame_new(opcode, payload, length);
+    if (!frame)
+    {
+        return -1;
+    }
+    struct ws_frame *compressed[16] = {NULL};
+
+    int delivered = 0;
+    for (size_t r = 0; r < nruns; r++)
+    {
+        const ws_conn_t *conns = runs[r].conns;
+        for (size_t i = 0; i < runs[r].len; i++)
+        {
+            if (conns[i] == except)
+            {
+                continue;
+            }
+            struct ws_conn *conn = ws_conn_lookup(conns[i]);
+            if (!conn)
+            {
+                continue;
+            }
+            if (conn->state != WS_STATE_OPEN)
+            {
+                ws_conn_put(conn);
+                continue;
+            }
+
+            struct ws_deflate *d = conn->deflate;
+            struct ws_frame *shared = frame;
+            int res;
+
+            if (conn->client || (d && length >= g_opts.deflate.min_size && !d->server_no_context_takeover))
+            {
+                res = ws_conn_send(conn, opcode, payload, length);
+            }
+            else
+            {
+                if (d && length >= g_opts.deflate.min_size)
+                {
+                    int bits = d->server_max_window_bits;
+                    u_int8_t *out;
+                    size_t out_len;
+                    if (!compressed[bits] && ws_deflate_compress(d, payload, length, &out, &out_len) == 0)
+                    {
+                        compressed[bits] = ws_frame_new(opcode | WS_RSV1, out, out_len);
+                        ws_buf_free(out);
+                    }
+                    if (compressed[bits])
+                    {
+                        shared = compressed[bits];
+                    }
+                }
+                res = ws_conn_send_frame(conn, shared);
+            }
+
+            if (res == 0)
+            {
+                delivered++;
+            }
+            ws_conn_put(conn);
+        }
+    }
+
+    for (int i = 0; i < 16; i++)
+    {
+        if (compressed[i])
+        {
+            ws_frame_unref(compressed[i]);
+        }
+    }
+    ws_frame_unref(frame);
+    return delivered;
+}
+
+// Bind one listening socket on PORT. SO_REUSEPORT lets every reactor bind its
+// own socket to the same port and have the kernel spread accepts across them.
+static int ws_bind_listener(const char *PORT, int backlog)
+{
+    struct addrinfo hints, *res, *p;
+    int sockfd, yes = 1;
+
+    memset(&hints, 0, sizeof(hints));
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if (getaddrinfo(NULL, PORT, &hints, &res) != 0)
+    {
+        ws_log_perror("getaddrinfo");
+        return -1;
+    }
+    for (p = res; p != NULL; p = p->ai_next)
     {
-        if ((clientfd =
-                 accept(sockfd, (struct sockaddr *)&their_addr, &sin_size)) == -1)
+        if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
         {
-            perror("accept");
             continue;
         }
 
-        int *client_sock = malloc(sizeof(int));
-        *client_sock = clientfd;
-        g_callbacks->on_open(clientfd);
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1 ||
+            setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1)
+        {
+            close(sockfd);
+            continue;
+        }
 
-        pthread_t thread_id;
-        if (pthread_create(&thread_id, NULL, handle_client, (void *)client_sock) !=
-            0)
+        if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1)
         {
-            perror("pthread_create");
-            close(clientfd);
-            free(client_sock);
+            close(sockfd);
             continue;
         }
-        pthread_detach(thread_id);
+
+        break;
     }
 
-    return 0;
+    freeaddrinfo(res);
+
+    if (p == NULL)
+    {
+        ws_log_perror("socket");
+        return -1;
+    }
+
+    if (listen(sockfd, backlog) == -1)
+    {
+        ws_log_perror("listen");
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+static void *ws_reactor_thread(void *arg)
+{
+    struct ws_reactor *reactor = arg;
+    t_reactor = reactor;
+    ws_reactor_run(reactor);
+    return NULL;
+}
+
+// Fills in whatever options were left at zero.
+static void ws_opts_defaults(void)
+{
+    if (g_opts.max_message_size == 0)
+    {
+        g_opts.max_message_size = WS_DEFAULT_MAX_MESSAGE;
+    }
+    if (g_opts.send_high_water == 0)
+    {
+        g_opts.send_high_water = WS_DEFAULT_SEND_HIGH_WATER;
+    }
+    if (g_opts.send_low_water == 0 || g_opts.send_low_water > g_opts.send_high_water)
+    {
+        g_opts.send_low_water = g_opts.send_high_water / 4;
+    }
+    if (g_opts.worker_high_water == 0)
+    {
+        g_opts.worker_high_water = WS_DEFAULT_WORKER_HIGH_WATER;
+    }
+    if (g_opts.worker_low_water == 0 || g_opts.worker_low_water > g_opts.worker_high_water)
+    {
+        g_opts.worker_low_water = g_opts.worker_high_water / 4;
+    }
+    if (g_opts.pong_timeout_ms <= 0)
+    {
+        g_opts.pong_timeout_ms = g_opts.ping_interval_ms;
+    }
+    if (g_opts.handshake_timeout_ms == 0)
+    {
+        g_opts.handshake_timeout_ms = WS_DEFAULT_HANDSHAKE_TIMEOUT;
+    }
+}
+
+static int ws_window_bits_valid(int bits) { return bits == 0 || (bits >= 9 && bits <= 15); }
+
+// One epoll reactor, without a listener, serves every client connection. It
+// is started by the first ws_connect and runs for the life of the process.
+static struct ws_reactor g_client_reactor;
+static pthread_once_t g_client_once = PTHREAD_ONCE_INIT;
+static int g_client_started;
+
+static void ws_client_reactor_start(void)
+{
+    if (ws_conn_table_init() == -1)
+    {
+        return;
+    }
+    // a server sets these before it ever connects anywhere
+    pthread_mutex_lock(&g_opts_lock);
+    ws_opts_defaults();
+    pthread_mutex_unlock(&g_opts_lock);
+
+    struct ws_reactor *reactor = &g_client_reactor;
+    reactor->id = -1;
+    reactor->listen_fd = -1;
+    reactor->backend = WS_BACKEND_EPOLL;
+    reactor->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reactor->wake_fd == -1)
+    {
+        ws_log_perror("eventfd");
+        return;
+    }
+    if (pthread_create(&reactor->thread, NULL, ws_reactor_thread, reactor) != 0)
+    {
+        ws_log_perror("pthread_create");
+        close(reactor->wake_fd);
+        return;
+    }
+    pthread_detach(reactor->thread);
+    g_client_started = 1;
+}
+
+// returns the client reactor, starting it if need be, or NULL if it failed to
+struct ws_reactor *ws_client_reactor(void)
+{
+    pthread_once(&g_client_once, ws_client_reactor_start);
+    return g_client_started ? &g_client_reactor : NULL;
+}
+
+// returns how long ws_connect may take, in ms, or -1 for no limit
+int ws_client_timeout_ms(void) { return g_opts.handshake_timeout_ms; }
+
+int ws_on_reactor_thread(void) { return t_reactor != NULL; }
+
+// Setup TCP server and listen for incoming connections
+int ws_listen(const char *PORT) { return ws_listen_opts(PORT, NULL); }
+
+// Start opts->threads reactors, each owning a SO_REUSEPORT listener and the
+// connections accepted on it. Nothing is shared between reactors, so accept
+// and I/O scale with the number of cores. Blocks until every reactor exits.
+int ws_listen_opts(const char *PORT, const ws_listen_opts_t *opts)
+{
+    if (g_callbacks == NULL)
+    {
+        ws_log_error("ws_init must be called before ws_listen");
+        return -1;
+    }
+
+    if (ws_conn_table_init() == -1)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&g_opts_lock);
+    if (opts)
+    {
+        g_opts = *opts;
+    }
+    ws_opts_defaults();
+    pthread_mutex_unlock(&g_opts_lock);
+    // the window size indexes per-size tables of deflate streams and frames
+    if (!ws_window_bits_valid(g_opts.deflate.server_max_window_bits) ||
+        !ws_window_bits_valid(g_opts.deflate.client_max_window_bits))
+    {
+        ws_log_error("deflate window bits must be 9..15");
+        return -1;
+    }
+    if (ws_tls_init(&g_opts.tls) == -1)
+    {
+        return -1;
+    }
+    if (g_opts.workers > 0 && ws_workers_start(g_opts.workers, g_opts.worker_low_water) == -1)
+    {
+        return -1;
+    }
+    if (g_opts.backend == WS_BACKEND_URING && ws_tls_enabled())
+    {
+        ws_log_info("TLS is served from the epoll backend");
+        g_opts.backend = WS_BACKEND_EPOLL;
+    }
+    else if (g_opts.backend == WS_BACKEND_URING && ws_uring_probe() == -1)
+    {
+        ws_log_warn("io_uring is unavailable, using epoll");
+        g_opts.backend = WS_BACKEND_EPOLL;
+    }
+
+    int threads = (opts && opts->threads > 0) ? opts->threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int backlog = (opts && opts->backlog > 0) ? opts->backlog : SOMAXCONN;
+    if (threads < 1)
+    {
+        threads = 1;
+    }
+
+    struct ws_reactor *reactors = calloc(threads, sizeof(struct ws_reactor));
+    if (!reactors)
+    {
+        return -1;
+    }
+
+    // bind every listener up front so a bad port fails here, not in a thread
+    int bound = 0;
+    for (; bound < threads; bound++)
+    {
+        reactors[bound].id = bound;
+        reactors[bound].backend = g_opts.backend;
+        reactors[bound].wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (reactors[bound].wake_fd == -1)
+        {
+            ws_log_perror("eventfd");
+            break;
+        }
+        reactors[bound].listen_fd = ws_bind_listener(PORT, backlog);
+        if (reactors[bound].listen_fd == -1)
+        {
+            close(reactors[bound].wake_fd);
+            break;
+        }
+    }
+
+    if (bound < threads)
+    {
+        for (int i = 0; i < bound; i++)
+        {
+            close(reactors[i].listen_fd);
+            close(reactors[i].wake_fd);
+        }
+        free(reactors);
+        return -1;
+    }
+
+    ws_log_info("listening on port %s (%d reactor threads, %s)", PORT, threads,
+                g_opts.backend == WS_BACKEND_URING ? "io_uring" : "epoll");
+
+    int started = 0;
+    for (; started < threads; started++)
+    {
+        if (pthread_create(&reactors[started].thread, NULL, ws_reactor_thread, &reactors[started]) != 0)
+        {
+            ws_log_perror("pthread_create");
+            break;
+        }
+    }
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(reactors[i].thread, NULL);
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        close(reactors[i].listen_fd);
+        close(reactors[i].wake_fd);
+    }
+    free(reactors);
+    return -1;
 }
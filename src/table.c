@@ -0,0 +1,138 @@
+#include "../include/table.h"
+#include "../include/log.h"
+#include "../include/reactor.h"
+
+#define WS_TABLE_NONE UINT32_MAX
+
+static _Atomic(struct ws_conn *) *g_slabs;
+static size_t g_slots;
+static atomic_uint g_used; // slots handed out at least once, all initialised
+static u_int32_t g_free = WS_TABLE_NONE; // most recently freed first, still warm in cache
+static pthread_mutex_t g_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int ws_table_init(size_t slots)
+{
+    if (g_slabs)
+    {
+        return 0;
+    }
+    if (slots >= WS_TABLE_NONE)
+    {
+        slots = WS_TABLE_NONE - 1;
+    }
+
+    g_slabs = calloc((slots + WS_TABLE_SLAB - 1) >> WS_TABLE_SLAB_SHIFT, sizeof(*g_slabs));
+    if (!g_slabs)
+    {
+        ws_log_perror("calloc");
+        return -1;
+    }
+    g_slots = slots;
+    return 0;
+}
+
+static struct ws_conn *ws_table_slot(u_int32_t slot)
+{
+    struct ws_conn *slab = atomic_load_explicit(&g_slabs[slot >> WS_TABLE_SLAB_SHIFT], memory_order_acquire);
+    return &slab[slot & (WS_TABLE_SLAB - 1)];
+}
+
+struct ws_conn *ws_table_alloc(void)
+{
+    pthread_mutex_lock(&g_table_lock);
+    u_int32_t slot = g_free;
+    u_int32_t gen = 0;
+    struct ws_conn *conn;
+
+    if (slot != WS_TABLE_NONE)
+    {
+        conn = ws_table_slot(slot);
+        g_free = conn->free_next;
+        gen = conn->gen;
+    }
+    else
+    {
+        slot = atomic_load_explicit(&g_used, memory_order_relaxed);
+        if (slot >= g_slots)
+        {
+            pthread_mutex_unlock(&g_table_lock);
+            ws_log_error("connection table full (%zu)", g_slots);
+            return NULL;
+        }
+        size_t i = slot >> WS_TABLE_SLAB_SHIFT;
+        if (atomic_load_explicit(&g_slabs[i], memory_order_relaxed) == NULL)
+        {
+            // only the pages of slots actually used become resident
+            struct ws_conn *slab = aligned_alloc(WS_CACHE_LINE, WS_TABLE_SLAB * sizeof(struct ws_conn));
+            if (!slab)
+            {
+                pthread_mutex_unlock(&g_table_lock);
+                ws_log_perror("aligned_alloc");
+                return NULL;
+            }
+            atomic_store_explicit(&g_slabs[i], slab, memory_order_release);
+        }
+        conn = ws_table_slot(slot);
+    }
+
+    // a stale handle may be looked up meanwhile; the slot has no references,
+    // so the lookup leaves it alone
+    memset(conn, 0, sizeof(struct ws_conn));
+    conn->slot = slot;
+    conn->gen = gen + 1 != 0 ? gen + 1 : 1;
+
+    if (slot == atomic_load_explicit(&g_used, memory_order_relaxed))
+    {
+        atomic_store_explicit(&g_used, slot + 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&g_table_lock);
+    return conn;
+}
+
+void ws_table_publish(struct ws_conn *conn)
+{
+    atomic_store_explicit(&conn->published, 1, memory_order_release);
+}
+
+void ws_table_remove(struct ws_conn *conn)
+{
+    atomic_store_explicit(&conn->published, 0, memory_order_release);
+}
+
+void ws_table_free(struct ws_conn *conn)
+{
+    pthread_mutex_lock(&g_table_lock);
+    conn->free_next = g_free;
+    g_free = conn->slot;
+    pthread_mutex_unlock(&g_table_lock);
+}
+
+struct ws_conn *ws_table_get(ws_conn_t handle)
+{
+    u_int32_t slot = (u_int32_t)handle;
+    u_int32_t gen = (u_int32_t)(handle >> 32);
+    if (slot >= atomic_load_explicit(&g_used, memory_order_acquire))
+    {
+        return NULL;
+    }
+
+    // no lock: a reference is only taken while another is held, so a free
+    // slot stays free; once ours pins the slot its generation can't change
+    struct ws_conn *conn = ws_table_slot(slot);
+    int refs = atomic_load_explicit(&conn->refs, memory_order_relaxed);
+    do
+    {
+        if (refs == 0)
+        {
+            return NULL;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&conn->refs, &refs, refs + 1, memory_order_acquire,
+                                                    memory_order_relaxed));
+
+    if (!atomic_load_explicit(&conn->published, memory_order_acquire) || conn->gen != gen)
+    {
+        ws_conn_put(conn);
+        return NULL;
+    }
+    return conn;
+}
@@ -0,0 +1,160 @@
+#include "../include/timer.h"
+#include <string.h>
+#include <time.h>
+
+static u_int64_t ws_timer_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u_int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void ws_timer_wheel_init(struct ws_timer_wheel *wheel)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->origin_ms = ws_timer_now_ms();
+}
+
+// Files timer by how far ahead of wheel->now it expires: level 0 if within 64
+// ticks, level 1 if within 64^2, and so on.
+static void ws_timer_link(struct ws_timer_wheel *wheel, struct ws_timer *timer)
+{
+    u_int64_t expires = timer->expires;
+    u_int64_t delta = expires > wheel->now ? expires - wheel->now : 0;
+    if (delta >= 1ull << (WS_TIMER_LEVELS * WS_TIMER_BITS))
+    {
+        // parked in the furthest slot and spilled again from there
+        delta = (1ull << (WS_TIMER_LEVELS * WS_TIMER_BITS)) - 1;
+        expires = wheel->now + delta;
+    }
+
+    int level = 0;
+    while (delta >= 1ull << ((level + 1) * WS_TIMER_BITS))
+    {
+        level++;
+    }
+    int index = (expires >> (level * WS_TIMER_BITS)) & (WS_TIMER_SLOTS - 1);
+
+    struct ws_timer **head = &wheel->slots[level * WS_TIMER_SLOTS + index];
+    timer->slot = level * WS_TIMER_SLOTS + index;
+    timer->next = *head;
+    if (*head)
+    {
+        (*head)->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+    wheel->occupied[level] |= 1ull << index;
+}
+
+static void ws_timer_unlink(struct ws_timer_wheel *wheel, struct ws_timer *timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next)
+    {
+        timer->next->pprev = timer->pprev;
+    }
+    if (wheel->slots[timer->slot] == NULL)
+    {
+        wheel->occupied[timer->slot / WS_TIMER_SLOTS] &= ~(1ull << (timer->slot % WS_TIMER_SLOTS));
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+void ws_timer_schedule(struct ws_timer_wheel *wheel, struct ws_timer *timer, u_int64_t expires)
+{
+    if (timer->pprev)
+    {
+        ws_timer_unlink(wheel, timer);
+    }
+    else
+    {
+        wheel->count++;
+    }
+    timer->expires = expires > wheel->now ? expires : wheel->now + 1;
+    ws_timer_link(wheel, timer);
+}
+
+void ws_timer_cancel(struct ws_timer_wheel *wheel, struct ws_timer *timer)
+{
+    if (timer->pprev)
+    {
+        ws_timer_unlink(wheel, timer);
+        wheel->count--;
+    }
+}
+
+void ws_timer_wheel_update(struct ws_timer_wheel *wheel)
+{
+    wheel->clock = (ws_timer_now_ms() - wheel->origin_ms) / WS_TIMER_TICK_MS;
+    if (wheel->count == 0)
+    {
+        // nothing to catch up on
+        wheel->now = wheel->clock;
+    }
+}
+
+// Re-files the timers of one slot above level 0, whose span the wheel has
+// just entered.
+static void ws_timer_cascade(struct ws_timer_wheel *wheel, int level)
+{
+    int index = (wheel->now >> (level * WS_TIMER_BITS)) & (WS_TIMER_SLOTS - 1);
+    struct ws_timer *timer = wheel->slots[level * WS_TIMER_SLOTS + index];
+    wheel->slots[level * WS_TIMER_SLOTS + index] = NULL;
+    wheel->occupied[level] &= ~(1ull << index);
+    while (timer)
+    {
+        struct ws_timer *next = timer->next;
+        ws_timer_link(wheel, timer);
+        timer = next;
+    }
+}
+
+void ws_timer_wheel_expire(struct ws_timer_wheel *wheel, void (*fire)(struct ws_timer *timer))
+{
+    while (wheel->now < wheel->clock && wheel->count > 0)
+    {
+        wheel->now++;
+        for (int level = 1; level < WS_TIMER_LEVELS; level++)
+        {
+            if (wheel->now & ((1ull << (level * WS_TIMER_BITS)) - 1))
+            {
+                break;
+            }
+            ws_timer_cascade(wheel, level);
+        }
+
+        // taken one at a time, since fire may cancel others in the slot
+        struct ws_timer **head = &wheel->slots[wheel->now & (WS_TIMER_SLOTS - 1)];
+        while (*head)
+        {
+            struct ws_timer *timer = *head;
+            ws_timer_unlink(wheel, timer);
+            wheel->count--;
+            fire(timer);
+        }
+    }
+    if (wheel->count == 0)
+    {
+        wheel->now = wheel->clock;
+    }
+}
+
+int ws_timer_wheel_timeout(const struct ws_timer_wheel *wheel)
+{
+    if (wheel->count == 0)
+    {
+        return -1;
+    }
+
+    // the next occupied level 0 slot, or the end of the rotation, where the
+    // level above may spill into it
+    int index = wheel->now & (WS_TIMER_SLOTS - 1);
+    u_int64_t ahead = index == WS_TIMER_SLOTS - 1 ? 0 : wheel->occupied[0] >> (index + 1);
+    u_int64_t ticks = ahead ? (u_int64_t)__builtin_ctzll(ahead) + 1 : (u_int64_t)(WS_TIMER_SLOTS - index);
+
+    u_int64_t due_ms = wheel->origin_ms + (wheel->now + ticks) * WS_TIMER_TICK_MS;
+    u_int64_t now_ms = ws_timer_now_ms();
+    return due_ms > now_ms ? (int)(due_ms - now_ms) : 0;
+}
@@ -0,0 +1,365 @@
+#include "../include/tls.h"
+#include "../include/log.h"
+#include "../include/reactor.h"
+#include <openssl/err.h>
+#include <sys/sendfile.h>
+
+static SSL_CTX *g_tls_ctx;
+
+static void ws_tls_log_errors(const char *what)
+{
+    unsigned long err;
+    char buf[256];
+    while ((err = ERR_get_error()) != 0)
+    {
+        ERR_error_string_n(err, buf, sizeof(buf));
+        ws_log_error("%s: %s", what, buf);
+    }
+}
+
+// One context for every reactor, so the session cache and the ticket keys are
+// shared and a client can resume on whichever thread accepts it.
+int ws_tls_init(const ws_tls_opts_t *opts)
+{
+    if (opts->cert_file == NULL)
+    {
+        return 0;
+    }
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx)
+    {
+        ws_tls_log_errors("SSL_CTX_new");
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, opts->cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, opts->key_file ? opts->key_file : opts->cert_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1)
+    {
+        ws_tls_log_errors(opts->cert_file);
+        SSL_CTX_free(ctx);
+        return -1;
+    }
+
+    // writes resume from the send queue, which may have moved and grown
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                              SSL_MODE_RELEASE_BUFFERS);
+    if (!opts->no_ktls)
+    {
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    }
+
+    // resumption: a server-side cache for session ids, and one stateless
+    // ticket per full handshake
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"swss", 4);
+    SSL_CTX_set_num_tickets(ctx, 1);
+
+    // OpenSSL writes with plain write(2) during handshakes and alerts
+    signal(SIGPIPE, SIG_IGN);
+
+    g_tls_ctx = ctx;
+    return 0;
+}
+
+int ws_tls_enabled(void) { return g_tls_ctx != NULL; }
+
+int ws_tls_accept(struct ws_conn *conn)
+{
+    SSL *ssl = SSL_new(g_tls_ctx);
+    if (!ssl)
+    {
+        ws_tls_log_errors("SSL_new");
+        return -1;
+    }
+    if (SSL_set_fd(ssl, conn->fd) != 1)
+    {
+        SSL_free(ssl);
+        return -1;
+    }
+    SSL_set_accept_state(ssl);
+    conn->tls = ssl;
+    conn->tls_tx = 1;
+    conn->tls_rx = 1;
+    conn->state = WS_STATE_TLS;
+    return 0;
+}
+
+// Advances the TLS handshake. Once it completes, any direction the kernel
+// took over (kTLS) goes back to plain socket calls.
+// returns 1 when done, 0 if it needs the socket again, -1 on failure
+int ws_tls_handshake(struct ws_conn *conn)
+{
+    pthread_mutex_lock(&conn->out_lock);
+    int ret = SSL_do_handshake(conn->tls);
+    if (ret == 1)
+    {
+        conn->tls_tx = !BIO_get_ktls_send(SSL_get_wbio(conn->tls));
+        conn->tls_rx = !BIO_get_ktls_recv(SSL_get_rbio(conn->tls));
+        conn->state = WS_STATE_HANDSHAKE;
+    }
+    pthread_mutex_unlock(&conn->out_lock);
+
+    if (ret == 1)
+    {
+        ws_log_debug("fd %d: %s %s%s, kTLS tx %s rx %s", conn->fd, SSL_get_version(conn->tls),
+                     SSL_get_cipher_name(conn->tls), SSL_session_reused(conn->tls) ? " (resumed)" : "",
+                     conn->tls_tx ? "off" : "on", conn->tls_rx ? "off" : "on");
+        return 1;
+    }
+
+    int err = SSL_get_error(conn->tls, ret);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+    {
+        return 0;
+    }
+    ws_tls_log_errors("SSL_do_handshake");
+    return -1;
+}
+
+// Best-effort close_notify; never waits for the peer's.
+void ws_tls_shutdown(struct ws_conn *conn)
+{
+    if (conn->tls && conn->state != WS_STATE_TLS)
+    {
+        SSL_shutdown(conn->tls);
+    }
+    ERR_clear_error();
+}
+
+// SSL_read until the buffers are full or the socket is drained, so a short
+// result still means there is nothing left to read.
+static ssize_t ws_tls_readv(struct ws_conn *conn, struct iovec *iov, int iovcnt)
+{
+    ssize_t total = 0;
+
+    // an SSL object must not be read and written at the same time
+    pthread_mutex_lock(&conn->out_lock);
+    for (int i = 0; i < iovcnt; i++)
+    {
+        size_t off = 0;
+        while (off < iov[i].iov_len)
+        {
+            int n = SSL_read(conn->tls, (u_int8_t *)iov[i].iov_base + off, iov[i].iov_len - off);
+            if (n > 0)
+            {
+                off += n;
+                total += n;
+                continue;
+            }
+
+            int err = SSL_get_error(conn->tls, n);
+            pthread_mutex_unlock(&conn->out_lock);
+            if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+            {
+                if (total == 0)
+                {
+                    errno = EAGAIN;
+                    return -1;
+                }
+                return total;
+            }
+            if (err == SSL_ERROR_ZERO_RETURN)
+            {
+                return total;
+            }
+            ERR_clear_error();
+            errno = ECONNRESET;
+            return total > 0 ? total : -1;
+        }
+    }
+    pthread_mutex_unlock(&conn->out_lock);
+    return total;
+}
+
+// Small pieces (a frame header and its payload, or a run of small frames)
+// are gathered into one record; each record costs a header and a tag on the
+// wire. With partial writes SSL_write stops after a record, so this loops
+// until the socket pushes back. Called with out_lock held.
+static ssize_t ws_tls_writev(struct ws_conn *conn, const struct iovec *iov, int iovcnt)
+{
+    u_int8_t record[16384];
+    ssize_t total = 0;
+    int i = 0;
+    size_t off = 0;
+
+    while (i < iovcnt)
+    {
+        const u_int8_t *data;
+        size_t len;
+        if (iov[i].iov_len - off >= sizeof(record))
+        {
+            data = (const u_int8_t *)iov[i].iov_base + off;
+            len = iov[i].iov_len - off;
+        }
+        else
+        {
+            len = 0;
+            for (int j = i; j < iovcnt && len < sizeof(record); j++)
+            {
+                size_t from = (j == i) ? off : 0;
+                size_t n = iov[j].iov_len - from;
+                if (n > sizeof(record) - len)
+                {
+                    n = sizeof(record) - len;
+                }
+                memcpy(record + len, (const u_int8_t *)iov[j].iov_base + from, n);
+                len += n;
+            }
+            data = record;
+        }
+        if (len == 0)
+        {
+            break;
+        }
+
+        int n = SSL_write(conn->tls, data, len);
+        if (n <= 0)
+        {
+            int err = SSL_get_error(conn->tls, n);
+            if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+            {
+                if (total == 0)
+                {
+                    errno = EAGAIN;
+                    return -1;
+                }
+                return total;
+            }
+            ERR_clear_error();
+            errno = EPIPE;
+            return total > 0 ? total : -1;
+        }
+
+        total += n;
+        // step over what was written
+        size_t left = n;
+        while (left > 0)
+        {
+            size_t avail = iov[i].iov_len - off;
+            if (left < avail)
+            {
+                off += left;
+                break;
+            }
+            left -= avail;
+            i++;
+            off = 0;
+        }
+        while (i < iovcnt && iov[i].iov_len == 0)
+        {
+            i++;
+        }
+    }
+    return total;
+}
+
+ssize_t ws_conn_readv(struct ws_conn *conn, struct iovec *iov, int iovcnt)
+{
+    if (conn->uring)
+    {
+        return ws_uring_readv(conn, iov, iovcnt);
+    }
+    if (conn->tls && conn->tls_rx)
+    {
+        return ws_tls_readv(conn, iov, iovcnt);
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    ssize_t n;
+    do
+    {
+        n = recvmsg(conn->fd, &msg, MSG_DONTWAIT);
+    } while (n == -1 && errno == EINTR);
+    return n;
+}
+
+ssize_t ws_conn_writev(struct ws_conn *conn, const struct iovec *iov, int iovcnt)
+{
+    if (conn->tls && conn->state == WS_STATE_TLS)
+    {
+        // nothing may be written until the TLS handshake is done; the queue
+        // is flushed when it is
+        errno = EAGAIN;
+        return -1;
+    }
+    if (conn->corked && !conn->closed)
+    {
+        // held in the queue until the cork is released (see ws_cork)
+        errno = EAGAIN;
+        return -1;
+    }
+    if (conn->tls && conn->tls_tx)
+    {
+        return ws_tls_writev(conn, iov, iovcnt);
+    }
+    if (conn->uring && ws_uring_defer_send(conn))
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+
+    ssize_t n;
+    do
+    {
+        n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while (n == -1 && errno == EINTR);
+    return n;
+}
+
+ssize_t ws_conn_sendfile(struct ws_conn *conn, int fd, off_t offset, size_t len)
+{
+    if ((conn->tls && conn->state == WS_STATE_TLS) || (conn->corked && !conn->closed))
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (conn->tls && conn->tls_tx)
+    {
+        // OpenSSL encrypts from memory; a record at a time
+        u_int8_t buf[16384];
+        ssize_t n;
+        do
+        {
+            n = pread(fd, buf, len < sizeof(buf) ? len : sizeof(buf), offset);
+        } while (n == -1 && errno == EINTR);
+        if (n == 0)
+        {
+            errno = EIO;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        struct iovec iov = {.iov_base = buf, .iov_len = n};
+        return ws_tls_writev(conn, &iov, 1);
+    }
+    if (conn->uring && ws_uring_defer_send(conn))
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    ssize_t n;
+    do
+    {
+        n = sendfile(conn->fd, fd, &offset, len);
+    } while (n == -1 && errno == EINTR);
+    if (n == 0)
+    {
+        errno = EIO;
+        return -1;
+    }
+    return n;
+}
@@ -0,0 +1,641 @@
+#include "../include/uring.h"
+#include "../include/log.h"
+#include "../include/pool.h"
+#include "../include/reactor.h"
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+
+// What a completion belongs to, in the low bits of its user_data; the rest is
+// the connection, whose allocation is at least 16-byte aligned.
+enum ws_uring_op
+{
+    WS_OP_IGNORE,
+    WS_OP_ACCEPT,
+    WS_OP_RECV,
+    WS_OP_SEND,
+    WS_OP_WAKE,
+    WS_OP_WRITABLE,
+};
+#define WS_OP_MASK 7
+
+struct ws_uring
+{
+    int fd;
+    struct ws_reactor *reactor;
+    int accepting;
+    int waking; // a poll of the reactor's wake eventfd is armed
+
+    // submission queue; the tail is published to the kernel on submit
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    unsigned to_submit;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *ring_mem;
+    size_t ring_size;
+    size_t sqes_size;
+
+    // buffers the kernel picks from for multishot receives, handed back as
+    // soon as their data has been parsed
+    struct io_uring_buf_ring *br;
+    u_int8_t *bufs;
+    u_int16_t br_tail;
+
+    // connections given output during this loop iteration
+    struct ws_conn *dirty;
+};
+
+static __thread struct ws_uring *t_uring;
+
+static int ws_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                          const struct io_uring_getevents_arg *arg)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg ? sizeof(*arg) : 0);
+}
+
+static void ws_uring_free(struct ws_uring *ring)
+{
+    if (ring->fd != -1)
+    {
+        close(ring->fd);
+    }
+    if (ring->ring_mem)
+    {
+        munmap(ring->ring_mem, ring->ring_size);
+    }
+    if (ring->sqes)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->br)
+    {
+        munmap(ring->br, WS_URING_BUFS * sizeof(struct io_uring_buf));
+    }
+    free(ring->bufs);
+    free(ring);
+}
+
+static void ws_uring_buf_put(struct ws_uring *ring, u_int16_t bid)
+{
+    struct io_uring_buf *buf = &ring->br->bufs[ring->br_tail & (WS_URING_BUFS - 1)];
+    buf->addr = (u_int64_t)(uintptr_t)(ring->bufs + (size_t)bid * WS_URING_BUF_SIZE);
+    buf->len = WS_URING_BUF_SIZE;
+    buf->bid = bid;
+    ring->br_tail++;
+    __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+// The ring is created by the thread that will drive it. Completions are only
+// processed when that thread asks for them, so the kernel never interrupts it
+// to run task work.
+struct ws_uring *ws_uring_new(void)
+{
+    struct ws_uring *ring = calloc(1, sizeof(struct ws_uring));
+    if (!ring)
+    {
+        return NULL;
+    }
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_SUBMIT_ALL |
+              IORING_SETUP_CQSIZE;
+    p.cq_entries = WS_URING_ENTRIES * 4;
+    ring->fd = (int)syscall(__NR_io_uring_setup, WS_URING_ENTRIES, &p);
+    if (ring->fd == -1 || !(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP))
+    {
+        ws_uring_free(ring);
+        return NULL;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_mem = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                          IORING_OFF_SQ_RING);
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    ring->br = mmap(NULL, WS_URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->bufs = malloc((size_t)WS_URING_BUFS * WS_URING_BUF_SIZE);
+    if (ring->ring_mem == MAP_FAILED || ring->sqes == MAP_FAILED || ring->br == MAP_FAILED || !ring->bufs)
+    {
+        ring->ring_mem = ring->ring_mem == MAP_FAILED ? NULL : ring->ring_mem;
+        ring->sqes = ring->sqes == MAP_FAILED ? NULL : ring->sqes;
+        ring->br = ring->br == MAP_FAILED ? NULL : ring->br;
+        ws_uring_free(ring);
+        return NULL;
+    }
+
+    u_int8_t *mem = ring->ring_mem;
+    ring->sq_head = (unsigned *)(mem + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(mem + p.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(mem + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    unsigned *array = (unsigned *)(mem + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++)
+    {
+        array[i] = i;
+    }
+    ring->cq_head = (unsigned *)(mem + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(mem + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(mem + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(mem + p.cq_off.cqes);
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (u_int64_t)(uintptr_t)ring->br;
+    reg.ring_entries = WS_URING_BUFS;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    {
+        ws_uring_free(ring);
+        return NULL;
+    }
+    for (u_int16_t bid = 0; bid < WS_URING_BUFS; bid++)
+    {
+        ws_uring_buf_put(ring, bid);
+    }
+    return ring;
+}
+
+// Whether this kernel has everything the backend uses (Linux 6.1 or later).
+int ws_uring_probe(void)
+{
+    struct ws_uring *ring = ws_uring_new();
+    if (!ring)
+    {
+        return -1;
+    }
+    ws_uring_free(ring);
+    return 0;
+}
+
+// Submits the queue and, if wait is set, waits for a completion for up to
+// timeout_ms (-1 = no limit).
+// returns -1 if the kernel refused the batch
+static int ws_uring_submit(struct ws_uring *ring, unsigned wait, int timeout_ms)
+{
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    if (wait && timeout_ms >= 0)
+    {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (u_int64_t)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    int n = ws_uring_enter(ring->fd, ring->to_submit, wait, flags, (flags & IORING_ENTER_EXT_ARG) ? &arg : NULL);
+    if (n == -1)
+    {
+        return (errno == EINTR || errno == EAGAIN || errno == EBUSY || errno == ETIME) ? 0 : -1;
+    }
+    ring->to_submit -= n;
+    return 0;
+}
+
+// A zeroed submission entry, or NULL if the queue is full and the kernel
+// would not take any of it.
+static struct io_uring_sqe *ws_uring_sqe(struct ws_uring *ring)
+{
+    if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    {
+        ws_uring_submit(ring, 0, -1);
+        if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+        {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_local_tail++;
+    ring->to_submit++;
+    return sqe;
+}
+
+// Starts a multishot receive on conn. It holds a reference until its final
+// completion.
+static int ws_uring_arm_recv(struct ws_uring *ring, struct ws_conn *conn)
+{
+    struct io_uring_sqe *sqe = ws_uring_sqe(ring);
+    if (!sqe)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = (u_int64_t)(uintptr_t)conn | WS_OP_RECV;
+    atomic_fetch_add_explicit(&conn->refs, 1, memory_order_relaxed);
+    return 0;
+}
+
+// Other threads never write to a connection's socket; they leave output in its
+// inbox and signal the reactor's eventfd, watched here.
+static void ws_uring_arm_wake(struct ws_uring *ring)
+{
+    struct io_uring_sqe *sqe = ws_uring_sqe(ring);
+    if (!sqe)
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = ring->reactor->wake_fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = WS_OP_WAKE;
+    ring->waking = 1;
+}
+
+static void ws_uring_arm_accept(struct ws_uring *ring)
+{
+    struct io_uring_sqe *sqe = ws_uring_sqe(ring);
+    if (!sqe)
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ring->reactor->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = WS_OP_ACCEPT;
+    ring->accepting = 1;
+}
+
+// Puts conn on the list to send for. Called with out_lock held.
+static void ws_uring_mark(struct ws_uring *ring, struct ws_conn *conn)
+{
+    if (!conn->tx_dirty && !conn->tx_inflight)
+    {
+        conn->tx_dirty = 1;
+        atomic_fetch_add_explicit(&conn->refs, 1, memory_order_relaxed);
+        conn->tx_next = ring->dirty;
+        ring->dirty = conn;
+    }
+}
+
+int ws_uring_defer_send(struct ws_conn *conn)
+{
+    if (conn->uring != t_uring || conn->closed)
+    {
+        return 0;
+    }
+    ws_uring_mark(t_uring, conn);
+    return 1;
+}
+
+ssize_t ws_uring_readv(struct ws_conn *conn, struct iovec *iov, int iovcnt)
+{
+    if (conn->rx_len <= 0)
+    {
+        if (conn->rx_len == 0)
+        {
+            return 0;
+        }
+        errno = -conn->rx_len;
+        return -1;
+    }
+
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt && conn->rx_len > 0; i++)
+    {
+        size_t n = iov[i].iov_len < (size_t)conn->rx_len ? iov[i].iov_len : (size_t)conn->rx_len;
+        memcpy(iov[i].iov_base, conn->rx_buf, n);
+        conn->rx_buf += n;
+        conn->rx_len -= n;
+        total += n;
+    }
+    if (conn->rx_len == 0)
+    {
+        conn->rx_len = -EAGAIN;
+    }
+    return total;
+}
+
+void ws_uring_close(struct ws_conn *conn)
+{
+    struct ws_uring *ring = conn->uring;
+    struct io_uring_sqe *cancel = ws_uring_sqe(ring);
+    struct io_uring_sqe *sqe = cancel ? ws_uring_sqe(ring) : NULL;
+    if (!sqe)
+    {
+        // the pending operations hold the file open past close; shutting the
+        // socket down ends them now (the receive with EOF) and frees the peer
+        shutdown(conn->fd, SHUT_RDWR);
+        close(conn->fd);
+        return;
+    }
+
+    // the descriptor has to stay open until the cancel has looked it up
+    cancel->opcode = IORING_OP_ASYNC_CANCEL;
+    cancel->fd = conn->fd;
+    cancel->cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_FD;
+    cancel->flags = IOSQE_IO_HARDLINK | IOSQE_CQE_SKIP_SUCCESS;
+    cancel->user_data = WS_OP_IGNORE;
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = conn->fd;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = WS_OP_IGNORE;
+}
+
+void ws_uring_pause(struct ws_conn *conn)
+{
+    // without a free entry the receive carries on, which only delays the pause
+    struct io_uring_sqe *sqe = ws_uring_sqe(conn->uring);
+    if (!sqe)
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (u_int64_t)(uintptr_t)conn | WS_OP_RECV;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = WS_OP_IGNORE;
+}
+
+int ws_uring_resume(struct ws_conn *conn) { return ws_uring_arm_recv(conn->uring, conn); }
+
+// The head of conn's queue is a span of a file, which io_uring could only
+// send spliced through a pipe. It is written with sendfile(2) right here
+// instead, and once the socket is full a poll waits for room for the rest.
+// Called with out_lock held.
+// returns the number of bytes written
+static ssize_t ws_uring_send_file(struct ws_uring *ring, struct ws_conn *conn, int fd, off_t offset, size_t len)
+{
+    ssize_t n;
+    do
+    {
+        n = sendfile(conn->fd, fd, &offset, len);
+    } while (n == -1 && errno == EINTR);
+    if (n > 0)
+    {
+        return n;
+    }
+
+    struct io_uring_sqe *sqe = (n == -1 && errno == EAGAIN) ? ws_uring_sqe(ring) : NULL;
+    if (!sqe)
+    {
+        // the file ended early, or as for a send that can't be submitted
+        shutdown(conn->fd, SHUT_RDWR);
+        return 0;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn->fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = (u_int64_t)(uintptr_t)conn | WS_OP_WRITABLE;
+    conn->tx_inflight = 1;
+    atomic_fetch_add_explicit(&conn->refs, 1, memory_order_relaxed);
+    return 0;
+}
+
+// One sendmsg per connection with output, covering as much of its queue as
+// fits; all of them go to the kernel with the next wait.
+static void ws_uring_send_dirty(struct ws_uring *ring)
+{
+    while (ring->dirty)
+    {
+        struct ws_conn *conn = ring->dirty;
+        ring->dirty = conn->tx_next;
+
+        pthread_mutex_lock(&conn->out_lock);
+        conn->tx_dirty = 0;
+        ssize_t sent = 0;
+        int fd;
+        off_t offset;
+        size_t len;
+        if (!conn->closed && !conn->tx_inflight && ws_outq_file_span(&conn->outq, &fd, &offset, &len))
+        {
+            sent = ws_uring_send_file(ring, conn, fd, offset, len);
+        }
+        else if (!conn->closed && !conn->tx_inflight && conn->outq.head != NULL)
+        {
+            if (!conn->tx)
+            {
+                // borrowed only while a send is with the kernel
+                conn->tx = ws_buf_alloc(sizeof(struct ws_uring_tx));
+            }
+            struct io_uring_sqe *sqe = conn->tx ? ws_uring_sqe(ring) : NULL;
+            if (sqe)
+            {
+                struct ws_uring_tx *tx = conn->tx;
+                memset(&tx->msg, 0, sizeof(tx->msg));
+                tx->msg.msg_iov = tx->iov;
+                tx->msg.msg_iovlen = ws_outq_iov(&conn->outq, tx->iov, WS_URING_SEND_IOV);
+                sqe->opcode = IORING_OP_SENDMSG;
+                sqe->fd = conn->fd;
+                sqe->addr = (u_int64_t)(uintptr_t)&tx->msg;
+                sqe->len = 1;
+                sqe->msg_flags = MSG_NOSIGNAL;
+                sqe->user_data = (u_int64_t)(uintptr_t)conn | WS_OP_SEND;
+                conn->tx_inflight = 1;
+                atomic_fetch_add_explicit(&conn->refs, 1, memory_order_relaxed);
+            }
+            else
+            {
+                // out of memory or submission space; the receive side sees
+                // the connection end and closes it
+                shutdown(conn->fd, SHUT_RDWR);
+            }
+        }
+        pthread_mutex_unlock(&conn->out_lock);
+
+        // completes like a send, which lists conn again for whatever is left
+        if (sent > 0)
+        {
+            ws_conn_on_sent(conn, sent);
+        }
+        ws_conn_put(conn);
+    }
+}
+
+static void ws_uring_accepted(struct ws_uring *ring, int fd)
+{
+    if (fd < 0)
+    {
+        // with no descriptor to spare the multishot accept ends, and is not
+        // re-armed until the reactor's backoff is over
+        if (fd != -EAGAIN && fd != -EINTR)
+        {
+            ws_reactor_accept_failed(ring->reactor, -fd);
+        }
+        return;
+    }
+
+    struct ws_conn *conn = ws_conn_new(fd);
+    if (!conn)
+    {
+        close(fd);
+        return;
+    }
+    conn->uring = ring;
+    conn->rx_len = -EAGAIN;
+    if (ws_uring_arm_recv(ring, conn) == -1)
+    {
+        ws_conn_close(conn);
+    }
+}
+
+static void ws_uring_received(struct ws_uring *ring, struct ws_conn *conn, const struct io_uring_cqe *cqe)
+{
+    int bid = (cqe->flags & IORING_CQE_F_BUFFER) ? (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+
+    // ENOBUFS only means every buffer was taken, and ECANCELED that reads
+    // were paused; either way the receive is re-armed below or on resume
+    if (!conn->closed && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)
+    {
+        conn->rx_buf = bid >= 0 ? ring->bufs + (size_t)bid * WS_URING_BUF_SIZE : NULL;
+        conn->rx_len = cqe->res;
+        if (ws_conn_on_readable(conn) == -1)
+        {
+            if (cqe->res < 0)
+            {
+                ws_conn_error(conn, 1006);
+            }
+            ws_conn_close(conn);
+        }
+        conn->rx_len = -EAGAIN;
+    }
+    if (bid >= 0)
+    {
+        ws_uring_buf_put(ring, bid);
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        if (!conn->closed && atomic_load(&conn->rx_paused))
+        {
+            conn->rx_stopped = 1;
+        }
+        else if (!conn->closed && ws_uring_arm_recv(ring, conn) == -1)
+        {
+            ws_conn_close(conn);
+        }
+        ws_conn_put(conn);
+    }
+}
+
+static void ws_uring_complete(struct ws_uring *ring, const struct io_uring_cqe *cqe)
+{
+    struct ws_conn *conn = (struct ws_conn *)(uintptr_t)(cqe->user_data & ~(u_int64_t)WS_OP_MASK);
+    int sent;
+
+    switch (cqe->user_data & WS_OP_MASK)
+    {
+    case WS_OP_ACCEPT:
+        ws_uring_accepted(ring, cqe->res);
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+        {
+            ring->accepting = 0;
+        }
+        break;
+
+    case WS_OP_RECV:
+        ws_uring_received(ring, conn, cqe);
+        break;
+
+    case WS_OP_SEND:
+    case WS_OP_WRITABLE:
+        // a poll reports room to write, not bytes written
+        sent = cqe->res;
+        if ((cqe->user_data & WS_OP_MASK) == WS_OP_WRITABLE && sent > 0)
+        {
+            sent = 0;
+        }
+        if (ws_conn_on_sent(conn, sent) == -1)
+        {
+            ws_conn_error(conn, 1006);
+            ws_conn_close(conn);
+        }
+        ws_conn_put(conn);
+        break;
+
+    case WS_OP_WAKE:
+        if (cqe->res > 0)
+        {
+            ws_reactor_on_wake(ring->reactor);
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+        {
+            ring->waking = 0;
+        }
+        break;
+    }
+}
+
+// The reactor's timers are its connections' and the accept backoff, which
+// only has to come off the wheel for the loop to re-arm the accept.
+static void ws_uring_on_timer(struct ws_timer *timer)
+{
+    if (timer != &t_uring->reactor->accept_backoff)
+    {
+        ws_conn_on_timer(timer);
+    }
+}
+
+// Event loop for one reactor on io_uring. Each iteration submits everything
+// the previous completions produced (accepts, receives, the batched sends of
+// every connection written to) and waits for more in a single system call.
+int ws_uring_run(struct ws_reactor *reactor, struct ws_uring *ring)
+{
+    t_uring = ring;
+    ring->reactor = reactor;
+
+    while (1)
+    {
+        if (!ring->accepting && !reactor->accept_backoff.pprev)
+        {
+            ws_uring_arm_accept(ring);
+        }
+        if (!ring->waking)
+        {
+            ws_uring_arm_wake(ring);
+        }
+        // corks end with the iteration before, and what they held is sent now
+        ws_reactor_uncork(reactor);
+        ws_uring_send_dirty(ring);
+        if (ws_uring_submit(ring, 1, ws_timer_wheel_timeout(&reactor->timers)) == -1)
+        {
+            ws_log_perror("io_uring_enter");
+            break;
+        }
+        ws_timer_wheel_update(&reactor->timers);
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            // copied out so the slot can go back to the kernel straight away
+            struct io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            ws_uring_complete(ring, &cqe);
+        }
+
+        // a connection a timer closes may still have completions queued; they
+        // hold references, so it is not freed under them
+        ws_timer_wheel_expire(&reactor->timers, ws_uring_on_timer);
+    }
+
+    ws_timer_cancel(&reactor->timers, &reactor->accept_backoff);
+    t_uring = NULL;
+    ws_uring_free(ring);
+    return -1;
+}
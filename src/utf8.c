@@ -0,0 +1,333 @@
+#include "../include/utf8.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WS_UTF8_X86 1
+#endif
+
+// Advances st past one byte.
+// returns 0, or -1 if b can't come next
+static inline int ws_utf8_step(struct ws_utf8 *st, u_int8_t b)
+{
+    if (st->need > 0)
+    {
+        if (b < st->lo || b > st->hi)
+        {
+            return -1;
+        }
+        st->need--;
+        st->lo = 0x80;
+        st->hi = 0xBF;
+        return 0;
+    }
+    if (b < 0x80)
+    {
+        return 0;
+    }
+
+    // the second byte's range rules out overlong forms, surrogates
+    // (ED A0..BF) and anything past U+10FFFF (F4 90..BF)
+    st->lo = 0x80;
+    st->hi = 0xBF;
+    if (b >= 0xC2 && b <= 0xDF)
+    {
+        st->need = 1;
+    }
+    else if (b >= 0xE0 && b <= 0xEF)
+    {
+        st->need = 2;
+        st->lo = b == 0xE0 ? 0xA0 : 0x80;
+        st->hi = b == 0xED ? 0x9F : 0xBF;
+    }
+    else if (b >= 0xF0 && b <= 0xF4)
+    {
+        st->need = 3;
+        st->lo = b == 0xF0 ? 0x90 : 0x80;
+        st->hi = b == 0xF4 ? 0x8F : 0xBF;
+    }
+    else
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// A byte at a time, skipping runs of ASCII eight bytes per step.
+static int ws_utf8_scan(struct ws_utf8 *st, const u_int8_t *data, size_t len)
+{
+    size_t i = 0;
+    while (i < len)
+    {
+        if (st->need == 0)
+        {
+            for (; i + 8 <= len; i += 8)
+            {
+                u_int64_t word;
+                memcpy(&word, data + i, 8);
+                if (word & 0x8080808080808080ULL)
+                {
+                    break;
+                }
+            }
+            if (i == len)
+            {
+                break;
+            }
+        }
+        if (ws_utf8_step(st, data[i]) == -1)
+        {
+            return -1;
+        }
+        i++;
+    }
+    return 0;
+}
+
+int ws_utf8_scalar(const u_int8_t *data, size_t len)
+{
+    struct ws_utf8 st = {0};
+    if (ws_utf8_scan(&st, data, len) == -1)
+    {
+        return -1;
+    }
+    return ws_utf8_end(&st);
+}
+
+#ifdef WS_UTF8_X86
+// The vector kernels follow Keiser and Lemire, "Validating UTF-8 in less than
+// one instruction per byte" (2021). Each byte is classified together with the
+// one before it through three 16-entry nibble tables, whose entries are sets
+// of the errors that pair could be; a pair is bad if all three agree on one.
+// What two bytes can't show - a lead byte's third and fourth bytes - is
+// checked by shifting the block against the previous one.
+#define WS_UTF8_TOO_SHORT 0x01      // 11______ 0_______ or 11______ 11______
+#define WS_UTF8_TOO_LONG 0x02       // 0_______ 10______
+#define WS_UTF8_OVERLONG_3 0x04     // 11100000 100_____
+#define WS_UTF8_TOO_LARGE 0x08      // 11110100 1001____ and above
+#define WS_UTF8_SURROGATE 0x10      // 11101101 101_____
+#define WS_UTF8_OVERLONG_2 0x20     // 1100000_ 10______
+#define WS_UTF8_TOO_LARGE_1000 0x40 // 11110101 1000____ and above
+#define WS_UTF8_OVERLONG_4 0x40     // 11110000 1000____
+#define WS_UTF8_TWO_CONTS 0x80      // 10______ 10______
+#define WS_UTF8_CARRY (WS_UTF8_TOO_SHORT | WS_UTF8_TOO_LONG | WS_UTF8_TWO_CONTS)
+
+// indexed by the high nibble of the first byte of the pair
+static const u_int8_t ws_utf8_byte1_high[16] = {
+    WS_UTF8_TOO_LONG, WS_UTF8_TOO_LONG, WS_UTF8_TOO_LONG, WS_UTF8_TOO_LONG,
+    WS_UTF8_TOO_LONG, WS_UTF8_TOO_LONG, WS_UTF8_TOO_LONG, WS_UTF8_TOO_LONG,
+    WS_UTF8_TWO_CONTS, WS_UTF8_TWO_CONTS, WS_UTF8_TWO_CONTS, WS_UTF8_TWO_CONTS,
+    WS_UTF8_TOO_SHORT | WS_UTF8_OVERLONG_2,
+    WS_UTF8_TOO_SHORT,
+    WS_UTF8_TOO_SHORT | WS_UTF8_OVERLONG_3 | WS_UTF8_SURROGATE,
+    WS_UTF8_TOO_SHORT | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000 | WS_UTF8_OVERLONG_4,
+};
+
+// indexed by the low nibble of the first byte
+static const u_int8_t ws_utf8_byte1_low[16] = {
+    WS_UTF8_CARRY | WS_UTF8_OVERLONG_3 | WS_UTF8_OVERLONG_2 | WS_UTF8_OVERLONG_4,
+    WS_UTF8_CARRY | WS_UTF8_OVERLONG_2,
+    WS_UTF8_CARRY,
+    WS_UTF8_CARRY,
+    WS_UTF8_CARRY | WS_UTF8_TOO_LARGE,
+    WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000,
+    WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000,
+    WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000,
+    WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000,
+    WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000,
+    WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000,
+    WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000,
+    WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000,
+    WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000 | WS_UTF8_SURROGATE,
+    WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000,
+    WS_UTF8_CARRY | WS_UTF8_TOO_LARGE | WS_UTF8_TOO_LARGE_1000,
+};
+
+// indexed by the high nibble of the second byte
+static const u_int8_t ws_utf8_byte2_high[16] = {
+    WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT,
+    WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT,
+    WS_UTF8_TOO_LONG | WS_UTF8_OVERLONG_2 | WS_UTF8_TWO_CONTS | WS_UTF8_OVERLONG_3 | WS_UTF8_TOO_LARGE_1000 |
+        WS_UTF8_OVERLONG_4,
+    WS_UTF8_TOO_LONG | WS_UTF8_OVERLONG_2 | WS_UTF8_TWO_CONTS | WS_UTF8_OVERLONG_3 | WS_UTF8_TOO_LARGE,
+    WS_UTF8_TOO_LONG | WS_UTF8_OVERLONG_2 | WS_UTF8_TWO_CONTS | WS_UTF8_SURROGATE | WS_UTF8_TOO_LARGE,
+    WS_UTF8_TOO_LONG | WS_UTF8_OVERLONG_2 | WS_UTF8_TWO_CONTS | WS_UTF8_SURROGATE | WS_UTF8_TOO_LARGE,
+    WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT, WS_UTF8_TOO_SHORT,
+};
+
+// a block ending in a lead byte whose sequence runs past it exceeds these
+static const u_int8_t ws_utf8_incomplete[32] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xEF, 0xDF, 0xBF,
+};
+
+__attribute__((target("sse4.1"))) int ws_utf8_sse4(const u_int8_t *data, size_t len)
+{
+    const __m128i byte1_high = _mm_loadu_si128((const __m128i *)ws_utf8_byte1_high);
+    const __m128i byte1_low = _mm_loadu_si128((const __m128i *)ws_utf8_byte1_low);
+    const __m128i byte2_high = _mm_loadu_si128((const __m128i *)ws_utf8_byte2_high);
+    const __m128i incomplete_max = _mm_loadu_si128((const __m128i *)(ws_utf8_incomplete + 16));
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    __m128i prev = _mm_setzero_si128();
+    __m128i incomplete = _mm_setzero_si128();
+    __m128i error = _mm_setzero_si128();
+
+    for (size_t i = 0; i < len; i += 16)
+    {
+        __m128i in;
+        if (i + 16 <= len)
+        {
+            in = _mm_loadu_si128((const __m128i *)(data + i));
+        }
+        else
+        {
+            // pad the last block with ASCII
+            u_int8_t tail[16] = {0};
+            memcpy(tail, data + i, len - i);
+            in = _mm_loadu_si128((const __m128i *)tail);
+        }
+
+        if (_mm_movemask_epi8(in) == 0)
+        {
+            // only a sequence left open by the block before can be wrong
+            error = _mm_or_si128(error, incomplete);
+        }
+        else
+        {
+            __m128i prev1 = _mm_alignr_epi8(in, prev, 15);
+            __m128i special = _mm_and_si128(
+                _mm_and_si128(_mm_shuffle_epi8(byte1_high, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+                              _mm_shuffle_epi8(byte1_low, _mm_and_si128(prev1, nibble))),
+                _mm_shuffle_epi8(byte2_high, _mm_and_si128(_mm_srli_epi16(in, 4), nibble)));
+
+            // bytes two and three after a 3- or 4-byte lead must be continuations
+            __m128i third = _mm_subs_epu8(_mm_alignr_epi8(in, prev, 14), _mm_set1_epi8(0xE0 - 0x80));
+            __m128i fourth = _mm_subs_epu8(_mm_alignr_epi8(in, prev, 13), _mm_set1_epi8(0xF0 - 0x80));
+            __m128i must23 = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8((char)0x80));
+            error = _mm_or_si128(error, _mm_xor_si128(must23, special));
+            incomplete = _mm_subs_epu8(in, incomplete_max);
+        }
+        prev = in;
+    }
+
+    error = _mm_or_si128(error, incomplete);
+    return _mm_testz_si128(error, error) ? 0 : -1;
+}
+
+__attribute__((target("avx2"))) int ws_utf8_avx2(const u_int8_t *data, size_t len)
+{
+    const __m256i byte1_high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)ws_utf8_byte1_high));
+    const __m256i byte1_low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)ws_utf8_byte1_low));
+    const __m256i byte2_high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)ws_utf8_byte2_high));
+    const __m256i incomplete_max = _mm256_loadu_si256((const __m256i *)ws_utf8_incomplete);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    __m256i prev = _mm256_setzero_si256();
+    __m256i incomplete = _mm256_setzero_si256();
+    __m256i error = _mm256_setzero_si256();
+
+    for (size_t i = 0; i < len; i += 32)
+    {
+        __m256i in;
+        if (i + 32 <= len)
+        {
+            in = _mm256_loadu_si256((const __m256i *)(data + i));
+        }
+        else
+        {
+            u_int8_t tail[32] = {0};
+            memcpy(tail, data + i, len - i);
+            in = _mm256_loadu_si256((const __m256i *)tail);
+        }
+
+        if (_mm256_movemask_epi8(in) == 0)
+        {
+            error = _mm256_or_si256(error, incomplete);
+        }
+        else
+        {
+            // alignr shifts within 128-bit lanes, so the lane boundary is
+            // bridged with the previous block's high lane
+            __m256i carry = _mm256_permute2x128_si256(prev, in, 0x21);
+            __m256i prev1 = _mm256_alignr_epi8(in, carry, 15);
+            __m256i special = _mm256_and_si256(
+                _mm256_and_si256(
+                    _mm256_shuffle_epi8(byte1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+                    _mm256_shuffle_epi8(byte1_low, _mm256_and_si256(prev1, nibble))),
+                _mm256_shuffle_epi8(byte2_high, _mm256_and_si256(_mm256_srli_epi16(in, 4), nibble)));
+
+            __m256i third = _mm256_subs_epu8(_mm256_alignr_epi8(in, carry, 14), _mm256_set1_epi8(0xE0 - 0x80));
+            __m256i fourth = _mm256_subs_epu8(_mm256_alignr_epi8(in, carry, 13), _mm256_set1_epi8(0xF0 - 0x80));
+            __m256i must23 = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char)0x80));
+            error = _mm256_or_si256(error, _mm256_xor_si256(must23, special));
+            incomplete = _mm256_subs_epu8(in, incomplete_max);
+        }
+        prev = in;
+    }
+
+    error = _mm256_or_si256(error, incomplete);
+    return _mm256_testz_si256(error, error) ? 0 : -1;
+}
+
+int ws_utf8_have_sse4(void) { return __builtin_cpu_supports("sse4.1"); }
+int ws_utf8_have_avx2(void) { return __builtin_cpu_supports("avx2"); }
+#else
+int ws_utf8_sse4(const u_int8_t *data, size_t len) { return ws_utf8_scalar(data, len); }
+int ws_utf8_avx2(const u_int8_t *data, size_t len) { return ws_utf8_scalar(data, len); }
+int ws_utf8_have_sse4(void) { return 0; }
+int ws_utf8_have_avx2(void) { return 0; }
+#endif
+
+typedef int (*ws_utf8_fn)(const u_int8_t *data, size_t len);
+
+// Picked on first use, like the masking kernel.
+static ws_utf8_fn g_utf8_kernel;
+
+static ws_utf8_fn ws_utf8_kernel(void)
+{
+    ws_utf8_fn kernel = __atomic_load_n(&g_utf8_kernel, __ATOMIC_RELAXED);
+    if (kernel == NULL)
+    {
+        kernel = ws_utf8_have_avx2() ? ws_utf8_avx2 : ws_utf8_have_sse4() ? ws_utf8_sse4 : ws_utf8_scalar;
+        __atomic_store_n(&g_utf8_kernel, kernel, __ATOMIC_RELAXED);
+    }
+    return kernel;
+}
+
+int ws_utf8_valid(const u_int8_t *data, size_t len) { return ws_utf8_kernel()(data, len); }
+
+int ws_utf8_feed(struct ws_utf8 *st, const u_int8_t *data, size_t len)
+{
+    // finish the character the last piece split
+    size_t i = 0;
+    for (; st->need > 0 && i < len; i++)
+    {
+        if (ws_utf8_step(st, data[i]) == -1)
+        {
+            return -1;
+        }
+    }
+
+    // the kernels take whole characters, so a lead byte near the end whose
+    // continuations haven't all arrived is held back for the next piece
+    size_t end = len;
+    for (size_t k = 1; k <= 3 && k <= len - i; k++)
+    {
+        u_int8_t b = data[len - k];
+        if ((b & 0xC0) == 0x80)
+        {
+            continue;
+        }
+        size_t want = b >= 0xF0 ? 4 : b >= 0xE0 ? 3 : b >= 0xC0 ? 2 : 1;
+        if (want > k)
+        {
+            end = len - k;
+        }
+        break;
+    }
+
+    if (end > i && ws_utf8_kernel()(data + i, end - i) == -1)
+    {
+        return -1;
+    }
+    return ws_utf8_scan(st, data + end, len - end);
+}
@@ -2,37 +2,62 @@
 #include "../include/base64.h"
 
 #define GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
-#define RESPONSE_SIZE 1024
+#define GUID_LEN 36
 
-char *ws_createAcceptToken(char *key)
+static const char response_head[] = "HTTP/1.1 101 Switching Protocols\r\n"
+                                    "Upgrade: websocket\r\n"
+                                    "Connection: Upgrade\r\n"
+                                    "Sec-WebSocket-Accept: ";
+
+// Sec-WebSocket-Accept for key, computed entirely on the stack.
+// returns 0 on success, -1 if the key is too long to be valid
+int ws_createAcceptToken(const char *key, size_t key_len, char accept[WS_ACCEPT_LEN + 1])
 {
-    char *token = malloc(64);
-    strcpy(token, key);
-    strcat(token, GUID);
+    unsigned char token[WS_KEY_MAX + GUID_LEN];
+    if (key_len > WS_KEY_MAX)
+    {
+        return -1;
+    }
+    memcpy(token, key, key_len);
+    memcpy(token + key_len, GUID, GUID_LEN);
 
     unsigned char sha_hash[SHA_DIGEST_LENGTH];
-    SHA1((unsigned char *)token, strlen(token), sha_hash);
-
-    size_t output_length;
-    char *accept_token = base64_encode(sha_hash, SHA_DIGEST_LENGTH, &output_length);
-    char *response = ws_generateHTTPResponse(accept_token);
-
-    free(token);
-    free(accept_token);
+    SHA1(token, key_len + GUID_LEN, sha_hash);
 
-    return response;
+    base64_encode(sha_hash, SHA_DIGEST_LENGTH, accept);
+    return 0;
 }
 
-char *ws_generateHTTPResponse(char *key)
+// Writes the 101 response into the caller's buffer. extensions is the
+// negotiated Sec-WebSocket-Extensions value, or NULL.
+// returns the response length, or 0 if it doesn't fit
+size_t ws_generateHTTPResponse(char *response, size_t size, const char *accept, const char *extensions)
 {
-    char *response = malloc(RESPONSE_SIZE);
-
-    snprintf(response, RESPONSE_SIZE,
-             "HTTP/1.1 101 Switching Protocols\r\n"
-             "Upgrade: websocket\r\n"
-             "Connection: Upgrade\r\n"
-             "Sec-WebSocket-Accept: %s\r\n\r\n",
-             key);
-
-    return response;
+    size_t ext_len = extensions ? strlen(extensions) : 0;
+    size_t len = sizeof(response_head) - 1 + WS_ACCEPT_LEN + 2 + (extensions ? 26 + ext_len + 2 : 0) + 2;
+    if (len > size)
+    {
+        return 0;
+    }
+
+    char *p = response;
+    memcpy(p, response_head, sizeof(response_head) - 1);
+    p += sizeof(response_head) - 1;
+    memcpy(p, accept, WS_ACCEPT_LEN);
+    p += WS_ACCEPT_LEN;
+    memcpy(p, "\r\n", 2);
+    p += 2;
+    if (extensions)
+    {
+        memcpy(p, "Sec-WebSocket-Extensions: ", 26);
+        p += 26;
+        memcpy(p, extensions, ext_len);
+        p += ext_len;
+        memcpy(p, "\r\n", 2);
+        p += 2;
+    }
+    memcpy(p, "\r\n", 2);
+    p += 2;
+
+    return p - response;
 }
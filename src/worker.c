@@ -0,0 +1,320 @@
+#include "../include/worker.h"
+#include "../include/log.h"
+#include "../include/pool.h"
+#include "../include/reactor.h"
+
+// A worker's run queue of serial queues waiting for a thread. Each connection
+// has a home worker, so its callbacks tend to stay on one core, but a worker
+// with nothing to do takes whatever another one has queued.
+struct ws_worker
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct ws_serial *head;
+    struct ws_serial *tail;
+};
+
+static struct ws_worker *g_workers;
+static int g_nworkers;
+static size_t g_low_water;
+
+// idle workers sleep until something is queued anywhere
+static atomic_size_t g_pending;
+static atomic_int g_sleepers;
+static pthread_mutex_t g_idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_idle = PTHREAD_COND_INITIALIZER;
+
+static __thread struct ws_conn *t_task_conn;
+static __thread int t_task_corks; // corks the running callback holds on t_task_conn
+
+static struct ws_conn *ws_serial_conn(struct ws_serial *s)
+{
+    return (struct ws_conn *)((char *)s - offsetof(struct ws_conn, serial));
+}
+
+static void ws_serial_submit(struct ws_serial *s)
+{
+    struct ws_worker *w = &g_workers[ws_serial_conn(s)->slot % g_nworkers];
+    s->next = NULL;
+    pthread_mutex_lock(&w->lock);
+    if (w->tail)
+    {
+        w->tail->next = s;
+    }
+    else
+    {
+        w->head = s;
+    }
+    w->tail = s;
+    atomic_fetch_add(&g_pending, 1);
+    pthread_mutex_unlock(&w->lock);
+
+    // pairs with the sleeper raising g_sleepers before it checks g_pending
+    if (atomic_load(&g_sleepers) > 0)
+    {
+        pthread_mutex_lock(&g_idle_lock);
+        pthread_cond_signal(&g_idle);
+        pthread_mutex_unlock(&g_idle_lock);
+    }
+}
+
+static struct ws_serial *ws_worker_pop(struct ws_worker *w)
+{
+    pthread_mutex_lock(&w->lock);
+    struct ws_serial *s = w->head;
+    if (s)
+    {
+        w->head = s->next;
+        if (w->head == NULL)
+        {
+            w->tail = NULL;
+        }
+        atomic_fetch_sub(&g_pending, 1);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return s;
+}
+
+static void ws_task_run(struct ws_task *t)
+{
+    struct ws_conn *conn = t->conn;
+    const ws_callbacks_t *cb = conn->callbacks;
+    ws_conn_t handle = ws_conn_handle(conn);
+
+    switch (t->type)
+    {
+    case WS_TASK_OPEN:
+        cb->on_open(handle);
+        break;
+    case WS_TASK_MESSAGE:
+        cb->on_message(handle, t->arg, t->len > 0 ? (const char *)t->data : "", t->len);
+        break;
+    case WS_TASK_BEGIN:
+        cb->on_message_begin(handle, t->arg);
+        break;
+    case WS_TASK_CHUNK:
+        cb->on_message_chunk(handle, (const char *)t->data, t->len);
+        break;
+    case WS_TASK_END:
+        cb->on_message_end(handle);
+        break;
+    case WS_TASK_DRAIN:
+        cb->on_drain(handle);
+        break;
+    case WS_TASK_ERROR:
+        cb->on_error(handle, t->arg);
+        break;
+    case WS_TASK_CLOSE:
+        cb->on_close(handle);
+        break;
+    }
+}
+
+// Runs the callbacks queued on s so far, oldest first. More that arrive
+// meanwhile are left for another turn, behind the other queues waiting, so a
+// busy connection can't starve the rest.
+static void ws_serial_run(struct ws_serial *s)
+{
+    // s goes with its connection, which the last task may let go of
+    struct ws_conn *owner = ws_serial_conn(s);
+    atomic_fetch_add_explicit(&owner->refs, 1, memory_order_relaxed);
+
+    struct ws_task *t = atomic_exchange_explicit(&s->tasks, NULL, memory_order_acquire);
+    struct ws_task *oldest = NULL;
+    while (t)
+    {
+        struct ws_task *next = t->next;
+        t->next = oldest;
+        oldest = t;
+        t = next;
+    }
+
+    while (oldest)
+    {
+        t = oldest;
+        oldest = t->next;
+        struct ws_conn *conn = t->conn;
+
+        t_task_conn = conn;
+        ws_task_run(t);
+        t_task_conn = NULL;
+        if (t_task_corks > 0)
+        {
+            ws_conn_release_corks(conn, t_task_corks);
+        }
+        t_task_corks = 0;
+
+        // a connection whose reads were paused for this backlog resumes
+        // once it is back down to the low-water mark
+        if (t->len > 0 && atomic_fetch_sub(&conn->task_bytes, t->len) - t->len <= g_low_water &&
+            atomic_load(&conn->rx_paused) && atomic_exchange(&conn->rx_paused, 0))
+        {
+            ws_inbox_kick(conn);
+        }
+        ws_buf_free(t->data);
+        ws_conn_put(conn);
+        free(t);
+    }
+
+    atomic_store(&s->queued, 0);
+    if (atomic_load(&s->tasks) != NULL && !atomic_exchange(&s->queued, 1))
+    {
+        ws_serial_submit(s);
+    }
+    ws_conn_put(owner);
+}
+
+static void *ws_worker_thread(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    while (1)
+    {
+        struct ws_serial *s = ws_worker_pop(&g_workers[id]);
+        for (int i = 1; !s && i < g_nworkers; i++)
+        {
+            s = ws_worker_pop(&g_workers[(id + i) % g_nworkers]);
+        }
+        if (s)
+        {
+            ws_serial_run(s);
+            continue;
+        }
+
+        pthread_mutex_lock(&g_idle_lock);
+        atomic_fetch_add(&g_sleepers, 1);
+        while (atomic_load(&g_pending) == 0)
+        {
+            pthread_cond_wait(&g_idle, &g_idle_lock);
+        }
+        atomic_fetch_sub(&g_sleepers, 1);
+        pthread_mutex_unlock(&g_idle_lock);
+    }
+    return NULL;
+}
+
+int ws_workers_start(int threads, size_t low_water)
+{
+    g_workers = calloc(threads, sizeof(struct ws_worker));
+    if (!g_workers)
+    {
+        ws_log_perror("calloc");
+        return -1;
+    }
+    g_low_water = low_water;
+
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_mutex_init(&g_workers[i].lock, NULL);
+    }
+    // queues may be filled as soon as there is one thread to run them
+    for (int i = 0; i < threads; i++)
+    {
+        if (pthread_create(&g_workers[i].thread, NULL, ws_worker_thread, (void *)(intptr_t)i) != 0)
+        {
+            ws_log_perror("pthread_create");
+            if (i == 0)
+            {
+                return -1;
+            }
+            break;
+        }
+        pthread_detach(g_workers[i].thread);
+        g_nworkers = i + 1;
+    }
+    ws_log_info("%d worker threads running callbacks", g_nworkers);
+    return 0;
+}
+
+int ws_workers_enabled(void) { return g_nworkers > 0; }
+
+// Queues a task for conn and gets a worker to it if no one is on the queue
+// yet. Takes ownership of buf.
+static void ws_dispatch(struct ws_conn *conn, u_int8_t type, int arg, u_int8_t *buf, size_t len)
+{
+    struct ws_serial *s = &conn->serial;
+    struct ws_task *t = malloc(sizeof(struct ws_task));
+    if (!t)
+    {
+        ws_log_error("fd %d: callback dropped", conn->fd);
+        ws_buf_free(buf);
+        return;
+    }
+    atomic_fetch_add_explicit(&conn->refs, 1, memory_order_relaxed);
+    atomic_fetch_add(&conn->task_bytes, len);
+    t->conn = conn;
+    t->type = type;
+    t->arg = arg;
+    t->data = buf;
+    t->len = len;
+
+    struct ws_task *head = atomic_load_explicit(&s->tasks, memory_order_relaxed);
+    do
+    {
+        t->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&s->tasks, &head, t, memory_order_release,
+                                                    memory_order_relaxed));
+    if (!atomic_exchange(&s->queued, 1))
+    {
+        ws_serial_submit(s);
+    }
+}
+
+void ws_callback(struct ws_conn *conn, u_int8_t type, int arg)
+{
+    if (g_nworkers > 0)
+    {
+        ws_dispatch(conn, type, arg, NULL, 0);
+        return;
+    }
+    struct ws_task t = {.conn = conn, .type = type, .arg = arg};
+    ws_task_run(&t);
+}
+
+void ws_callback_take(struct ws_conn *conn, u_int8_t type, int arg, u_int8_t *buf, size_t len)
+{
+    if (g_nworkers > 0)
+    {
+        ws_dispatch(conn, type, arg, buf, len);
+        return;
+    }
+    struct ws_task t = {.conn = conn, .type = type, .arg = arg, .data = buf, .len = len};
+    ws_task_run(&t);
+    ws_buf_free(buf);
+}
+
+void ws_callback_copy(struct ws_conn *conn, u_int8_t type, const u_int8_t *data, size_t len)
+{
+    if (g_nworkers > 0)
+    {
+        u_int8_t *buf = ws_buf_alloc(len);
+        if (!buf)
+        {
+            ws_log_error("fd %d: callback dropped", conn->fd);
+            return;
+        }
+        memcpy(buf, data, len);
+        ws_dispatch(conn, type, 0, buf, len);
+        return;
+    }
+    struct ws_task t = {.conn = conn, .type = type, .data = (u_int8_t *)data, .len = len};
+    ws_task_run(&t);
+}
+
+struct ws_conn *ws_worker_conn(ws_conn_t handle)
+{
+    struct ws_conn *conn = t_task_conn;
+    if (!conn || ws_conn_handle(conn) != handle)
+    {
+        return NULL;
+    }
+    atomic_fetch_add_explicit(&conn->refs, 1, memory_order_relaxed);
+    return conn;
+}
+
+void ws_worker_count_cork(struct ws_conn *conn, int delta)
+{
+    if (conn == t_task_conn)
+    {
+        t_task_corks += delta;
+    }
+}